@@ -1,13 +1,42 @@
+#ifndef AABBH
+#define AABBH
+
 inline float ffmin(float a, float b) { return a < b ? a : b; }
 inline float ffmax(float a, float b) { return a > b ? a : b; }
 
+/*
+    A ray set up for box tests: the reciprocal of its direction and, per
+    axis, which side of a box it enters through, worked out once before a
+    traversal so each box test is subtracts and multiplies only. A zero
+    direction component gives an infinite reciprocal, with the sign of the
+    zero, so the ray is either always inside that slab or never.
+*/
+struct slab_ray {
+    vec3 origin;
+    vec3 inv_dir;
+    int near_side[3]; // 0 enters at the box's min on this axis, 1 at its max
+
+    slab_ray(const ray& r) : origin(r.origin()) {
+        for (int a = 0; a < 3; a++) {
+            inv_dir[a] = 1.0f / r.direction()[a];
+            near_side[a] = inv_dir[a] < 0.0f;
+        }
+    }
+};
+
 class aabb {
     public:
         aabb() {}
         aabb(const vec3& a, const vec3& b) { _min = a; _max = b; }
         vec3 min() const {return _min; }
         vec3 max() const {return _max; }
+        vec3 center() const { return 0.5f*(_min + _max); }
+        float area() const {
+            vec3 d = _max - _min;
+            return 2*(d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
 
+        // the reference test, dividing by the direction for every slab
         bool hit(const ray& r, float tmin, float tmax) const {
             for (int a = 0; a < 3; a++) {
                 float t0 = ffmin((_min[a] - r.origin()[a]) / r.direction()[a],
@@ -20,6 +49,25 @@ class aabb {
             }
             return true;
         }
+        /*
+            Branchless: the entry and exit planes are picked by near_side
+            rather than by swapping, and there is no early out. Where the
+            ray lies in a slab's plane, 0 * inf gives NaN, and putting the
+            axis value first in ffmax/ffmin makes NaN keep the bound, so
+            the ray counts as inside that slab.
+        */
+        bool hit(const slab_ray& r, float tmin, float tmax, float& tnear) const {
+            for (int a = 0; a < 3; a++) {
+                float near = r.near_side[a] ? _max[a] : _min[a];
+                float far = r.near_side[a] ? _min[a] : _max[a];
+                float t0 = (near - r.origin[a]) * r.inv_dir[a];
+                float t1 = (far - r.origin[a]) * r.inv_dir[a];
+                tmin = ffmax(t0, tmin);
+                tmax = ffmin(t1, tmax);
+            }
+            tnear = tmin;
+            return tmin <= tmax;
+        }
 
     vec3 _min;
     vec3 _max;
@@ -37,18 +85,4 @@ aabb surrounding_box(aabb box0, aabb box1) {
     return aabb(small,big);
 }
 
-/*
-    Hit method variation that is quicker on many compilers
-*/
-// inline bool aabb::hit(const ray& r, float tmin, float tmax) const {
-//     for (int a = 0; a < 3; a++) {
-//         float invD = 1.0f / r.direction()[a];
-//         float t0 = (min()[a] - r.origin()[a]) * invD;
-//         float t1 = (max()[a] - r.origin()[a]) * invD;
-//         if (invD < 0.0f) std::swap(t0, t1);
-//         tmin = t0 > tmin ? t0 : tmin;
-//         tmax = t1 < tmax ? t1 : tmax;
-//         if (tmax <= tmin) return false;
-//     }
-//     return true;
-// }
\ No newline at end of file
+#endif
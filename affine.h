@@ -0,0 +1,190 @@
+#ifndef AFFINEH
+#define AFFINEH
+
+#include <math.h>
+
+#include "aabb.h"
+#include "ray.h"
+
+#if defined(__SSE2__)
+#define AFFINE_SSE
+#include <immintrin.h>
+#endif
+
+/*
+    3x4 affine transform: a 3x3 linear part in the first three columns of
+    m and a translation in the last, so a point p maps to A p + t and a
+    direction v to A v. a * b applies b first, then a.
+*/
+struct affine {
+    float m[3][4];
+
+    static affine identity() { return scaling(vec3(1, 1, 1)); }
+    static affine scaling(const vec3& s) {
+        affine x = {{{s.x(), 0, 0, 0}, {0, s.y(), 0, 0}, {0, 0, s.z(), 0}}};
+        return x;
+    }
+    static affine translation(const vec3& offset) {
+        affine x = identity();
+        for (int i = 0; i < 3; i++)
+            x.m[i][3] = offset[i];
+        return x;
+    }
+    // turns x towards -z: the rotation about y for a positive angle
+    static affine rotation_y(float degrees) {
+        float radians = (M_PI / 180) * degrees;
+        float c = cos(radians), s = sin(radians);
+        affine x = {{{c, 0, s, 0}, {0, 1, 0, 0}, {-s, 0, c, 0}}};
+        return x;
+    }
+
+    bool is_identity() const { return translation_only() && m[0][3] == 0 && m[1][3] == 0 && m[2][3] == 0; }
+    bool translation_only() const { return uniform_scale() == 1; }
+    // s where the linear part is s times the identity with s > 0, else 0
+    float uniform_scale() const {
+        float s = m[0][0];
+        if (!(s > 0) || m[1][1] != s || m[2][2] != s)
+            return 0;
+        if (m[0][1] != 0 || m[0][2] != 0 || m[1][0] != 0 || m[1][2] != 0 || m[2][0] != 0 || m[2][1] != 0)
+            return 0;
+        return s;
+    }
+    // a linear part that only scales each axis by a positive factor, so boxes stay boxes
+    bool positive_diagonal() const {
+        return m[0][0] > 0 && m[1][1] > 0 && m[2][2] > 0
+            && m[0][1] == 0 && m[0][2] == 0 && m[1][0] == 0 && m[1][2] == 0 && m[2][0] == 0 && m[2][1] == 0;
+    }
+
+    affine operator*(const affine& b) const {
+        affine x;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                x.m[i][j] = m[i][0]*b.m[0][j] + m[i][1]*b.m[1][j] + m[i][2]*b.m[2][j];
+                if (j == 3)
+                    x.m[i][j] += m[i][3];
+            }
+        }
+        return x;
+    }
+
+    vec3 point(const vec3& p) const {
+        return vec3(m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+                    m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+                    m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+    }
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                    m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                    m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+    }
+    // A^T v: a normal of the far side's space when this transform maps into it from the near side
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+                    m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+                    m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+    }
+    // keeps t: a point at t along r is the point at t along the transformed ray
+    ray apply(const ray& r) const { return ray(point(r.origin()), vector(r.direction()), r.time()); }
+
+    affine inverse() const {
+        float c00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+        float c01 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+        float c02 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+        float inv_det = 1.0f / (m[0][0]*c00 + m[0][1]*c01 + m[0][2]*c02);
+        affine x;
+        x.m[0][0] = c00 * inv_det;
+        x.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+        x.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+        x.m[1][0] = c01 * inv_det;
+        x.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+        x.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+        x.m[2][0] = c02 * inv_det;
+        x.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+        x.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+        for (int i = 0; i < 3; i++)
+            x.m[i][3] = -(x.m[i][0]*m[0][3] + x.m[i][1]*m[1][3] + x.m[i][2]*m[2][3]);
+        return x;
+    }
+
+    // the smallest box around the transformed box: each output axis takes the smaller and larger of every term
+    aabb box(const aabb& b) const {
+        vec3 lo, hi;
+        for (int i = 0; i < 3; i++) {
+            lo[i] = hi[i] = m[i][3];
+            for (int j = 0; j < 3; j++) {
+                float e = m[i][j] * b.min()[j], f = m[i][j] * b.max()[j];
+                lo[i] += ffmin(e, f);
+                hi[i] += ffmax(e, f);
+            }
+        }
+        return aabb(lo, hi);
+    }
+    // the smallest box around the transformed sphere, an ellipsoid whose extent along axis i is r times the length of row i
+    aabb sphere_box(const vec3& center, float radius) const {
+        vec3 c = point(center), e;
+        for (int i = 0; i < 3; i++)
+            e[i] = fabs(radius) * sqrt(m[i][0]*m[i][0] + m[i][1]*m[i][1] + m[i][2]*m[i][2]);
+        return aabb(c - e, c + e);
+    }
+};
+
+/*
+    A transform with everything mapping through it needs, worked out once:
+    the inverse, which moves rays into the object, and the normal matrix,
+    the inverse transposed, which keeps normals perpendicular to surfaces
+    that were scaled or sheared. The inverse is kept again by columns so a
+    ray is moved with four lane SSE multiplies and adds, three per vector.
+*/
+struct alignas(16) affine_frame {
+    float object_columns[4][4]; // to_object's linear columns, then its translation
+    affine to_world, to_object, normal_to_world;
+
+    affine_frame() { set(affine::identity()); }
+    explicit affine_frame(const affine& m) { set(m); }
+    void set(const affine& m) {
+        to_world = m;
+        to_object = m.inverse();
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                normal_to_world.m[i][j] = to_object.m[j][i];
+        for (int i = 0; i < 3; i++)
+            normal_to_world.m[i][3] = 0;
+        for (int j = 0; j < 4; j++) {
+            for (int i = 0; i < 3; i++)
+                object_columns[j][i] = to_object.m[i][j];
+            object_columns[j][3] = 0;
+        }
+    }
+    // this frame applied after inner
+    affine_frame then(const affine& inner) const { return affine_frame(to_world * inner); }
+
+    bool identity() const { return to_world.is_identity(); }
+    vec3 point_to_world(const vec3& p) const { return to_world.point(p); }
+    vec3 vector_to_world(const vec3& v) const { return to_world.vector(v); }
+    vec3 normal_to_world_unit(const vec3& n) const { return unit_vector(normal_to_world.vector(n)); }
+    aabb box_to_world(const aabb& b) const { return to_world.box(b); }
+
+    // keeps t, as affine::apply does, with the same sums in the same order
+    ray ray_to_object(const ray& r) const {
+#ifdef AFFINE_SSE
+        __m128 c0 = _mm_load_ps(object_columns[0]);
+        __m128 c1 = _mm_load_ps(object_columns[1]);
+        __m128 c2 = _mm_load_ps(object_columns[2]);
+        __m128 c3 = _mm_load_ps(object_columns[3]);
+        const vec3& o = r.A;
+        const vec3& d = r.B;
+        __m128 origin = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(o.e[0])),
+            _mm_mul_ps(c1, _mm_set1_ps(o.e[1]))), _mm_mul_ps(c2, _mm_set1_ps(o.e[2]))), c3);
+        __m128 direction = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(d.e[0])),
+            _mm_mul_ps(c1, _mm_set1_ps(d.e[1]))), _mm_mul_ps(c2, _mm_set1_ps(d.e[2])));
+        alignas(16) float ob[4], db[4];
+        _mm_store_ps(ob, origin);
+        _mm_store_ps(db, direction);
+        return ray(vec3(ob[0], ob[1], ob[2]), vec3(db[0], db[1], db[2]), r.time());
+#else
+        return to_object.apply(r);
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef ARENAH
+#define ARENAH
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/*
+    Bump allocator that owns a scene. Shapes, materials and textures made
+    with new while an arena_scope is active on the thread are carved out of
+    large blocks one after another, so things built together (a box, its
+    faces and their list) sit next to each other, without a malloc header
+    between them. release() runs their destructors, newest first, and hands
+    the blocks back in one go, which frees a whole scene without walking its
+    graph or leaving holes in the heap.
+
+    Objects in an arena must not be freed one by one: delete on one only
+    runs its destructor, and its memory stays with the arena until release.
+    With huge_pages, blocks are 2 MB aligned and the kernel is asked to back
+    them with transparent huge pages, which saves TLB misses when a scene
+    is too big for the cache.
+
+    The current arena is per thread. thread_pool::submit hands the
+    submitting thread's arena on to the task, so objects made in pool tasks
+    land in the same arena, and allocation takes a lock to allow for that.
+    release() must not run while anything still allocates.
+*/
+
+const size_t huge_page_size = size_t(1) << 21;
+
+class arena {
+    public:
+        typedef void (*destroy_fn)(void *);
+
+        arena(size_t block_size = size_t(1) << 20, bool huge_pages = false);
+        ~arena();
+        void *allocate(size_t bytes, size_t align = 16);
+        // memory for an object that release() destroys with destroy
+        void *allocate_object(size_t bytes, destroy_fn destroy);
+        // runs the destructors and frees every block
+        void release();
+        // takes p off the destructor list, for objects destroyed by delete
+        void forget(void *p);
+        bool owns(const void *p) const;
+
+        size_t bytes_used() const { return used; }
+        size_t bytes_reserved() const { return reserved; }
+        size_t objects() const { return finalizers.size(); }
+
+        // forget() on the arena that owns p; false if p is not arena memory
+        static bool forget_owned(void *p);
+
+    private:
+        struct block {
+            char *data;
+            size_t size;
+            size_t offset;
+        };
+        struct finalizer {
+            void *object;
+            destroy_fn destroy;
+        };
+
+        block new_block(size_t min_size);
+        void *allocate_locked(size_t bytes, size_t align);
+
+        std::vector<block> blocks;
+        std::vector<finalizer> finalizers;
+        size_t block_size;
+        bool huge_pages;
+        size_t used;
+        size_t reserved;
+        mutable std::mutex mutex; // blocks and finalizers, for pool tasks that share the arena
+
+        // every live arena, so delete can tell arena memory from the heap
+        static std::vector<arena *>& registry() {
+            static std::vector<arena *> arenas;
+            return arenas;
+        }
+        static std::mutex& registry_mutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        arena(const arena&);
+        arena& operator=(const arena&);
+};
+
+arena::arena(size_t size, bool huge) : block_size(size), huge_pages(huge), used(0), reserved(0) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().push_back(this);
+}
+
+arena::~arena() {
+    release();
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().erase(std::find(registry().begin(), registry().end(), this));
+}
+
+arena::block arena::new_block(size_t min_size) {
+    block b;
+    b.size = std::max(block_size, min_size);
+    b.offset = 0;
+    if (huge_pages) {
+        b.size = (b.size + huge_page_size - 1) & ~(huge_page_size - 1);
+        b.data = (char *)aligned_alloc(huge_page_size, b.size);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (b.data)
+            madvise(b.data, b.size, MADV_HUGEPAGE);
+#endif
+    } else {
+        b.data = (char *)malloc(b.size);
+    }
+    if (!b.data)
+        throw std::bad_alloc();
+    reserved += b.size;
+    return b;
+}
+
+void *arena::allocate(size_t bytes, size_t align) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocate_locked(bytes, align);
+}
+
+void *arena::allocate_locked(size_t bytes, size_t align) {
+    size_t offset = 0;
+    if (!blocks.empty()) {
+        const block& b = blocks.back();
+        uintptr_t base = uintptr_t(b.data);
+        offset = ((base + b.offset + align - 1) & ~uintptr_t(align - 1)) - base;
+    }
+    if (blocks.empty() || offset + bytes > blocks.back().size) {
+        blocks.push_back(new_block(bytes + align));
+        uintptr_t base = uintptr_t(blocks.back().data);
+        offset = ((base + align - 1) & ~uintptr_t(align - 1)) - base;
+    }
+    blocks.back().offset = offset + bytes;
+    used += bytes;
+    return blocks.back().data + offset;
+}
+
+void *arena::allocate_object(size_t bytes, destroy_fn destroy) {
+    std::lock_guard<std::mutex> lock(mutex);
+    void *p = allocate_locked(bytes, 16);
+    finalizer f = {p, destroy};
+    finalizers.push_back(f);
+    return p;
+}
+
+void arena::release() {
+    for (size_t i = finalizers.size(); i > 0; i--)
+        if (finalizers[i-1].destroy)
+            finalizers[i-1].destroy(finalizers[i-1].object);
+    finalizers.clear();
+    for (const block& b : blocks)
+        free(b.data);
+    blocks.clear();
+    used = reserved = 0;
+}
+
+void arena::forget(void *p) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = finalizers.size(); i > 0; i--) {
+        if (finalizers[i-1].object == p) {
+            finalizers[i-1].destroy = NULL;
+            return;
+        }
+    }
+}
+
+bool arena::owns(const void *p) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const block& b : blocks)
+        if (p >= b.data && p < b.data + b.size)
+            return true;
+    return false;
+}
+
+bool arena::forget_owned(void *p) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    for (arena *a : registry()) {
+        if (a->owns(p)) {
+            a->forget(p);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline arena *&current_arena() {
+    static thread_local arena *a = NULL;
+    return a;
+}
+
+// makes a the current arena of this thread until the scope ends; NULL means the heap
+class arena_scope {
+    public:
+        arena_scope(arena& a) : previous(current_arena()) { current_arena() = &a; }
+        explicit arena_scope(arena *a) : previous(current_arena()) { current_arena() = a; }
+        ~arena_scope() { current_arena() = previous; }
+    private:
+        arena *previous;
+};
+
+/*
+    Allocation for the scene classes' operator new and delete: from the
+    current arena when there is one, from the heap otherwise. T is the base
+    class, whose virtual destructor release() calls.
+*/
+template <class T>
+void destroy_scene_object(void *p) {
+    static_cast<T *>(p)->~T();
+}
+
+template <class T>
+void *scene_new(size_t bytes) {
+    if (arena *a = current_arena())
+        return a->allocate_object(bytes, destroy_scene_object<T>);
+    return ::operator new(bytes);
+}
+
+inline void scene_delete(void *p) {
+    if (p && !arena::forget_owned(p))
+        ::operator delete(p);
+}
+
+// n uninitialized Ts that need no destructor, such as pointer lists
+template <class T>
+T *scene_array(size_t n) {
+    if (arena *a = current_arena())
+        return static_cast<T *>(a->allocate(n * sizeof(T), alignof(T)));
+    return new T[n];
+}
+
+#endif
@@ -0,0 +1,1466 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compiled_scene.h"
+#include "random.h"
+#include "render.h"
+#include "scenes.h"
+#include "sphere_set.h"
+#include "vec3a.h"
+#include "wavefront.h"
+#include "wide_bvh.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+/*
+    Benchmarks for the renderer. Run ./bench to run all of them or
+    ./bench <name> ... to pick some.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+std::vector<unsigned long> thread_counts() {
+    unsigned long hardware_threads = std::thread::hardware_concurrency();
+    if (hardware_threads == 0) hardware_threads = 2;
+    std::vector<unsigned long> counts;
+    for (unsigned long t = 1; t < hardware_threads; t *= 2)
+        counts.push_back(t);
+    counts.push_back(hardware_threads);
+    return counts;
+}
+
+// runs f(thread_index) on n threads and returns the wall time in seconds
+double time_threads(unsigned long n, const std::function<void(unsigned long)>& f) {
+    std::vector<std::thread> threads;
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long t = 0; t < n; t++)
+        threads.push_back(std::thread(f, t));
+    for (unsigned long t = 0; t < n; t++)
+        threads[t].join();
+    return seconds_since(start);
+}
+
+/*
+    Rays from random points on a sphere around the box towards random points
+    inside it, so most of them have to traverse the scene.
+*/
+std::vector<ray> bench_rays(int n, const aabb& target) {
+    std::vector<ray> rays;
+    rays.reserve(n);
+    vec3 center = target.center();
+    float radius = 0.5f * (target.max() - target.min()).length() * 1.5f;
+    vec3 extent = target.max() - target.min();
+    for (int i = 0; i < n; i++) {
+        vec3 origin = center + radius*unit_vector(random_in_unit_sphere());
+        vec3 goal = target.min() + vec3(random_float()*extent.x(), random_float()*extent.y(), random_float()*extent.z());
+        rays.push_back(ray(origin, goal - origin, random_float()));
+    }
+    return rays;
+}
+
+// closest hit throughput in Mrays/s; hits counts the rays that hit something
+double trace_rays(hitable *world, const std::vector<ray>& rays, int& hits) {
+    hit_record rec;
+    hits = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (const ray& r : rays)
+        if (world->hit(r, 0.001, FLT_MAX, rec)) hits++;
+    return rays.size() / seconds_since(start) / 1e6;
+}
+
+float libc_random_float() {
+    // the generator the renderer used before random.h
+    return ((float) rand() / (RAND_MAX));
+}
+
+void bench_rng() {
+    const int per_thread = 1 << 22;
+    std::cout << "rng: Msamples/s, " << per_thread << " samples per thread" << std::endl;
+    std::cout << "threads\trand()\tpcg32" << std::endl;
+    for (unsigned long n : thread_counts()) {
+        volatile float sink = 0;
+        double libc = time_threads(n, [&](unsigned long t) {
+            float acc = 0;
+            for (int i = 0; i < per_thread; i++) acc += libc_random_float();
+            sink = acc;
+        });
+        double pcg = time_threads(n, [&](unsigned long t) {
+            seed_thread_rng(t, 0);
+            float acc = 0;
+            for (int i = 0; i < per_thread; i++) acc += random_float();
+            sink = acc;
+        });
+        double samples = double(n) * per_thread / 1e6;
+        std::cout << n << "\t" << samples / libc << "\t" << samples / pcg << std::endl;
+    }
+}
+
+void bench_render() {
+    unsigned char *tex_data;
+    seed_thread_rng(0, 0);
+    hitable *world = random_scene(&tex_data);
+    camera cam(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 2.0, 0.0, 10.0, 0.0, 1.0);
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    settings.ns = 4;
+    std::vector<unsigned char> image(settings.nx*settings.ny*3);
+
+    std::cout << "render: random_scene " << settings.nx << "x" << settings.ny << " " << settings.ns << " spp" << std::endl;
+    std::cout << "threads\tseconds\tMrays/s (camera rays)" << std::endl;
+    for (unsigned long n : thread_counts()) {
+        settings.threads = n;
+        bench_clock::time_point start = bench_clock::now();
+        render(world, NULL, cam, settings, &image[0]);
+        double seconds = seconds_since(start);
+        double rays = double(settings.nx) * settings.ny * settings.ns / 1e6;
+        std::cout << n << "\t" << seconds << "\t" << rays / seconds << std::endl;
+    }
+}
+
+void bench_tiles() {
+    seed_thread_rng(0, 0);
+    hitable *lights;
+    hitable *world = final(&lights);
+    camera cam(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0);
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    settings.ns = 4;
+    std::vector<unsigned char> image(settings.nx*settings.ny*3);
+
+    std::cout << "tiles: final " << settings.nx << "x" << settings.ny << " " << settings.ns << " spp, busy and idle seconds summed over threads" << std::endl;
+    std::cout << "tile\tseconds\tbusy\tidle\tstolen" << std::endl;
+    for (int tile_size = 8; tile_size <= 64; tile_size *= 2) {
+        settings.tile_size = tile_size;
+        bench_clock::time_point start = bench_clock::now();
+        std::vector<thread_load> load = render(world, lights, cam, settings, &image[0]).load;
+        double seconds = seconds_since(start);
+        thread_load total;
+        for (const thread_load& l : load) {
+            total.busy_seconds += l.busy_seconds;
+            total.idle_seconds += l.idle_seconds;
+            total.stolen += l.stolen;
+        }
+        std::cout << tile_size << "\t" << seconds << "\t" << total.busy_seconds << "\t" << total.idle_seconds << "\t" << total.stolen << std::endl;
+    }
+}
+
+void bench_roulette() {
+    unsigned char *tex_data;
+    seed_thread_rng(0, 0);
+    hitable *lights[2];
+    hitable *scenes[2] = {random_scene(&tex_data, &lights[0]), final(&lights[1])};
+    camera cams[2] = {
+        camera(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 2.0, 0.0, 10.0, 0.0, 1.0),
+        camera(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0),
+    };
+    const char *names[2] = {"random_scene", "final"};
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    settings.ns = 4;
+    std::vector<unsigned char> image(settings.nx*settings.ny*3);
+
+    std::cout << "roulette: seconds and average path length by Russian roulette start depth" << std::endl;
+    std::cout << "scene\trr start\tseconds\tpath length" << std::endl;
+    int starts[] = {1, 3, 5, 10, settings.max_depth + 1};
+    for (int s = 0; s < 2; s++) {
+        for (int start : starts) {
+            settings.rr_start_depth = start;
+            bench_clock::time_point begin = bench_clock::now();
+            render_stats stats = render(scenes[s], lights[s], cams[s], settings, &image[0]);
+            std::cout << names[s] << "\t" << (start > settings.max_depth ? std::string("off") : std::to_string(start)) << "\t"
+                      << seconds_since(begin) << "\t" << stats.average_path_length() << std::endl;
+        }
+    }
+}
+
+double image_mse(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b) {
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        double d = double(a[i]) - double(b[i]);
+        sum += d*d;
+    }
+    return sum / a.size();
+}
+
+/*
+    Equal time comparison of BSDF sampling alone against next event
+    estimation with MIS on final(). Each mode gets the samples per pixel that
+    fit in the time one pass of base_spp takes with NEE, and its error is
+    measured against a high sample count reference.
+*/
+void bench_nee() {
+    seed_thread_rng(0, 0);
+    hitable *lights;
+    hitable *world = final(&lights);
+    camera cam(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0);
+
+    render_settings settings;
+    settings.nx = 100;
+    settings.ny = 50;
+    std::vector<unsigned char> reference(settings.nx*settings.ny*3), image(reference.size());
+    settings.ns = 1024;
+    settings.seed = 1;
+    render(world, lights, cam, settings, &reference[0]);
+
+    const int base_spp = 16;
+    std::cout << "nee: final " << settings.nx << "x" << settings.ny << ", mean squared error against a " << settings.ns << " spp reference" << std::endl;
+    std::cout << "mode\tspp\tseconds\tMSE" << std::endl;
+    double budget = 0;
+    for (int nee = 1; nee >= 0; nee--) {
+        settings.light_sampling = nee;
+        settings.seed = 2;
+        settings.ns = 4;
+        bench_clock::time_point start = bench_clock::now();
+        render(world, lights, cam, settings, &image[0]);
+        double per_spp = seconds_since(start) / settings.ns;
+        if (nee)
+            budget = per_spp * base_spp;
+        settings.ns = std::max(1, int(budget / per_spp + 0.5));
+        start = bench_clock::now();
+        render(world, lights, cam, settings, &image[0]);
+        std::cout << (nee ? "nee+mis" : "bsdf") << "\t" << settings.ns << "\t" << seconds_since(start) << "\t" << image_mse(image, reference) << std::endl;
+    }
+}
+
+void bench_bvh_scene(const std::string& name, std::vector<hitable *> list) {
+    const char *split_names[] = {"median", "sah"};
+    bvh_split splits[] = {bvh_split_median, bvh_split_sah};
+    for (int i = 0; i < 2; i++) {
+        std::vector<hitable *> prims = list;
+        bench_clock::time_point start = bench_clock::now();
+        bvh_node *bvh = new bvh_node(&prims[0], int(prims.size()), 0.0, 1.0, splits[i]);
+        double build = seconds_since(start);
+
+        seed_thread_rng(1, 0);
+        std::vector<ray> rays = bench_rays(200000, bvh->box);
+        int hits;
+        double mrays = trace_rays(bvh, rays, hits);
+        std::cout << name << "\t" << split_names[i] << "\t" << build << "\t" << mrays << "\t" << bvh->stats() << std::endl;
+    }
+
+    std::vector<hitable *> prims = list;
+    bench_clock::time_point start = bench_clock::now();
+    linear_bvh *bvh = new linear_bvh(&prims[0], int(prims.size()), 0.0, 1.0);
+    double build = seconds_since(start);
+
+    seed_thread_rng(1, 0);
+    std::vector<ray> rays = bench_rays(200000, bvh->nodes[0].box);
+    int hits;
+    double mrays = trace_rays(bvh, rays, hits);
+    std::cout << name << "\tlinear\t" << build << "\t" << mrays << "\t" << bvh->stats << std::endl;
+}
+
+void bench_bvh() {
+    std::cout << "bvh: build seconds, closest hit Mrays/s and tree quality" << std::endl;
+    std::cout << "scene\tsplit\tbuild\tMrays/s\ttree" << std::endl;
+
+    unsigned char *tex_data;
+    int n;
+    seed_thread_rng(0, 0);
+    hitable **list = random_scene_list(&tex_data, n);
+    bench_bvh_scene("random_scene", std::vector<hitable *>(list, list + n));
+    for (int size = 10000; size <= 1000000; size *= 10) {
+        seed_thread_rng(0, 0);
+        bench_bvh_scene("cloud " + std::to_string(size), sphere_cloud(size));
+    }
+}
+
+/*
+    The slab test traversal used before slab_ray: a reciprocal per ray, then
+    a swap on the sign of each axis and an early out.
+*/
+inline bool slab_hit_swap(const aabb& box, const vec3& origin, const vec3& inv_dir, float tmin, float tmax, float& tnear) {
+    for (int a = 0; a < 3; a++) {
+        float t0 = (box._min[a] - origin[a]) * inv_dir[a];
+        float t1 = (box._max[a] - origin[a]) * inv_dir[a];
+        if (inv_dir[a] < 0.0f) std::swap(t0, t1);
+        tmin = ffmax(t0, tmin);
+        tmax = ffmin(t1, tmax);
+        if (tmax < tmin) return false;
+    }
+    tnear = tmin;
+    return true;
+}
+
+// linear_bvh::intersect as it was with slab_hit_swap
+bool swap_traversal_hit(const linear_bvh& bvh, const ray& r, float t_min, float t_max, hit_record& rec) {
+    vec3 origin = r.origin();
+    vec3 inv_dir(1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z());
+    float tnear;
+    if (!slab_hit_swap(bvh.nodes[0].box, origin, inv_dir, t_min, t_max, tnear))
+        return false;
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    bool hit_anything = false;
+    for (;;) {
+        const linear_bvh_node& node = bvh.nodes[index];
+        if (node.count > 0) {
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                if (bvh.prims[i]->intersect(r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = slab_hit_swap(bvh.nodes[near_child].box, origin, inv_dir, t_min, t_max, t_near);
+            bool hit_far = slab_hit_swap(bvh.nodes[far_child].box, origin, inv_dir, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+    return hit_anything;
+}
+
+/*
+    Box tests alone, every ray against every node box of a scene's
+    linear_bvh: aabb::hit dividing for each slab, slab_hit_swap, and the
+    branchless test on a slab_ray, which includes setting it up. A third
+    of the rays run parallel to one or two axes, with the origin on the
+    plane of some node's box on those axes, so infinite and NaN distances
+    are tested too; those rays count as inside the slab they lie on, where
+    aabb::hit counts them as missing it. Most of those boxes are missed,
+    which favours an early out, so closest hit traversal of linear_bvh is
+    timed with both slab tests as well: there about half the boxes tested
+    are hit.
+*/
+void bench_slab_scene(const std::string& name, std::vector<hitable *> list) {
+    std::vector<hitable *> prims = list;
+    linear_bvh accel(&prims[0], int(prims.size()), 0, 1);
+    seed_thread_rng(1, 0);
+    std::vector<ray> rays = bench_rays(std::max(200, 40000000 / accel.node_count), accel.nodes[0].box);
+    for (size_t i = 0; i < rays.size(); i += 3) {
+        const aabb& box = accel.nodes[int(random_float() * accel.node_count)].box;
+        vec3 origin = rays[i].origin(), direction = rays[i].direction();
+        for (int a = int(random_float() * 3), axes = 0; axes < 1 + int(i % 2); a = (a + 1) % 3, axes++) {
+            origin[a] = box._min[a];
+            direction[a] = axes ? -0.0f : 0.0f;
+        }
+        rays[i] = ray(origin, direction, rays[i].time());
+    }
+
+    const char *tests[3] = {"aabb::hit", "slab_hit_swap", "slab_ray"};
+    long hits[3];
+    double rate[3];
+    for (int round = 0; round < 3; round++) {
+        for (int m = 0; m < 3; m++) {
+            long count = 0;
+            float tnear;
+            bench_clock::time_point start = bench_clock::now();
+            for (const ray& r : rays) {
+                if (m == 0) {
+                    for (int i = 0; i < accel.node_count; i++)
+                        count += accel.nodes[i].box.hit(r, 0.001f, FLT_MAX);
+                } else if (m == 1) {
+                    vec3 inv_dir(1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z());
+                    for (int i = 0; i < accel.node_count; i++)
+                        count += slab_hit_swap(accel.nodes[i].box, r.origin(), inv_dir, 0.001f, FLT_MAX, tnear);
+                } else {
+                    slab_ray sr(r);
+                    for (int i = 0; i < accel.node_count; i++)
+                        count += accel.nodes[i].box.hit(sr, 0.001f, FLT_MAX, tnear);
+                }
+            }
+            double tests_per_second = double(rays.size()) * accel.node_count / seconds_since(start) / 1e6;
+            if (round == 0 || tests_per_second > rate[m])
+                rate[m] = tests_per_second;
+            hits[m] = count;
+        }
+    }
+
+    seed_thread_rng(2, 0);
+    rays = bench_rays(200000, accel.nodes[0].box);
+    double traversal[3];
+    int traversal_hits[3];
+    for (int round = 0; round < 3; round++) {
+        for (int m = 1; m < 3; m++) {
+            hit_record rec;
+            int count = 0;
+            bench_clock::time_point start = bench_clock::now();
+            for (const ray& r : rays)
+                count += m == 1 ? swap_traversal_hit(accel, r, 0.001, FLT_MAX, rec) : accel.intersect(r, 0.001, FLT_MAX, rec);
+            double mrays = rays.size() / seconds_since(start) / 1e6;
+            if (round == 0 || mrays > traversal[m])
+                traversal[m] = mrays;
+            traversal_hits[m] = count;
+        }
+    }
+    for (int m = 0; m < 3; m++) {
+        std::cout << name << "\t" << tests[m] << "\t" << rate[m] << "\t" << hits[m] << "\t";
+        if (m == 0)
+            std::cout << "-\t-" << std::endl;
+        else
+            std::cout << traversal[m] << "\t" << traversal_hits[m] << std::endl;
+    }
+}
+
+void bench_slab() {
+    std::cout << "slab: box tests on every node of a scene's BVH and closest hit traversal of 200K rays, best of 3" << std::endl;
+    std::cout << "scene\ttest\tMtests/s\thits\tMrays/s\thits" << std::endl;
+    unsigned char *tex_data;
+    int n;
+    seed_thread_rng(0, 0);
+    hitable **list = random_scene_list(&tex_data, n);
+    bench_slab_scene("random_scene", std::vector<hitable *>(list, list + n));
+    hitable *lights;
+    linear_bvh *final_scene = dynamic_cast<linear_bvh *>(final(&lights));
+    bench_slab_scene("final", final_scene->prims);
+    seed_thread_rng(0, 0);
+    bench_slab_scene("cloud 100000", sphere_cloud(100000));
+}
+
+template <class accel>
+void bench_accel(const char *name, std::vector<hitable *> list, const std::vector<ray>& rays) {
+    bench_clock::time_point start = bench_clock::now();
+    accel *a = new accel(&list[0], int(list.size()), 0.0, 1.0);
+    double build = seconds_since(start);
+    int hits;
+    double mrays = trace_rays(a, rays, hits);
+    std::cout << "\t" << name << "\t" << build << "\t" << mrays << "\t" << hits << std::endl;
+    delete a;
+}
+
+void bench_wide() {
+    std::cout << "wide: binary vs 4 and 8 wide BVH, build seconds and closest hit Mrays/s" << std::endl;
+    {
+        hitable *l[1] = {new sphere(vec3(0,0,0), 1, NULL)};
+        std::cout << "bvh4 kernel " << bvh4(l, 1, 0, 1).kernel << ", bvh8 kernel " << bvh8(l, 1, 0, 1).kernel << std::endl;
+    }
+    std::cout << "prims\tbvh\tbuild\tMrays/s\thits" << std::endl;
+    for (int size = 1000; size <= 1000000; size *= 10) {
+        seed_thread_rng(0, 0);
+        std::vector<hitable *> list = sphere_cloud(size);
+        std::vector<ray> rays = bench_rays(200000, aabb(vec3(-50,-50,-50), vec3(50,50,50)));
+        std::cout << size << std::endl;
+        bench_accel<linear_bvh>("binary", list, rays);
+        bench_accel<bvh4>("bvh4", list, rays);
+        bench_accel<bvh8>("bvh8", list, rays);
+    }
+}
+
+/*
+    Times one vector operation over arrays of operands for vec3 and vec3a.
+    Results go to an array that is summed afterwards, so the loops measure
+    throughput and are not optimized away.
+*/
+template <class V, class F>
+double time_vec_op(const std::vector<V>& a, const std::vector<V>& b, int passes, F op) {
+    std::vector<float> out(a.size());
+    bench_clock::time_point start = bench_clock::now();
+    for (int p = 0; p < passes; p++) {
+        for (size_t i = 0; i < a.size(); i++)
+            out[i] = op(a[i], b[i]);
+        asm volatile("" ::: "memory"); // keep every pass
+    }
+    double seconds = seconds_since(start);
+    volatile float sink = 0;
+    for (float f : out) sink = sink + f;
+    return seconds * 1e9 / (double(a.size()) * passes);
+}
+
+template <class V>
+std::vector<double> time_vec_ops(const std::vector<V>& a, const std::vector<V>& b, int passes) {
+    std::vector<double> ns;
+    ns.push_back(time_vec_op(a, b, passes, [](const V& u, const V& v) { return dot(u, v); }));
+    ns.push_back(time_vec_op(a, b, passes, [](const V& u, const V& v) { return cross(u, v).x(); }));
+    ns.push_back(time_vec_op(a, b, passes, [](const V& u, const V& v) { return unit_vector(u).y(); }));
+    ns.push_back(time_vec_op(a, b, passes, [](const V& u, const V& v) { return (u / v.x()).z(); }));
+    ns.push_back(time_vec_op(a, b, passes, [](const V& u, const V& v) { return (u + v*0.5f - u*v).x(); }));
+    // the sphere test: discriminant of a ray from u along v against a unit sphere
+    ns.push_back(time_vec_op(a, b, passes, [](const V& u, const V& v) {
+        float b = dot(u, v);
+        return b*b - dot(v, v)*(dot(u, u) - 1);
+    }));
+    return ns;
+}
+
+void bench_vec() {
+    const int n = 1 << 12, passes = 2000;
+    std::vector<vec3> a, b;
+    std::vector<vec3a> aa, ba;
+    seed_thread_rng(0, 0);
+    for (int i = 0; i < n; i++) {
+        a.push_back(random_in_unit_sphere() + vec3(2, 2, 2));
+        b.push_back(random_in_unit_sphere() + vec3(2, 2, 2));
+        aa.push_back(vec3a(a.back()));
+        ba.push_back(vec3a(b.back()));
+    }
+#ifdef VEC3A_SSE
+    const char *isa = "sse2";
+#else
+    const char *isa = "scalar";
+#endif
+    std::cout << "vec: ns per operation, vec3 against vec3a (" << isa << ")" << std::endl;
+    std::cout << "op\tvec3\tvec3a" << std::endl;
+    const char *names[] = {"dot", "cross", "unit", "div", "madd", "sphere"};
+    std::vector<double> scalar = time_vec_ops(a, b, passes);
+    std::vector<double> simd = time_vec_ops(aa, ba, passes);
+    for (size_t i = 0; i < scalar.size(); i++)
+        std::cout << names[i] << "\t" << scalar[i] << "\t" << simd[i] << std::endl;
+}
+
+/*
+    Shadow segments from outside the scene to points inside it (t_max = 1),
+    answered with the closest hit query and with occluded(). Both columns
+    count the blocked segments, which have to agree.
+*/
+void bench_occlusion_accel(const std::string& name, hitable *accel, const std::vector<ray>& rays) {
+    hit_record rec;
+    int hits = 0, blocked = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (const ray& r : rays)
+        if (accel->hit(r, 0.001, 1, rec)) hits++;
+    double hit_mrays = rays.size() / seconds_since(start) / 1e6;
+    start = bench_clock::now();
+    for (const ray& r : rays)
+        if (accel->occluded(r, 0.001, 1)) blocked++;
+    double occluded_mrays = rays.size() / seconds_since(start) / 1e6;
+    std::cout << name << "\t" << hit_mrays << "\t" << occluded_mrays << "\t" << occluded_mrays / hit_mrays << "\t" << hits << "\t" << blocked << std::endl;
+}
+
+void bench_occlusion() {
+    std::cout << "occlusion: shadow segments, Mrays/s for hit() and occluded()" << std::endl;
+    std::cout << "scene\thit\toccluded\tspeedup\thits\tblocked" << std::endl;
+
+    unsigned char *tex_data;
+    int n;
+    seed_thread_rng(0, 0);
+    hitable **list = random_scene_list(&tex_data, n);
+    std::vector<std::pair<std::string, std::vector<hitable *> > > scenes;
+    scenes.push_back(std::make_pair(std::string("random_scene"), std::vector<hitable *>(list, list + n)));
+    for (int size = 10000; size <= 1000000; size *= 10) {
+        seed_thread_rng(0, 0);
+        scenes.push_back(std::make_pair("cloud " + std::to_string(size), sphere_cloud(size)));
+    }
+    for (auto& scene : scenes) {
+        linear_bvh *binary = new linear_bvh(&scene.second[0], int(scene.second.size()), 0.0, 1.0);
+        bvh8 *wide = new bvh8(&scene.second[0], int(scene.second.size()), 0.0, 1.0);
+        seed_thread_rng(1, 0);
+        std::vector<ray> rays = bench_rays(200000, binary->nodes[0].box);
+        bench_occlusion_accel(scene.first + " linear", binary, rays);
+        bench_occlusion_accel(scene.first + " bvh8", wide, rays);
+        delete binary;
+        delete wide;
+    }
+
+    seed_thread_rng(0, 0);
+    hitable *world = final();
+    aabb box;
+    world->bounding_box(0, 1, box);
+    seed_thread_rng(1, 0);
+    bench_occlusion_accel("final", world, bench_rays(200000, box));
+}
+
+/*
+    The same random clouds as sphere pointers in linear_bvh and bvh8 and as
+    a sphere_set: build seconds, bytes per sphere (objects, pointers and tree)
+    and closest hit Mrays/s, then a save and load round trip of the set.
+*/
+void bench_spheres() {
+    std::cout << "spheres: pointer spheres vs sphere_set" << std::endl;
+    std::vector<material *> materials(1, new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73))));
+    {
+        sphere_set probe(materials);
+        std::cout << "sphere_set kernel " << probe.kernel << std::endl;
+    }
+    std::cout << "spheres\taccel\tbuild\tbytes/sphere\tMrays/s\thits" << std::endl;
+    for (int size = 100000; size <= 1000000; size *= 10) {
+        seed_thread_rng(0, 0);
+        std::vector<hitable *> list = sphere_cloud(size);
+        seed_thread_rng(1, 0);
+        std::vector<ray> rays = bench_rays(200000, aabb(vec3(-50,-50,-50), vec3(50,50,50)));
+        size_t objects = size_t(size) * (sizeof(sphere) + sizeof(hitable *));
+        int hits;
+
+        bench_clock::time_point start = bench_clock::now();
+        linear_bvh *binary = new linear_bvh(&list[0], size, 0.0, 1.0);
+        double build = seconds_since(start);
+        double mrays = trace_rays(binary, rays, hits);
+        std::cout << size << "\tlinear\t" << build << "\t" << double(objects + binary->stats.bytes) / size << "\t" << mrays << "\t" << hits << std::endl;
+        delete binary;
+
+        start = bench_clock::now();
+        bvh8 *wide = new bvh8(&list[0], size, 0.0, 1.0);
+        build = seconds_since(start);
+        mrays = trace_rays(wide, rays, hits);
+        std::cout << size << "\tbvh8\t" << build << "\t" << double(objects + wide->node_count*sizeof(wide_bvh_node<8>) + wide->prims.size()*sizeof(hitable *)) / size << "\t" << mrays << "\t" << hits << std::endl;
+        delete wide;
+
+        sphere_set *set = new sphere_set(materials);
+        for (hitable *h : list) {
+            sphere *s = (sphere *)h;
+            set->add(s->center, s->radius, 0);
+        }
+        start = bench_clock::now();
+        set->build();
+        build = seconds_since(start);
+        mrays = trace_rays(set, rays, hits);
+        std::cout << size << "\tsphere_set\t" << build << "\t" << double(set->stats.bytes) / size << "\t" << mrays << "\t" << hits << std::endl;
+
+        const char *path = "/tmp/bench_spheres.sphs";
+        start = bench_clock::now();
+        set->save(path);
+        double save = seconds_since(start);
+        sphere_set loaded(materials);
+        start = bench_clock::now();
+        loaded.load(path);
+        double load = seconds_since(start);
+        remove(path);
+        std::cout << size << "\tfile\tsave " << save << " s, load " << load << " s, " << size / load / 1e6 << " M spheres/s" << std::endl;
+        delete set;
+        for (hitable *h : list)
+            delete h;
+    }
+}
+
+/*
+    Camera rays for every pixel of a 3840x2160 image, one per pixel, traced
+    one at a time and in packets of packet_size along each row, then shadow
+    rays from the hit points towards the lights the same two ways. The hit
+    counts have to agree; so do the blocked counts, except where fog
+    (constant_medium) decides at random whether it stops a ray.
+*/
+void bench_packets_scene(const std::string& name, hitable *world, hitable *lights, camera& cam) {
+    const int nx = 3840, ny = 2160;
+    std::vector<ray> rays;
+    rays.reserve(nx * ny);
+    seed_thread_rng(1, 0);
+    for (int j = 0; j < ny; j++)
+        for (int i = 0; i < nx; i++)
+            rays.push_back(cam.get_ray((i + 0.5f) / nx, (j + 0.5f) / ny));
+
+    std::vector<hit_record> single(rays.size());
+    std::vector<char> single_hit(rays.size());
+    int hits = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t k = 0; k < rays.size(); k++)
+        if ((single_hit[k] = world->hit(rays[k], 0.001, FLT_MAX, single[k]))) hits++;
+    double single_mrays = rays.size() / seconds_since(start) / 1e6;
+
+    int packet_hits = 0, mismatches = 0;
+    hit_record rec[packet_size];
+    start = bench_clock::now();
+    for (size_t k = 0; k < rays.size(); k += packet_size) {
+        ray_packet packet;
+        for (int i = 0; i < packet_size; i++)
+            packet.set(i, rays[k + i], FLT_MAX);
+        packet.prepare();
+        int mask = world->hit_packet(packet, 0.001, rec);
+        packet_hits += __builtin_popcount(mask);
+        for (int i = 0; i < packet_size; i++)
+            if (((mask >> i) & 1) != single_hit[k + i] || (single_hit[k + i] && rec[i].t != single[k + i].t)) mismatches++;
+    }
+    double packet_mrays = rays.size() / seconds_since(start) / 1e6;
+    std::cout << name << "\tprimary\t" << single_mrays << "\t" << packet_mrays << "\t" << packet_mrays / single_mrays
+              << "\t" << hits << "\t" << packet_hits << "\t" << mismatches << std::endl;
+
+    // shadow segments towards a point on the lights, from every pixel that hit something
+    std::vector<ray> shadow;
+    seed_thread_rng(2, 0);
+    for (size_t k = 0; k < rays.size(); k++) {
+        vec3 p = single_hit[k] ? single[k].p : rays[k].origin();
+        shadow.push_back(ray(p, lights->random(p), rays[k].time()));
+    }
+    int blocked = 0;
+    start = bench_clock::now();
+    for (const ray& r : shadow)
+        if (world->occluded(r, 0.001, 0.999)) blocked++;
+    single_mrays = shadow.size() / seconds_since(start) / 1e6;
+    int packet_blocked = 0;
+    start = bench_clock::now();
+    for (size_t k = 0; k < shadow.size(); k += packet_size) {
+        ray_packet packet;
+        for (int i = 0; i < packet_size; i++)
+            packet.set(i, shadow[k + i], 0.999);
+        packet.prepare();
+        packet_blocked += __builtin_popcount(world->occluded_packet(packet, 0.001));
+    }
+    packet_mrays = shadow.size() / seconds_since(start) / 1e6;
+    std::cout << name << "\tshadow\t" << single_mrays << "\t" << packet_mrays << "\t" << packet_mrays / single_mrays
+              << "\t" << blocked << "\t" << packet_blocked << "\t-" << std::endl;
+}
+
+void bench_packets() {
+    std::cout << "packets: 4K camera and shadow rays, single ray vs packet Mrays/s" << std::endl;
+    {
+        linear_bvh empty;
+        std::cout << "packet kernel " << empty.packet_kernel << ", " << packet_size << " rays" << std::endl;
+    }
+    std::cout << "scene\trays\tsingle\tpacket\tspeedup\thits\tpacket hits\tmismatches" << std::endl;
+
+    unsigned char *tex_data;
+    hitable *lights;
+    seed_thread_rng(0, 0);
+    hitable *world = random_scene(&tex_data, &lights);
+    camera random_cam(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 16.0f/9, 0, 10, 0, 1);
+    bench_packets_scene("random_scene", world, lights, random_cam);
+
+    seed_thread_rng(0, 0);
+    world = final(&lights);
+    camera final_cam(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 16.0f/9, 0, 10, 0, 1);
+    bench_packets_scene("final", world, lights, final_cam);
+}
+
+/*
+    The path integrator against the wavefront one, with and without packets
+    and, for the wavefront, with and without binning between stages. Each
+    mode is run three times, interleaved, and keeps its best time. The
+    errors against a 256 spp path traced reference should match.
+*/
+void bench_wavefront() {
+    unsigned char *tex_data;
+    seed_thread_rng(0, 0);
+    hitable *lights[2];
+    hitable *scenes[2] = {random_scene(&tex_data, &lights[0]), final(&lights[1])};
+    camera cams[2] = {
+        camera(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 2.0, 0.0, 10.0, 0.0, 1.0),
+        camera(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0),
+    };
+    const char *names[2] = {"random_scene", "final"};
+    const char *modes[] = {"path", "path+packets", "wavefront unsorted", "wavefront", "wavefront+packets"};
+    const int mode_count = 5;
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    std::vector<unsigned char> reference(settings.nx*settings.ny*3), image(reference.size());
+
+    std::cout << "wavefront: " << settings.nx << "x" << settings.ny << " 16 spp, best of 3 seconds and MSE against 256 spp" << std::endl;
+    std::cout << "scene\tmode\tseconds\tMrays/s\tMSE" << std::endl;
+    for (int s = 0; s < 2; s++) {
+        settings.ns = 256;
+        settings.seed = 1;
+        render(scenes[s], lights[s], cams[s], settings, &reference[0]);
+        settings.ns = 16;
+        settings.seed = 2;
+        double best[mode_count];
+        uint64_t rays[mode_count];
+        double mse[mode_count];
+        for (int round = 0; round < 3; round++) {
+            for (int m = 0; m < mode_count; m++) {
+                settings.packets = m == 1 || m == 4;
+                settings.wave_sorting = m != 2;
+                bench_clock::time_point start = bench_clock::now();
+                render_stats stats = m < 2 ? render(scenes[s], lights[s], cams[s], settings, &image[0])
+                                           : render_wavefront(scenes[s], lights[s], cams[s], settings, &image[0]);
+                double seconds = seconds_since(start);
+                if (round == 0 || seconds < best[m])
+                    best[m] = seconds;
+                rays[m] = stats.rays;
+                mse[m] = image_mse(image, reference);
+            }
+        }
+        for (int m = 0; m < mode_count; m++)
+            std::cout << names[s] << "\t" << modes[m] << "\t" << best[m] << "\t" << rays[m] / best[m] / 1e6 << "\t" << mse[m] << std::endl;
+    }
+}
+
+// resident set size of the process in MB
+double resident_mb() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / (1024.0*1024.0));
+}
+
+/*
+    Loads and unloads a 100k sphere cloud in a linear_bvh five times: on the
+    heap, where nothing can free the scene again, then in an arena released
+    after every round, with and without huge pages. Columns are build and
+    release seconds, closest hit Mrays/s and the resident size afterwards.
+*/
+void bench_arena() {
+    std::cout << "arena: 100k sphere cloud loaded and unloaded 5 times" << std::endl;
+    std::cout << "memory\tround\tbuild\tMrays/s\trelease\tresident MB" << std::endl;
+    seed_thread_rng(1, 0);
+    std::vector<ray> rays = bench_rays(200000, aabb(vec3(-50,-50,-50), vec3(50,50,50)));
+    const char *names[] = {"heap", "arena", "arena+huge"};
+    for (int mode = 0; mode < 3; mode++) {
+        arena scene_arena(size_t(1) << 20, mode == 2);
+        for (int round = 0; round < 5; round++) {
+            bench_clock::time_point start = bench_clock::now();
+            hitable *world;
+            {
+                arena *previous = current_arena();
+                current_arena() = mode > 0 ? &scene_arena : NULL;
+                seed_thread_rng(0, 0);
+                std::vector<hitable *> list = sphere_cloud(100000);
+                world = new linear_bvh(&list[0], int(list.size()), 0.0, 1.0);
+                current_arena() = previous;
+            }
+            double build = seconds_since(start);
+            int hits;
+            double mrays = trace_rays(world, rays, hits);
+            start = bench_clock::now();
+            scene_arena.release();
+            double release = seconds_since(start);
+            std::cout << names[mode] << "\t" << round << "\t" << build << "\t" << mrays << "\t"
+                      << (mode > 0 ? std::to_string(release) : std::string("-")) << "\t" << resident_mb() << std::endl;
+        }
+    }
+}
+
+/*
+    The scene as built (virtual calls all the way down) against the same
+    scene through compiled_scene, first for traversal only, then with its
+    materials too. Renders use the same seed, so they match the virtual one
+    exactly unless the scene holds fog, whose random draws follow the order
+    primitives are visited in; the MSE against a 256 spp render shows those
+    still converge to the same image.
+*/
+void bench_compiled() {
+    unsigned char *tex_data;
+    seed_thread_rng(0, 0);
+    hitable *lights[2];
+    hitable *scenes[2] = {random_scene(&tex_data, &lights[0]), final(&lights[1])};
+    camera cams[2] = {
+        camera(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 2.0, 0.0, 10.0, 0.0, 1.0),
+        camera(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0),
+    };
+    const char *names[2] = {"random_scene", "final"};
+    const char *modes[] = {"virtual", "compiled traversal", "compiled all"};
+    const int mode_count = 3;
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    std::vector<unsigned char> reference(settings.nx*settings.ny*3), image(reference.size()), first(reference.size());
+
+    std::cout << "compiled: 200K closest hit rays and " << settings.nx << "x" << settings.ny
+              << " 16 spp renders, best of 3, MSE against 256 spp" << std::endl;
+    std::cout << "scene\tmode\tMrays/s\trender s\tspeedup\tMSE\tsame image" << std::endl;
+    for (int s = 0; s < 2; s++) {
+        compiled_scene compiled(scenes[s], 0, 1);
+        std::cout << names[s] << ": " << compiled.source_hitables << " objects compiled into "
+                  << compiled.prims.size() << " primitives" << std::endl;
+        hitable *worlds[mode_count] = {scenes[s], &compiled, &compiled};
+        aabb box;
+        scenes[s]->bounding_box(0, 1, box);
+        std::vector<ray> rays = bench_rays(200000, box);
+        settings.ns = 256;
+        settings.seed = 1;
+        render(scenes[s], lights[s], cams[s], settings, &reference[0]);
+        settings.ns = 16;
+        settings.seed = 2;
+
+        double mrays[mode_count], best[mode_count], mse[mode_count];
+        bool same[mode_count];
+        for (int round = 0; round < 3; round++) {
+            for (int m = 0; m < mode_count; m++) {
+                int hits;
+                double rate = trace_rays(worlds[m], rays, hits);
+                bench_clock::time_point start = bench_clock::now();
+                if (m == 2)
+                    render(worlds[m], lights[s], cams[s], settings, &image[0], compiled);
+                else
+                    render(worlds[m], lights[s], cams[s], settings, &image[0]);
+                double seconds = seconds_since(start);
+                if (round == 0 || rate > mrays[m])
+                    mrays[m] = rate;
+                if (round == 0 || seconds < best[m])
+                    best[m] = seconds;
+                if (m == 0)
+                    first = image;
+                mse[m] = image_mse(image, reference);
+                same[m] = image == first;
+            }
+        }
+        for (int m = 0; m < mode_count; m++)
+            std::cout << names[s] << "\t" << modes[m] << "\t" << mrays[m] << "\t" << best[m] << "\t"
+                      << best[0] / best[m] << "\t" << mse[m] << "\t" << (same[m] ? "yes" : "no") << std::endl;
+    }
+}
+
+// box as it used to be built: six rectangles in a list, three flipped to face out
+hitable *six_rect_box(const vec3& p0, const vec3& p1, material *ptr) {
+    hitable **list = scene_array<hitable *>(6);
+    list[0] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
+    list[1] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+    list[2] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
+    list[3] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    list[4] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
+    list[5] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    return new hitable_list(list, 6);
+}
+
+/*
+    The final scene with its 28 boxes as slab tested boxes and as six
+    rectangles each, through the virtual calls and compiled: the boxes on
+    their own, then the whole scene. Fog draws random numbers in the order
+    the BVH reaches it, so the two renders differ in noise.
+*/
+void bench_box() {
+    seed_thread_rng(0, 0);
+    hitable *lights;
+    linear_bvh *boxes = dynamic_cast<linear_bvh *>(final(&lights));
+    std::vector<hitable *> list, only_boxes, only_rects;
+    for (hitable *h : boxes->prims) {
+        box *b = dynamic_cast<box *>(h);
+        list.push_back(b ? six_rect_box(b->pmin, b->pmax, b->mp) : h);
+        if (b) {
+            only_boxes.push_back(h);
+            only_rects.push_back(list.back());
+        }
+    }
+    linear_bvh rects(&list[0], int(list.size()), 0, 1);
+    linear_bvh alone_boxes(&only_boxes[0], int(only_boxes.size()), 0, 1);
+    linear_bvh alone_rects(&only_rects[0], int(only_rects.size()), 0, 1);
+    compiled_scene compiled_boxes(boxes, 0, 1), compiled_rects(&rects, 0, 1);
+    compiled_scene compiled_alone_boxes(&alone_boxes, 0, 1), compiled_alone_rects(&alone_rects, 0, 1);
+    hitable *worlds[4] = {&rects, boxes, &compiled_rects, &compiled_boxes};
+    hitable *alone[4] = {&alone_rects, &alone_boxes, &compiled_alone_rects, &compiled_alone_boxes};
+    const char *modes[4] = {"six rects", "slab box", "six rects compiled", "slab box compiled"};
+    camera cam(vec3(0,278,-800), vec3(0,278,0), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0);
+
+    aabb bounds;
+    boxes->bounding_box(0, 1, bounds);
+    std::vector<ray> rays = bench_rays(200000, bounds);
+    alone_boxes.bounding_box(0, 1, bounds);
+    std::vector<ray> box_rays = bench_rays(200000, bounds);
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    settings.ns = 16;
+    std::vector<unsigned char> first(settings.nx*settings.ny*3), image(first.size());
+
+    std::cout << "box: final scene's 28 boxes, 200K closest hit rays at the boxes alone and at the scene, "
+              << settings.nx << "x" << settings.ny << " " << settings.ns << " spp render, best of 3" << std::endl;
+    std::cout << "mode\tboxes Mrays/s\tscene Mrays/s\trender s\tMSE to six rects" << std::endl;
+    double box_rate[4], scene_rate[4], best[4], mse[4];
+    for (int round = 0; round < 3; round++) {
+        for (int m = 0; m < 4; m++) {
+            int hits;
+            double at_boxes = trace_rays(alone[m], box_rays, hits);
+            double scene = trace_rays(worlds[m], rays, hits);
+            bench_clock::time_point start = bench_clock::now();
+            render(worlds[m], lights, cam, settings, &image[0]);
+            double seconds = seconds_since(start);
+            if (round == 0 || at_boxes > box_rate[m]) box_rate[m] = at_boxes;
+            if (round == 0 || scene > scene_rate[m]) scene_rate[m] = scene;
+            if (round == 0 || seconds < best[m]) best[m] = seconds;
+            if (m == 0)
+                first = image;
+            mse[m] = image_mse(image, first);
+        }
+    }
+    for (int m = 0; m < 4; m++)
+        std::cout << modes[m] << "\t" << box_rate[m] << "\t" << scene_rate[m] << "\t" << best[m] << "\t" << mse[m] << std::endl;
+}
+
+/*
+    translate and rotate_y as they were before transform replaced them,
+    for bench_transform to compare against: each moves the ray by itself
+    and nested ones are a virtual call each.
+*/
+class translate : public hitable {
+    public:
+        translate(hitable *p, const vec3& displacement) : ptr(p), offset(displacement) {}
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const {
+            ptr->surface(move(r), rec);
+            rec.p += offset;
+        }
+        virtual bool bounding_box(float t0, float t1, aabb& box) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const { return ptr->occluded(move(r), t_min, t_max); }
+        virtual float pdf_value(const vec3& o, const vec3& v) const { return ptr->pdf_value(o - offset, v); }
+        virtual vec3 random(const vec3& o) const { return ptr->random(o - offset); }
+        ray move(const ray& r) const { return ray(r.origin() - offset, r.direction(), r.time()); }
+        hitable *ptr;
+        vec3 offset;
+};
+
+bool translate::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    ray moved_r = move(r);
+    if (!ptr->intersect(moved_r, t_min, t_max, rec))
+        return false;
+    if (rec.prim == ptr) {
+        rec.prim = this;
+    } else {
+        finish_surface(moved_r, rec);
+        rec.p += offset;
+    }
+    return true;
+}
+
+bool translate::bounding_box(float t0, float t1, aabb& box) const {
+    if (ptr->bounding_box(t0, t1, box)) {
+        box = aabb(box.min() + offset, box.max() + offset);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+class rotate_y : public hitable {
+    public:
+        rotate_y(hitable *p, float angle);
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const {
+            ptr->surface(rotate(r), rec);
+            rotate_back(rec);
+        }
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            box = bbox; return hasbox;
+        }
+        virtual bool occluded(const ray& r, float t_min, float t_max) const { return ptr->occluded(rotate(r), t_min, t_max); }
+        ray rotate(const ray& r) const;
+        void rotate_back(hit_record& rec) const;
+        hitable *ptr;
+        float sin_theta;
+        float cos_theta;
+        bool hasbox;
+        aabb bbox;
+};
+rotate_y::rotate_y(hitable *p, float angle) : ptr(p) {
+    float radians = (M_PI / 180) * angle;
+    sin_theta = sin(radians);
+    cos_theta = cos(radians);
+    hasbox = ptr->bounding_box(0, 1, bbox);
+    vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+    vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i=0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k=0; k < 2; k++) {
+                float x = i*bbox.max().x() + (1-i)*bbox.min().x();
+                float y = j*bbox.max().y() + (1-j)*bbox.min().y();
+                float z = k*bbox.max().z() + (1-k)*bbox.min().z();
+                float newx = cos_theta*x + sin_theta*z;
+                float newz = -sin_theta*x + cos_theta*z;
+                vec3 tester(newx, y, newz);
+                for (int c = 0; c < 3; c++) {
+                    if (tester[c] > max[c])
+                        max[c] = tester[c];
+                    if (tester[c] < min[c])
+                        min[c] = tester[c];
+                }
+            }
+        }
+    }
+    bbox = aabb(min, max);
+}
+
+// the ray in the object's own frame
+ray rotate_y::rotate(const ray& r) const {
+    vec3 origin = r.origin();
+    vec3 direction = r.direction();
+    origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
+    origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
+    direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
+    direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
+    return ray(origin, direction, r.time());
+}
+
+// the hit point and normal back in world space
+void rotate_y::rotate_back(hit_record& rec) const {
+    vec3 p = rec.p;
+    vec3 normal = rec.normal;
+    p[0] = cos_theta*rec.p[0] + sin_theta*rec.p[2];
+    p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
+    normal[0] = cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
+    normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
+    rec.p = p;
+    rec.normal = normal;
+}
+
+bool rotate_y::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    ray rotated_r = rotate(r);
+    if (!ptr->intersect(rotated_r, t_min, t_max, rec))
+        return false;
+    if (rec.prim == ptr) {
+        rec.prim = this;
+    } else {
+        finish_surface(rotated_r, rec);
+        rotate_back(rec);
+    }
+    return true;
+}
+
+/*
+    1000 spheres and 1000 boxes on a grid, each turned, moved, turned again
+    and moved into place: as four nested translate and rotate_y wrappers,
+    as the single transform the same four fold into, and that compiled.
+    Also the SAH cost of the BVH over the shapes, which the tight bounds of
+    the transformed spheres lower. Rounding differs between the wrappers' ray
+    moves and the matrix, which sends some paths another way, so renders
+    are compared by their MSE against a 256 spp render through the wrappers.
+*/
+hitable *turned_shapes(bool wrappers, linear_bvh **shapes, hitable **lights) {
+    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
+    material *red = new lambertian(new constant_texture(vec3(0.65, 0.05, 0.05)));
+    std::vector<hitable *> list;
+    for (int i = 0; i < 2000; i++) {
+        vec3 at(3*(i % 10) - 13.5f, 3*((i / 10) % 10) + 1.5f, 3*(i / 100) - 30);
+        vec3 jitter(random_float() - 0.5f, 0, random_float() - 0.5f);
+        float a = 360*random_float(), b = 360*random_float();
+        hitable *shape = i % 2 ? (hitable *)new box(vec3(-0.6,-0.6,-0.6), vec3(0.6,0.6,0.6), red)
+                               : (hitable *)new sphere(vec3(0.3,0,0), 0.8, white);
+        if (wrappers) {
+            list.push_back(new translate(new rotate_y(new translate(new rotate_y(shape, a), jitter), b), at));
+        } else {
+            hitable *t = new transform(shape, affine::rotation_y(a));
+            t = new transform(t, affine::translation(jitter));
+            t = new transform(t, affine::rotation_y(b));
+            list.push_back(new transform(t, affine::translation(at)));
+        }
+    }
+    *shapes = new linear_bvh(&list[0], int(list.size()), 0, 1);
+    hitable **world = scene_array<hitable *>(3);
+    world[0] = *shapes;
+    world[1] = new xz_rect(-1000, 1000, -1000, 1000, 0, white);
+    world[2] = new sphere(vec3(0, 80, -20), 20, new diffuse_light(new constant_texture(vec3(8, 8, 8))));
+    *lights = light_list(world[2]);
+    return new hitable_list(world, 3);
+}
+
+void bench_transform() {
+    hitable *lights[3];
+    linear_bvh *shapes[2];
+    seed_thread_rng(0, 0);
+    hitable *wrapped = turned_shapes(true, &shapes[0], &lights[0]);
+    seed_thread_rng(0, 0);
+    hitable *transformed = turned_shapes(false, &shapes[1], &lights[1]);
+    lights[2] = lights[1];
+    compiled_scene compiled(transformed, 0, 1);
+    hitable *worlds[3] = {wrapped, transformed, &compiled};
+    // the compiled BVH also holds the ground, so its SAH cost is not comparable
+    float sah[3] = {shapes[0]->stats.sah_cost, shapes[1]->stats.sah_cost, shapes[1]->stats.sah_cost};
+    const char *modes[3] = {"translate+rotate_y", "transform", "transform compiled"};
+    camera cam(vec3(0,20,-60), vec3(0,12,-15), vec3(0,1,0), 40, 2.0, 0.0, 10.0, 0.0, 1.0);
+
+    aabb bounds(vec3(-15,0,-31), vec3(15,30,-1));
+    std::vector<ray> rays = bench_rays(200000, bounds);
+
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    settings.ns = 256;
+    settings.seed = 1;
+    std::vector<unsigned char> reference(settings.nx*settings.ny*3), image(reference.size());
+    render(wrapped, lights[0], cam, settings, &reference[0]);
+    settings.ns = 16;
+    settings.seed = 2;
+
+    std::cout << "transform: 2000 shapes under four nested wrappers or one transform, 200K closest hit rays, "
+              << settings.nx << "x" << settings.ny << " " << settings.ns << " spp render, best of 3, MSE against 256 spp" << std::endl;
+    std::cout << "mode\tSAH cost\tMrays/s\thits\trender s\tMSE" << std::endl;
+    double rate[3], best[3], mse[3];
+    int hits[3];
+    for (int round = 0; round < 3; round++) {
+        for (int m = 0; m < 3; m++) {
+            double r = trace_rays(worlds[m], rays, hits[m]);
+            bench_clock::time_point start = bench_clock::now();
+            render(worlds[m], lights[m], cam, settings, &image[0]);
+            double seconds = seconds_since(start);
+            if (round == 0 || r > rate[m]) rate[m] = r;
+            if (round == 0 || seconds < best[m]) best[m] = seconds;
+            mse[m] = image_mse(image, reference);
+        }
+    }
+    for (int m = 0; m < 3; m++)
+        std::cout << modes[m] << "\t" << sah[m] << "\t" << rate[m] << "\t" << hits[m] << "\t" << best[m] << "\t" << mse[m] << std::endl;
+}
+
+/*
+    Tori of 100K and 1M triangles in a triangle_mesh: build seconds, bytes
+    per triangle and closest hit Mrays/s with each leaf kernel the CPU runs,
+    then a save and load round trip through OBJ and binary PLY. Every kernel
+    and every reloaded mesh has to hit the same rays.
+*/
+void bench_mesh() {
+    std::cout << "mesh: triangle_mesh kernels and loaders" << std::endl;
+    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
+    std::vector<std::pair<const char *, triangle_mesh::leaf_fn> > kernels(1, std::make_pair("scalar", triangle_leaf_scalar));
+#ifdef TRIANGLE_MESH_X86
+    if (__builtin_cpu_supports("sse4.2"))
+        kernels.push_back(std::make_pair("sse4.2", triangle_leaf_sse));
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(std::make_pair("avx2", triangle_leaf_avx2));
+#endif
+    std::cout << "triangles\tbuild\tbytes/triangle\tkernel\tMrays/s\thits" << std::endl;
+    for (int size = 100000; size <= 1000000; size *= 10) {
+        triangle_mesh mesh(white);
+        tessellate_torus(mesh, 35, 15, size);
+        bench_clock::time_point start = bench_clock::now();
+        mesh.build();
+        double build = seconds_since(start);
+        seed_thread_rng(1, 0);
+        std::vector<ray> rays = bench_rays(200000, mesh.nodes[0].box);
+        int hits, reference = -1;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            mesh.leaf_test = kernels[k].second;
+            double mrays = trace_rays(&mesh, rays, hits);
+            std::cout << mesh.size() << "\t" << build << "\t" << double(mesh.stats.bytes) / mesh.size() << "\t" << kernels[k].first << "\t" << mrays << "\t" << hits
+                      << (reference >= 0 && hits != reference ? " MISMATCH" : "") << std::endl;
+            reference = hits;
+        }
+
+        const char *paths[] = {"/tmp/bench_mesh.obj", "/tmp/bench_mesh.ply"};
+        for (const char *path : paths) {
+            start = bench_clock::now();
+            mesh.save(path);
+            double save = seconds_since(start);
+            triangle_mesh loaded(white);
+            loaded.load(path);
+            remove(path);
+            loaded.build();
+            trace_rays(&loaded, rays, hits);
+            std::cout << mesh.size() << "\t" << path + strlen(path) - 3 << "\tsave " << save << " s, load " << loaded.load_seconds << " s, "
+                      << loaded.load_bytes / (1024.0*1024.0) << " MB, " << loaded.size() / loaded.load_seconds / 1e6 << " M triangles/s, "
+                      << hits << " hits" << (hits != reference ? " MISMATCH" : "") << std::endl;
+        }
+    }
+}
+
+// bytes of a fir (or of all the copies of them): its meshes and the linear_bvh over them
+size_t forest_bytes(const linear_bvh *trees) {
+    size_t bytes = trees->stats.bytes;
+    for (const hitable *h : trees->prims) {
+        if (const linear_bvh *part = dynamic_cast<const linear_bvh *>(h))
+            bytes += forest_bytes(part);
+        else
+            bytes += sizeof(triangle_mesh) + ((const triangle_mesh *)h)->stats.bytes;
+    }
+    return bytes;
+}
+
+/*
+    Duplicated against instanced geometry. random_scene's spheres as their
+    own objects and as instances of one sphere per radius: geometry bytes,
+    closest hit Mrays/s and a 16 spp render's MSE against a 256 spp render
+    of the original. Then forests of 1K to 1M firs (see forest()), as copies up to
+    10K trees and as instances: build seconds, geometry MB and bytes per
+    tree, Mrays/s, the rebuild of the top level BVH a moving forest would
+    pay every frame, and the resident size.
+*/
+void bench_instancing() {
+    std::cout << "instancing: duplicated vs instanced geometry" << std::endl;
+    unsigned char *tex_data;
+    hitable *lights;
+    seed_thread_rng(0, 0);
+    int n;
+    hitable **list = random_scene_list(&tex_data, n);
+    lights = light_list(list[0]);
+    hitable *scenes[2] = {new linear_bvh(list, n, 0.0, 1.0), instance_spheres(list, n)};
+    size_t bytes[2] = {n * (sizeof(sphere) + sizeof(hitable *)) + ((linear_bvh *)scenes[0])->stats.bytes,
+                       ((instance_bvh *)scenes[1])->blases.size() * sizeof(sphere) + ((instance_bvh *)scenes[1])->stats.bytes};
+    camera cam(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 2.0, 0.0, 10.0, 0.0, 1.0);
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    std::vector<unsigned char> reference(settings.nx*settings.ny*3), image(reference.size());
+    settings.ns = 256;
+    settings.seed = 1;
+    render(scenes[0], lights, cam, settings, &reference[0]);
+    settings.ns = 16;
+    settings.seed = 2;
+    aabb box;
+    scenes[0]->bounding_box(0, 1, box);
+    seed_thread_rng(1, 0);
+    std::vector<ray> rays = bench_rays(200000, box);
+    const char *modes[2] = {"spheres", "instances"};
+    std::cout << "scene\tgeometry\tbytes\tMrays/s\thits\trender s\tMSE" << std::endl;
+    for (int m = 0; m < 2; m++) {
+        int hits;
+        double mrays = trace_rays(scenes[m], rays, hits);
+        bench_clock::time_point start = bench_clock::now();
+        render(scenes[m], lights, cam, settings, &image[0]);
+        double seconds = seconds_since(start);
+        std::cout << "random_scene\t" << modes[m] << "\t" << bytes[m] << "\t" << mrays << "\t" << hits << "\t"
+                  << seconds << "\t" << image_mse(image, reference) << std::endl;
+    }
+
+    std::cout << "trees\tgeometry\tbuild\tMB\tbytes/tree\tMrays/s\thits\ttop rebuild\tresident MB" << std::endl;
+    for (int trees = 1000; trees <= 1000000; trees *= 10) {
+        for (int instanced = 0; instanced < 2; instanced++) {
+            if (!instanced && trees > 10000)
+                continue;
+            arena scene_arena;
+            arena_scope scope(scene_arena);
+            seed_thread_rng(0, 0);
+            hitable *world;
+            bench_clock::time_point start = bench_clock::now();
+            forest(trees, instanced, &world);
+            double build = seconds_since(start);
+            size_t geometry;
+            double rebuild = 0;
+            if (instanced) {
+                instance_bvh *top = (instance_bvh *)world;
+                geometry = top->stats.bytes;
+                for (hitable *fir : top->blases)
+                    geometry += forest_bytes((linear_bvh *)fir);
+                start = bench_clock::now();
+                top->build();
+                rebuild = seconds_since(start);
+            } else {
+                geometry = forest_bytes((linear_bvh *)world);
+            }
+            world->bounding_box(0, 1, box);
+            seed_thread_rng(1, 0);
+            std::vector<ray> forest_rays = bench_rays(100000, box);
+            int hits;
+            double mrays = trace_rays(world, forest_rays, hits);
+            std::cout << trees << "\t" << (instanced ? "instances" : "copies") << "\t" << build << "\t" << geometry / (1024.0*1024.0) << "\t"
+                      << double(geometry) / trees << "\t" << mrays << "\t" << hits << "\t"
+                      << (instanced ? std::to_string(rebuild) : std::string("-")) << "\t" << resident_mb() << std::endl;
+        }
+    }
+}
+
+/*
+    random_scene with its diffuse spheres bouncing up by as much as bounce
+    while the shutter is open, like the README's motion blur picture, under
+    a linear_bvh of the boxes they sweep and under motion_bvhs with the
+    shutter in 1 and 4 segments. Rays have random times and are aimed at
+    the small spheres; renders use the same seed and should match. Best of
+    3 rounds.
+*/
+void bench_motion() {
+    render_settings settings;
+    settings.nx = 200;
+    settings.ny = 100;
+    settings.ns = 8;
+    settings.seed = 2;
+    camera cam(vec3(13,2,3), vec3(0,0,0), vec3(0,1,0), 20, 2.0, 0.0, 10.0, 0.0, 1.0);
+    std::vector<unsigned char> first(settings.nx*settings.ny*3), image(first.size());
+    const char *modes[3] = {"linear", "motion 1", "motion 4"};
+    const int mode_count = 3;
+
+    std::cout << "motion: random_scene with bouncing spheres, 200K closest hit rays at random times, "
+              << settings.nx << "x" << settings.ny << " " << settings.ns << " spp renders, best of 3" << std::endl;
+    std::cout << "bounce\tbvh\tbuild\tbytes\tMrays/s\thits\trender s\tspeedup\tsame image" << std::endl;
+    const float bounces[3] = {0.5, 2, 8};
+    for (float bounce : bounces) {
+        unsigned char *tex_data;
+        seed_thread_rng(0, 0);
+        int n;
+        hitable **list = random_scene_list(&tex_data, n, bounce);
+        hitable *lights = light_list(list[0]);
+        seed_thread_rng(1, 0);
+        std::vector<ray> rays = bench_rays(200000, aabb(vec3(-11,0,-11), vec3(11,1 + bounce,11)));
+
+        hitable *worlds[mode_count];
+        double build[mode_count];
+        size_t bytes[mode_count];
+        for (int m = 0; m < mode_count; m++) {
+            bench_clock::time_point start = bench_clock::now();
+            if (m == 0) {
+                linear_bvh *bvh = new linear_bvh(list, n, 0.0, 1.0);
+                bytes[m] = bvh->stats.bytes;
+                worlds[m] = bvh;
+            } else {
+                motion_bvh *bvh = new motion_bvh(list, n, 0.0, 1.0, m == 1 ? 1 : 4);
+                bytes[m] = bvh->stats.bytes;
+                worlds[m] = bvh;
+            }
+            build[m] = seconds_since(start);
+        }
+
+        double mrays[mode_count], best[mode_count];
+        int hits[mode_count];
+        bool same[mode_count];
+        for (int round = 0; round < 3; round++) {
+            for (int m = 0; m < mode_count; m++) {
+                double rate = trace_rays(worlds[m], rays, hits[m]);
+                bench_clock::time_point start = bench_clock::now();
+                render(worlds[m], lights, cam, settings, &image[0]);
+                double seconds = seconds_since(start);
+                if (round == 0 || rate > mrays[m])
+                    mrays[m] = rate;
+                if (round == 0 || seconds < best[m])
+                    best[m] = seconds;
+                if (m == 0)
+                    first = image;
+                same[m] = image == first;
+            }
+        }
+        for (int m = 0; m < mode_count; m++) {
+            std::cout << bounce << "\t" << modes[m] << "\t" << build[m] << "\t" << bytes[m] << "\t" << mrays[m] << "\t"
+                      << hits[m] << "\t" << best[m] << "\t" << best[0] / best[m] << "\t" << (same[m] ? "yes" : "no") << std::endl;
+            delete worlds[m];
+        }
+    }
+}
+
+struct benchmark {
+    const char *name;
+    void (*run)();
+};
+
+benchmark benchmarks[] = {
+    {"rng", bench_rng},
+    {"vec", bench_vec},
+    {"render", bench_render},
+    {"tiles", bench_tiles},
+    {"roulette", bench_roulette},
+    {"nee", bench_nee},
+    {"bvh", bench_bvh},
+    {"slab", bench_slab},
+    {"wide", bench_wide},
+    {"occlusion", bench_occlusion},
+    {"spheres", bench_spheres},
+    {"packets", bench_packets},
+    {"wavefront", bench_wavefront},
+    {"arena", bench_arena},
+    {"compiled", bench_compiled},
+    {"box", bench_box},
+    {"transform", bench_transform},
+    {"mesh", bench_mesh},
+    {"instancing", bench_instancing},
+    {"motion", bench_motion},
+};
+
+int main(int argc, char *argv[]) {
+    for (const benchmark& b : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++)
+            if (std::string(argv[i]) == b.name) selected = true;
+        if (selected) {
+            b.run();
+            std::cout << std::endl;
+        }
+    }
+}
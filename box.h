@@ -1,37 +1,97 @@
 #ifndef BOXH
 #define BOXH
 
+#include <algorithm>
+
 #include "hitable.h"
 #include "material.h"
 
+/*
+    Entry and exit of r through the slabs of [pmin, pmax], and the faces
+    they are on: face 2a is the pmin side of axis a, 2a+1 the pmax side.
+    An axis the ray runs parallel to gives infinite (or NaN) distances,
+    which the comparisons leave out.
+*/
+inline bool box_slabs(const vec3& pmin, const vec3& pmax, const ray& r, float& tnear, float& tfar, int& near_face, int& far_face) {
+    tnear = -FLT_MAX;
+    tfar = FLT_MAX;
+    near_face = far_face = 0;
+    for (int a = 0; a < 3; a++) {
+        float inv_d = 1.0f / r.direction()[a];
+        float t0 = (pmin[a] - r.origin()[a]) * inv_d;
+        float t1 = (pmax[a] - r.origin()[a]) * inv_d;
+        int f0 = 2*a, f1 = 2*a + 1;
+        if (inv_d < 0.0f) {
+            std::swap(t0, t1);
+            std::swap(f0, f1);
+        }
+        if (t0 > tnear) { tnear = t0; near_face = f0; }
+        if (t1 < tfar) { tfar = t1; far_face = f1; }
+    }
+    return tnear <= tfar;
+}
+
+/*
+    Axis aligned box, intersected with one slab test rather than as six
+    rectangles. Like the rectangles it is a surface: a ray that starts
+    inside hits the face it leaves through. Normals point out and each
+    face gets texture coordinates as the rectangle on it would. Rotated
+    boxes are a box under a transform.
+*/
 class box: public hitable {
     public:
         box() {}
-        box(const vec3& p0, const vec3& p1, material *ptr);
-        virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+        box(const vec3& p0, const vec3& p1, material *ptr) : pmin(p0), pmax(p1), mp(ptr) {}
+        // records the face in rec.u, which surface() turns into texture coordinates
+        virtual bool intersect(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             box = aabb(pmin, pmax);
             return true;
         }
+        virtual bool occluded(const ray& r, float t0, float t1) const;
         vec3 pmin, pmax;
-        hitable *list_ptr;
+        material *mp;
 };
 
-box::box(const vec3& p0, const vec3& p1, material *ptr) {
-    pmin = p0;
-    pmax = p1;
-    hitable **list = new hitable*[6];
-    list[0] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-    list[1] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-    list[2] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-    list[3] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-    list[4] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-    list[5] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-    list_ptr = new hitable_list(list, 6);
+inline bool box::intersect(const ray& r, float t0, float t1, hit_record& rec) const {
+    float tnear, tfar;
+    int near_face, far_face;
+    if (!box_slabs(pmin, pmax, r, tnear, tfar, near_face, far_face))
+        return false;
+    if (tnear >= t0 && tnear <= t1) {
+        rec.t = tnear;
+        rec.u = near_face;
+    } else if (tfar >= t0 && tfar <= t1) {
+        rec.t = tfar;
+        rec.u = far_face;
+    } else {
+        return false;
+    }
+    rec.prim = this;
+    return true;
+}
+
+inline void box::surface(const ray& r, hit_record& rec) const {
+    int face = int(rec.u);
+    int axis = face >> 1;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = vec3(0,0,0);
+    rec.normal[axis] = face & 1 ? 1 : -1;
+    // u runs along the first of the other two axes and v along the second
+    int a = axis == 0 ? 1 : 0;
+    int b = axis == 2 ? 1 : 2;
+    rec.u = (rec.p[a] - pmin[a]) / (pmax[a] - pmin[a]);
+    rec.v = (rec.p[b] - pmin[b]) / (pmax[b] - pmin[b]);
+    rec.mat_ptr = mp;
 }
 
-bool box::hit(const ray& r, float t0, float t1, hit_record& rec) const {
-    return list_ptr->hit(r, t0, t1, rec);
+inline bool box::occluded(const ray& r, float t0, float t1) const {
+    float tnear, tfar;
+    int near_face, far_face;
+    if (!box_slabs(pmin, pmax, r, tnear, tfar, near_face, far_face))
+        return false;
+    return (tnear >= t0 && tnear <= t1) || (tfar >= t0 && tfar <= t1);
 }
 
-#endif
\ No newline at end of file
+#endif
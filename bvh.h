@@ -0,0 +1,433 @@
+#ifndef BVHH
+#define BVHH
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#include "hitable.h"
+#include "parallel.h"
+
+/*
+    Bounding volume hierarchy built with a binned surface area heuristic.
+    Primitive bounds and centroids are computed once up front; every node then
+    bins the centroids along each axis and takes the cheapest split, or makes a
+    leaf of up to max_leaf_size primitives when splitting is not worth it.
+*/
+
+const int bvh_bins = 16;
+const float bvh_traversal_cost = 1.0;
+const float bvh_intersect_cost = 1.0;
+const int bvh_max_depth = 64;
+const int bvh_parallel_subtree = 4096; // smaller subtrees are built by one thread
+const int bvh_parallel_chunk = 1 << 15; // primitives per task when binning one node
+
+enum bvh_split {
+    bvh_split_sah,
+    bvh_split_median
+};
+
+struct bvh_primitive {
+    aabb box;
+    vec3 centroid;
+    int index;    // position in the caller's input
+    hitable *ptr; // NULL for primitives that are not hitables
+};
+
+struct bvh_stats {
+    int nodes = 0;
+    int leaves = 0;
+    int primitives = 0;
+    int max_depth = 0;
+    int max_leaf_size = 0;
+    float sah_cost = 0;
+    size_t bytes = 0;       // what the finished tree keeps
+    size_t build_bytes = 0; // temporary memory while building
+    double build_seconds = 0;
+};
+
+std::ostream& operator<<(std::ostream &os, const bvh_stats &s) {
+    os << "nodes " << s.nodes << ", leaves " << s.leaves
+       << ", prims/leaf " << (s.leaves ? float(s.primitives) / s.leaves : 0)
+       << " (max " << s.max_leaf_size << "), depth " << s.max_depth
+       << ", SAH cost " << s.sah_cost
+       << ", memory " << s.bytes / (1024.0*1024.0) << " MB";
+    if (s.build_seconds > 0)
+        os << ", build " << s.build_seconds << " s using " << s.build_bytes / (1024.0*1024.0) << " MB";
+    return os;
+}
+
+aabb bounds_of(const bvh_primitive *prims, int n) {
+    aabb box = prims[0].box;
+    for (int i = 1; i < n; i++)
+        box = surrounding_box(box, prims[i].box);
+    return box;
+}
+
+aabb centroid_bounds_of(const bvh_primitive *prims, int n) {
+    aabb box(prims[0].centroid, prims[0].centroid);
+    for (int i = 1; i < n; i++)
+        box = surrounding_box(box, aabb(prims[i].centroid, prims[i].centroid));
+    return box;
+}
+
+// primitive bounds and centroid bounds, split across the shared pool for big ranges
+void range_bounds(const bvh_primitive *prims, int n, aabb& box, aabb& cbox) {
+    thread_pool& pool = shared_thread_pool();
+    if (n < bvh_parallel_chunk * 2 || pool.size() < 2) {
+        box = bounds_of(prims, n);
+        cbox = centroid_bounds_of(prims, n);
+        return;
+    }
+    int chunks = (n + bvh_parallel_chunk - 1) / bvh_parallel_chunk;
+    std::vector<aabb> boxes(chunks), cboxes(chunks);
+    pool.parallel_for(0, n, bvh_parallel_chunk, [&](int first, int last) {
+        boxes[first / bvh_parallel_chunk] = bounds_of(prims + first, last - first);
+        cboxes[first / bvh_parallel_chunk] = centroid_bounds_of(prims + first, last - first);
+    });
+    box = boxes[0];
+    cbox = cboxes[0];
+    for (int i = 1; i < chunks; i++) {
+        box = surrounding_box(box, boxes[i]);
+        cbox = surrounding_box(cbox, cboxes[i]);
+    }
+}
+
+// collects bounds and centroids, dropping anything without a bounding box
+std::vector<bvh_primitive> make_bvh_primitives(hitable **l, int n, float time0, float time1) {
+    std::vector<bvh_primitive> prims(n);
+    std::vector<char> valid(n);
+    shared_thread_pool().parallel_for(0, n, bvh_parallel_chunk, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            valid[i] = l[i]->bounding_box(time0, time1, prims[i].box);
+            prims[i].centroid = prims[i].box.center();
+            prims[i].index = i;
+            prims[i].ptr = l[i];
+        }
+    });
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (valid[i])
+            prims[kept++] = prims[i];
+        else
+            std::cerr << "no bounding box in bvh_node constructor\n";
+    }
+    prims.resize(kept);
+    return prims;
+}
+
+inline int bvh_bin_index(float c, float cmin, float scale) {
+    int b = int((c - cmin) * scale);
+    return b < 0 ? 0 : (b >= bvh_bins ? bvh_bins - 1 : b);
+}
+
+struct bvh_binning {
+    int counts[3][bvh_bins];
+    aabb boxes[3][bvh_bins];
+
+    bvh_binning() {
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < bvh_bins; b++)
+                counts[a][b] = 0;
+    }
+
+    void add(const bvh_primitive *prims, int n, const aabb& cbounds, const float *scale) {
+        for (int i = 0; i < n; i++) {
+            for (int a = 0; a < 3; a++) {
+                if (scale[a] <= 0) continue;
+                int b = bvh_bin_index(prims[i].centroid[a], cbounds._min[a], scale[a]);
+                boxes[a][b] = counts[a][b]++ ? surrounding_box(boxes[a][b], prims[i].box) : prims[i].box;
+            }
+        }
+    }
+
+    void merge(const bvh_binning& other) {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < bvh_bins; b++) {
+                if (!other.counts[a][b]) continue;
+                boxes[a][b] = counts[a][b] ? surrounding_box(boxes[a][b], other.boxes[a][b]) : other.boxes[a][b];
+                counts[a][b] += other.counts[a][b];
+            }
+        }
+    }
+};
+
+/*
+    Picks the cheapest binned SAH split. Returns the primitive count that goes
+    to the left child after partitioning, or 0 when a leaf is cheaper.
+    intersect_cost is the cost of one primitive test relative to a node visit.
+*/
+int sah_partition(bvh_primitive *prims, int n, const aabb& bounds, const aabb& cbounds, int max_leaf_size, float intersect_cost = bvh_intersect_cost) {
+    float scale[3];
+    for (int a = 0; a < 3; a++) {
+        float extent = cbounds._max[a] - cbounds._min[a];
+        scale[a] = extent > 0 ? bvh_bins / extent : 0;
+    }
+
+    bvh_binning bins;
+    thread_pool& pool = shared_thread_pool();
+    if (n < bvh_parallel_chunk * 2 || pool.size() < 2) {
+        bins.add(prims, n, cbounds, scale);
+    } else {
+        std::vector<bvh_binning> partial((n + bvh_parallel_chunk - 1) / bvh_parallel_chunk);
+        pool.parallel_for(0, n, bvh_parallel_chunk, [&](int first, int last) {
+            partial[first / bvh_parallel_chunk].add(prims + first, last - first, cbounds, scale);
+        });
+        for (unsigned long i = 0; i < partial.size(); i++)
+            bins.merge(partial[i]);
+    }
+
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    int best_bin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] <= 0) continue;
+        const int *counts = bins.counts[axis];
+        const aabb *boxes = bins.boxes[axis];
+
+        // sweep from the right to get the area and count of every suffix
+        float right_area[bvh_bins];
+        int right_count[bvh_bins];
+        aabb acc;
+        int count = 0;
+        for (int b = bvh_bins - 1; b > 0; b--) {
+            if (counts[b]) {
+                acc = count ? surrounding_box(acc, boxes[b]) : boxes[b];
+                count += counts[b];
+            }
+            right_area[b] = count ? acc.area() : 0;
+            right_count[b] = count;
+        }
+
+        count = 0;
+        for (int b = 0; b < bvh_bins - 1; b++) {
+            if (counts[b]) {
+                acc = count ? surrounding_box(acc, boxes[b]) : boxes[b];
+                count += counts[b];
+            }
+            if (count == 0 || right_count[b+1] == 0) continue;
+            float cost = count*acc.area() + right_count[b+1]*right_area[b+1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    float area = bounds.area();
+    float leaf_cost = n * intersect_cost;
+    float split_cost = bvh_traversal_cost + (area > 0 ? intersect_cost * best_cost / area : n);
+
+    if (best_axis < 0) {
+        // every centroid is in the same spot, so only halving can help
+        return n <= max_leaf_size ? 0 : n/2;
+    }
+    if (n <= max_leaf_size && leaf_cost <= split_cost)
+        return 0;
+
+    float cmin = cbounds._min[best_axis];
+    float axis_scale = scale[best_axis];
+    bvh_primitive *mid = std::partition(prims, prims + n, [=](const bvh_primitive& p) {
+        return bvh_bin_index(p.centroid[best_axis], cmin, axis_scale) <= best_bin;
+    });
+    int n_left = int(mid - prims);
+    return (n_left == 0 || n_left == n) ? n/2 : n_left;
+}
+
+/*
+    Builds a temporary pointer tree over prims. Leaves refer to ranges of the
+    prims array, which partitioning leaves in depth first order. Big subtrees
+    are handed to the shared thread pool so every core takes part.
+*/
+struct bvh_build_node {
+    aabb box;
+    bvh_build_node *left;
+    bvh_build_node *right;
+    int first;
+    int count;
+};
+
+bvh_build_node *build_bvh_tree(bvh_primitive *prims, int first, int n, int depth, int max_leaf_size, std::atomic<int>& node_count, float intersect_cost = bvh_intersect_cost) {
+    bvh_build_node *node = new bvh_build_node;
+    node_count++;
+    aabb cbounds;
+    range_bounds(prims + first, n, node->box, cbounds);
+    int n_left = depth < bvh_max_depth - 1 ? sah_partition(prims + first, n, node->box, cbounds, max_leaf_size, intersect_cost) : 0;
+    if (n_left == 0) {
+        node->left = node->right = NULL;
+        node->first = first;
+        node->count = n;
+        return node;
+    }
+
+    node->first = node->count = 0;
+    thread_pool& pool = shared_thread_pool();
+    if (n >= bvh_parallel_subtree && pool.size() > 1) {
+        std::future<void> left = pool.submit([&]() {
+            node->left = build_bvh_tree(prims, first, n_left, depth + 1, max_leaf_size, node_count, intersect_cost);
+        });
+        node->right = build_bvh_tree(prims, first + n_left, n - n_left, depth + 1, max_leaf_size, node_count, intersect_cost);
+        pool.wait(left);
+    } else {
+        node->left = build_bvh_tree(prims, first, n_left, depth + 1, max_leaf_size, node_count, intersect_cost);
+        node->right = build_bvh_tree(prims, first + n_left, n - n_left, depth + 1, max_leaf_size, node_count, intersect_cost);
+    }
+    return node;
+}
+
+// splits at the median centroid of the widest axis
+int median_partition(bvh_primitive *prims, int n, int max_leaf_size) {
+    if (n <= max_leaf_size)
+        return 0;
+    aabb cbounds = centroid_bounds_of(prims, n);
+    vec3 extent = cbounds.max() - cbounds.min();
+    int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+    std::nth_element(prims, prims + n/2, prims + n, [=](const bvh_primitive& a, const bvh_primitive& b) {
+        return a.centroid[axis] < b.centroid[axis];
+    });
+    return n/2;
+}
+
+class bvh_node : public hitable {
+    public:
+        bvh_node() {}
+        bvh_node(hitable **l, int n, float time0, float time1, bvh_split split = bvh_split_sah, int max_leaf_size = 4);
+        bvh_node(bvh_primitive *prims, int n, bvh_split split, int max_leaf_size) { build(prims, n, split, max_leaf_size); }
+        void build(bvh_primitive *prims, int n, bvh_split split, int max_leaf_size);
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb& box) const;
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const;
+        virtual bool occluded(const ray& r, float tmin, float tmax) const;
+        // the children are bvh_nodes, so the ray is set up for box tests once for the whole tree
+        bool intersect_tree(const ray& r, const slab_ray& sr, float t_min, float t_max, hit_record& rec) const;
+        bool occluded_tree(const ray& r, const slab_ray& sr, float t_min, float t_max) const;
+        void collect_stats(bvh_stats& s, int depth, float root_area) const;
+        bvh_stats stats() const;
+        hitable *left;
+        hitable *right;
+        hitable **prims; // leaves have no children and count prims
+        int count;
+        aabb box;
+};
+
+bool bvh_node::bounding_box(float t0, float t1, aabb& b) const {
+    b = box;
+    return true;
+}
+
+bool bvh_node::transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& b) const {
+    aabb child;
+    if (left) {
+        if (!left->transformed_bounding_box(to_world, t0, t1, b) || !right->transformed_bounding_box(to_world, t0, t1, child))
+            b = child = to_world.box(box);
+        b = surrounding_box(b, child);
+        return true;
+    }
+    if (count == 0)
+        return hitable::transformed_bounding_box(to_world, t0, t1, b);
+    for (int i = 0; i < count; i++) {
+        if (!prims[i]->transformed_bounding_box(to_world, t0, t1, child))
+            child = to_world.box(box);
+        b = i == 0 ? child : surrounding_box(b, child);
+    }
+    return true;
+}
+
+bvh_node::bvh_node(hitable **l, int n, float time0, float time1, bvh_split split, int max_leaf_size) {
+    std::vector<bvh_primitive> build_prims = make_bvh_primitives(l, n, time0, time1);
+    if (build_prims.empty()) {
+        left = right = NULL;
+        prims = NULL;
+        count = 0;
+        box = aabb(vec3(0,0,0), vec3(0,0,0));
+        return;
+    }
+    build(&build_prims[0], int(build_prims.size()), split, max_leaf_size);
+}
+
+void bvh_node::build(bvh_primitive *build_prims, int n, bvh_split split, int max_leaf_size) {
+    aabb cbounds;
+    range_bounds(build_prims, n, box, cbounds);
+    int n_left = split == bvh_split_sah ? sah_partition(build_prims, n, box, cbounds, max_leaf_size)
+                                        : median_partition(build_prims, n, max_leaf_size);
+    if (n_left == 0) {
+        left = right = NULL;
+        prims = scene_array<hitable *>(n);
+        count = n;
+        for (int i = 0; i < n; i++)
+            prims[i] = build_prims[i].ptr;
+    } else {
+        prims = NULL;
+        count = 0;
+        left = new bvh_node(build_prims, n_left, split, max_leaf_size);
+        right = new bvh_node(build_prims + n_left, n - n_left, split, max_leaf_size);
+    }
+}
+
+bool bvh_node::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return intersect_tree(r, slab_ray(r), t_min, t_max, rec);
+}
+
+bool bvh_node::intersect_tree(const ray& r, const slab_ray& sr, float t_min, float t_max, hit_record& rec) const {
+    float tnear;
+    if (!box.hit(sr, t_min, t_max, tnear))
+        return false;
+    if (!left) {
+        bool hit_anything = false;
+        for (int i = 0; i < count; i++) {
+            if (prims[i]->intersect(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+    // the right child only has to beat a hit found on the left
+    bool hit_left = ((bvh_node *)left)->intersect_tree(r, sr, t_min, t_max, rec);
+    bool hit_right = ((bvh_node *)right)->intersect_tree(r, sr, t_min, hit_left ? rec.t : t_max, rec);
+    return hit_left || hit_right;
+}
+
+bool bvh_node::occluded(const ray& r, float t_min, float t_max) const {
+    return occluded_tree(r, slab_ray(r), t_min, t_max);
+}
+
+bool bvh_node::occluded_tree(const ray& r, const slab_ray& sr, float t_min, float t_max) const {
+    float tnear;
+    if (!box.hit(sr, t_min, t_max, tnear))
+        return false;
+    if (!left) {
+        for (int i = 0; i < count; i++)
+            if (prims[i]->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
+    return ((bvh_node *)left)->occluded_tree(r, sr, t_min, t_max) || ((bvh_node *)right)->occluded_tree(r, sr, t_min, t_max);
+}
+
+void bvh_node::collect_stats(bvh_stats& s, int depth, float root_area) const {
+    float relative_area = root_area > 0 ? box.area() / root_area : 1;
+    s.nodes++;
+    s.bytes += sizeof(bvh_node) + (left ? 0 : count*sizeof(hitable *));
+    s.max_depth = std::max(s.max_depth, depth);
+    if (!left) {
+        s.leaves++;
+        s.primitives += count;
+        s.max_leaf_size = std::max(s.max_leaf_size, count);
+        s.sah_cost += relative_area * count * bvh_intersect_cost;
+    } else {
+        s.sah_cost += relative_area * bvh_traversal_cost;
+        ((bvh_node *)left)->collect_stats(s, depth + 1, root_area);
+        ((bvh_node *)right)->collect_stats(s, depth + 1, root_area);
+    }
+}
+
+bvh_stats bvh_node::stats() const {
+    bvh_stats s;
+    collect_stats(s, 0, box.area());
+    return s;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define CAMERAH
 
 #include "ray.h"
+#include "random.h"
 
 vec3 random_in_unit_disk() {
     vec3 p;
@@ -31,7 +32,7 @@ class camera {
         ray get_ray(float s, float t) {
             vec3 rd = lens_radius*random_in_unit_disk();
             vec3 offset = u * rd.x() + v * rd.y();
-            float time = time0 + (drand48()* (time1-time0));
+            float time = time0 + (random_float()* (time1-time0));
             return ray(origin + offset, lower_left_corner+s*horizontal + t*vertical - origin - offset, time);
         }
 
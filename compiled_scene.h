@@ -0,0 +1,696 @@
+#ifndef COMPILEDSCENEH
+#define COMPILEDSCENEH
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "hitable_list.h"
+#include "material.h"
+#include "rectangle.h"
+#include "box.h"
+#include "sphere.h"
+#include "texture.h"
+
+/*
+    A scene rebuilt for tracing without virtual calls. The constructor walks
+    the graph it is given through lists, BVHs and the flip_normals and
+    transform wrappers down to the shapes, bakes the wrappers into them, copies each shape into an array of its own type and builds
+    one BVH over all of them. A leaf then holds small records that name the
+    type, so testing a primitive is a switch and a direct call the compiler
+    can inline, instead of a chain of virtual calls through every wrapper.
+
+    Materials and textures get the same treatment: emitted(), scatter() and
+    scattering_pdf() switch on their type and look up the texture by index,
+    in the same order of random draws as the classes in material.h, so a
+    render with them matches one through the virtual calls. render() takes
+    the scene as its shading argument to use them.
+
+    Shapes it does not know (fog, sphere_set) are kept as hitable pointers
+    and called through hit(), and their hits are shaded through rec.mat_ptr
+    as before.
+*/
+
+enum compiled_shape_type {
+    compiled_sphere,
+    compiled_moving_sphere,
+    compiled_xy_rect,
+    compiled_xz_rect,
+    compiled_yz_rect,
+    compiled_box,
+    compiled_quad,       // a rectangle under a transform, in world space
+    compiled_hitable     // anything else, through its virtual functions
+};
+
+enum compiled_material_type {
+    compiled_lambertian,
+    compiled_metal,
+    compiled_dielectric,
+    compiled_diffuse_light,
+    compiled_isotropic,
+    compiled_material    // anything else
+};
+
+enum compiled_texture_type {
+    compiled_constant,
+    compiled_checker,
+    compiled_noise,
+    compiled_image,
+    compiled_texture     // anything else
+};
+
+struct compiled_prim {
+    uint8_t type;
+    bool flip;     // under an odd number of flip_normals
+    int index;     // into the array for type
+    int material;  // into materials, -1 to shade through rec.mat_ptr
+    int frame;     // into frames for compiled_hitable under a transform, else -1
+};
+
+/*
+    A rectangle with its frame and flip baked in: corner q, edges u and v
+    and the facing normal, all in world space. The parameters along u and v
+    are the rectangle's own texture coordinates. A sheared frame leaves u
+    and v at an angle, so the parameters are read off with the dual vectors:
+    du is perpendicular to v and dot(u, du) is 1, and likewise for dv.
+*/
+struct world_quad {
+    vec3 q, u, v;
+    vec3 normal;
+    float d;            // dot(normal, q)
+    vec3 du, dv;
+    material *mat_ptr;
+
+    world_quad(const vec3& corner, const vec3& edge_u, const vec3& edge_v, const vec3& n, material *m)
+        : q(corner), u(edge_u), v(edge_v), normal(n), d(dot(n, corner)), mat_ptr(m) {
+        vec3 across_v = cross(edge_v, n), across_u = cross(n, edge_u);
+        du = across_v / dot(edge_u, across_v);
+        dv = across_u / dot(edge_v, across_u);
+    }
+
+    // written so that NaNs from rays parallel to the quad miss
+    bool intersect(const ray& r, float t0, float t1, float& t, float& a, float& b) const {
+        t = (d - dot(normal, r.origin())) / dot(normal, r.direction());
+        if (!(t >= t0 && t <= t1))
+            return false;
+        vec3 w = r.point_at_parameter(t) - q;
+        a = dot(w, du);
+        b = dot(w, dv);
+        return a >= 0 && a <= 1 && b >= 0 && b <= 1;
+    }
+};
+
+// index is the texture for lambertian, diffuse_light and isotropic, else into the type's array
+struct compiled_ref {
+    int type;
+    int index;
+};
+
+struct compiled_checker_texture {
+    int odd, even;
+};
+
+// what the constructor gathers from the scene before building the BVH
+struct compiled_build {
+    float time0, time1;
+    std::vector<hitable *> shapes;
+    std::vector<char> flips;
+    std::vector<affine_frame> frames;
+    std::vector<bvh_primitive> groups; // index is the group's number
+    std::vector<int> group_first;      // shapes of group g are [group_first[g], group_first[g+1])
+};
+
+class compiled_scene : public hitable {
+    public:
+        compiled_scene(hitable *world, float time0, float time1, int max_leaf_size = 4, float intersect_cost = bvh_intersect_cost);
+        ~compiled_scene() { free(nodes); }
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        // none when nothing in the world had a box
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (prims.empty())
+                return false;
+            box = nodes[0].box;
+            return true;
+        }
+
+        // material calls for hits this scene returned
+        vec3 emitted(const hit_record& rec) const;
+        bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const;
+        float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const;
+        vec3 texture_value(int texture, float u, float v, const vec3& p) const;
+
+        linear_bvh_node *nodes;
+        int node_count;
+        std::vector<compiled_prim> prims; // in leaf order
+        std::vector<sphere> spheres;
+        std::vector<moving_sphere> moving_spheres;
+        std::vector<xy_rect> xy_rects;
+        std::vector<xz_rect> xz_rects;
+        std::vector<yz_rect> yz_rects;
+        std::vector<box> boxes;
+        std::vector<world_quad> quads;
+        std::vector<hitable *> hitables;
+        std::vector<affine_frame> frames;
+
+        std::vector<compiled_ref> materials;
+        std::vector<metal> metals;
+        std::vector<dielectric> dielectrics;
+        std::vector<material *> material_objects;
+
+        std::vector<compiled_ref> textures;
+        std::vector<vec3> constants;
+        std::vector<compiled_checker_texture> checkers;
+        std::vector<noise_texture> noises;
+        std::vector<image_texture> images;
+        std::vector<texture *> texture_objects;
+
+        bvh_stats stats;
+        int source_hitables; // objects in the scene it was compiled from
+
+    private:
+        void collect(hitable *h, bool flip, bool split, const affine_frame& frame, compiled_build& build);
+        void collect_group(hitable *h, bool flip, bool split, const affine_frame& frame, compiled_build& build);
+        compiled_prim add_shape(hitable *h, bool flip, const affine_frame& frame);
+        int add_material(material *m);
+        int add_texture(texture *t);
+        bool intersect_prim(int i, const ray& r, float t_min, float t_max, hit_record& rec) const;
+
+        std::map<const material *, int> material_ids;
+        std::map<const texture *, int> texture_ids;
+};
+
+compiled_scene::compiled_scene(hitable *world, float time0, float time1, int max_leaf_size, float intersect_cost) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    compiled_build build;
+    build.time0 = time0;
+    build.time1 = time1;
+    source_hitables = 0;
+    collect(world, false, true, affine_frame(), build);
+    build.group_first.push_back(int(build.shapes.size()));
+    std::vector<bvh_primitive>& build_prims = build.groups;
+
+    std::vector<linear_bvh_node> out;
+    if (build_prims.empty()) {
+        out.push_back(empty_bvh_root());
+    } else {
+        std::atomic<int> build_nodes(0);
+        bvh_build_node *root = build_bvh_tree(&build_prims[0], 0, int(build_prims.size()), 0, max_leaf_size, build_nodes, intersect_cost);
+        stats.build_bytes = build_prims.size()*sizeof(bvh_primitive) + build_nodes*sizeof(bvh_build_node);
+        out.reserve(build_nodes);
+        flatten_bvh(out, root, 0, root->box.area(), stats, [](int first, int count) { return first; });
+    }
+
+    // partitioning left build_prims in leaf order, so copying the shapes in that order keeps every leaf contiguous
+    std::vector<int> prim_start(build_prims.size() + 1);
+    prims.reserve(build.shapes.size());
+    for (size_t i = 0; i < build_prims.size(); i++) {
+        prim_start[i] = int(prims.size());
+        int group = build_prims[i].index;
+        for (int k = build.group_first[group]; k < build.group_first[group + 1]; k++)
+            prims.push_back(add_shape(build.shapes[k], build.flips[k], build.frames[k]));
+    }
+    prim_start[build_prims.size()] = int(prims.size());
+    for (linear_bvh_node& node : out) {
+        if (node.count > 0) {
+            int first = node.first_prim;
+            node.first_prim = prim_start[first];
+            node.count = prim_start[first + node.count] - prim_start[first];
+        }
+    }
+
+    node_count = int(out.size());
+    size_t bytes = sizeof(linear_bvh_node) * node_count;
+    nodes = (linear_bvh_node *)aligned_alloc(32, (bytes + 31) & ~size_t(31));
+    memcpy(nodes, &out[0], bytes);
+
+    stats.bytes = bytes + prims.size()*sizeof(compiled_prim)
+        + spheres.size()*sizeof(sphere) + moving_spheres.size()*sizeof(moving_sphere)
+        + xy_rects.size()*sizeof(xy_rect) + xz_rects.size()*sizeof(xz_rect) + yz_rects.size()*sizeof(yz_rect)
+        + boxes.size()*sizeof(box) + quads.size()*sizeof(world_quad) + hitables.size()*sizeof(hitable *) + frames.size()*sizeof(affine_frame);
+    stats.build_bytes += out.capacity()*sizeof(linear_bvh_node);
+    stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+    Collects the shapes under h, looking through the containers that only
+    group them and folding transforms into frame. While split
+    is set every shape becomes a BVH primitive of its own. The primitives
+    of a BVH in the scene are kept whole instead: a list in one of its
+    leaves becomes a single BVH primitive over all its shapes, as the scene
+    grouped them that way.
+*/
+void compiled_scene::collect(hitable *h, bool flip, bool split, const affine_frame& frame, compiled_build& build) {
+    linear_bvh *lb = dynamic_cast<linear_bvh *>(h);
+    bvh_node *bn = dynamic_cast<bvh_node *>(h);
+    hitable_list *l = dynamic_cast<hitable_list *>(h);
+    flip_normals *f = dynamic_cast<flip_normals *>(h);
+    transform *t = dynamic_cast<transform *>(h);
+    if (split && !lb && !bn && !l && !f && !t) {
+        // a shape with nothing above it to keep it whole
+        collect_group(h, flip, true, frame, build);
+        return;
+    }
+    source_hitables++;
+    if (lb) {
+        for (hitable *p : lb->prims)
+            collect_group(p, flip, split, frame, build);
+    } else if (bn) {
+        if (bn->left) {
+            collect(bn->left, flip, split, frame, build);
+            collect(bn->right, flip, split, frame, build);
+        } else {
+            for (int i = 0; i < bn->count; i++)
+                collect_group(bn->prims[i], flip, split, frame, build);
+        }
+    } else if (l) {
+        for (int i = 0; i < l->list_size; i++)
+            collect(l->list[i], flip, split, frame, build);
+    } else if (f) {
+        collect(f->ptr, !flip, split, frame, build);
+    } else if (t) {
+        collect(t->ptr, flip, split, frame.then(t->frame.to_world), build);
+    } else {
+        build.shapes.push_back(h);
+        build.flips.push_back(flip);
+        build.frames.push_back(frame);
+    }
+}
+
+// adds h and everything under it as one BVH primitive, unless already inside one
+void compiled_scene::collect_group(hitable *h, bool flip, bool split, const affine_frame& frame, compiled_build& build) {
+    if (!split) {
+        collect(h, flip, false, frame, build);
+        return;
+    }
+    bvh_primitive p;
+    bool has_box = frame.identity() ? h->bounding_box(build.time0, build.time1, p.box)
+        : h->transformed_bounding_box(frame.to_world, build.time0, build.time1, p.box);
+    if (!has_box) {
+        std::cerr << "no bounding box in compiled_scene constructor\n";
+        return;
+    }
+    p.centroid = p.box.center();
+    p.index = int(build.groups.size());
+    p.ptr = NULL;
+    build.groups.push_back(p);
+    build.group_first.push_back(int(build.shapes.size()));
+    collect(h, flip, false, frame, build);
+}
+
+/*
+    Copies h into the array for its type. Rectangles under a frame become
+    world space quads. Spheres under a translation and uniform scale, and
+    boxes under a translation and scale along the axes, are moved and
+    scaled, as their texture coordinates do not change with that. Anything
+    else under a frame keeps the frame and has the ray moved into it at
+    every test.
+*/
+compiled_prim compiled_scene::add_shape(hitable *h, bool flip, const affine_frame& frame) {
+    compiled_prim p;
+    p.flip = flip;
+    p.frame = -1;
+    sphere *s = dynamic_cast<sphere *>(h);
+    moving_sphere *ms = dynamic_cast<moving_sphere *>(h);
+    xy_rect *xy = dynamic_cast<xy_rect *>(h);
+    xz_rect *xz = dynamic_cast<xz_rect *>(h);
+    yz_rect *yz = dynamic_cast<yz_rect *>(h);
+    box *bx = dynamic_cast<box *>(h);
+    float scale = frame.to_world.uniform_scale();
+    if (!frame.identity() && (xy || xz || yz)) {
+        vec3 q, u, v, n;
+        material *m;
+        if (xy) {
+            q = vec3(xy->x0, xy->y0, xy->k); u = vec3(xy->x1 - xy->x0, 0, 0); v = vec3(0, xy->y1 - xy->y0, 0); n = vec3(0,0,1); m = xy->mp;
+        } else if (xz) {
+            q = vec3(xz->x0, xz->k, xz->z0); u = vec3(xz->x1 - xz->x0, 0, 0); v = vec3(0, 0, xz->z1 - xz->z0); n = vec3(0,1,0); m = xz->mp;
+        } else {
+            q = vec3(yz->k, yz->y0, yz->z0); u = vec3(0, yz->y1 - yz->y0, 0); v = vec3(0, 0, yz->z1 - yz->z0); n = vec3(1,0,0); m = yz->mp;
+        }
+        n = frame.normal_to_world_unit(n);
+        p.type = compiled_quad;
+        p.index = int(quads.size());
+        p.material = add_material(m);
+        p.flip = false;
+        quads.push_back(world_quad(frame.point_to_world(q), frame.vector_to_world(u), frame.vector_to_world(v), flip ? -n : n, m));
+    } else if (s && scale > 0) {
+        p.type = compiled_sphere;
+        p.index = int(spheres.size());
+        p.material = add_material(s->mat_ptr);
+        spheres.push_back(*s);
+        spheres.back().center = frame.point_to_world(s->center);
+        spheres.back().radius *= scale;
+    } else if (ms && scale > 0) {
+        p.type = compiled_moving_sphere;
+        p.index = int(moving_spheres.size());
+        p.material = add_material(ms->mat_ptr);
+        moving_spheres.push_back(*ms);
+        moving_spheres.back().center0 = frame.point_to_world(ms->center0);
+        moving_spheres.back().center1 = frame.point_to_world(ms->center1);
+        moving_spheres.back().radius *= scale;
+    } else if (bx && frame.to_world.positive_diagonal()) {
+        p.type = compiled_box;
+        p.index = int(boxes.size());
+        p.material = add_material(bx->mp);
+        boxes.push_back(*bx);
+        boxes.back().pmin = frame.point_to_world(bx->pmin);
+        boxes.back().pmax = frame.point_to_world(bx->pmax);
+    } else if (!frame.identity()) {
+        p.type = compiled_hitable;
+        p.index = int(hitables.size());
+        p.material = -1;
+        p.frame = int(frames.size());
+        hitables.push_back(h);
+        frames.push_back(frame);
+    } else if (xy_rect *r = xy) {
+        p.type = compiled_xy_rect;
+        p.index = int(xy_rects.size());
+        p.material = add_material(r->mp);
+        xy_rects.push_back(*r);
+    } else if (xz_rect *r = xz) {
+        p.type = compiled_xz_rect;
+        p.index = int(xz_rects.size());
+        p.material = add_material(r->mp);
+        xz_rects.push_back(*r);
+    } else if (yz_rect *r = yz) {
+        p.type = compiled_yz_rect;
+        p.index = int(yz_rects.size());
+        p.material = add_material(r->mp);
+        yz_rects.push_back(*r);
+    } else {
+        p.type = compiled_hitable;
+        p.index = int(hitables.size());
+        p.material = -1;
+        hitables.push_back(h);
+    }
+    return p;
+}
+
+int compiled_scene::add_material(material *m) {
+    std::map<const material *, int>::iterator found = material_ids.find(m);
+    if (found != material_ids.end())
+        return found->second;
+    compiled_ref ref;
+    if (lambertian *l = dynamic_cast<lambertian *>(m)) {
+        ref.type = compiled_lambertian;
+        ref.index = add_texture(l->albedo);
+    } else if (metal *mt = dynamic_cast<metal *>(m)) {
+        ref.type = compiled_metal;
+        ref.index = int(metals.size());
+        metals.push_back(*mt);
+    } else if (dielectric *d = dynamic_cast<dielectric *>(m)) {
+        ref.type = compiled_dielectric;
+        ref.index = int(dielectrics.size());
+        dielectrics.push_back(*d);
+    } else if (diffuse_light *l = dynamic_cast<diffuse_light *>(m)) {
+        ref.type = compiled_diffuse_light;
+        ref.index = add_texture(l->emit);
+    } else if (isotropic *i = dynamic_cast<isotropic *>(m)) {
+        ref.type = compiled_isotropic;
+        ref.index = add_texture(i->albedo);
+    } else {
+        ref.type = compiled_material;
+        ref.index = int(material_objects.size());
+        material_objects.push_back(m);
+    }
+    int id = int(materials.size());
+    materials.push_back(ref);
+    material_ids[m] = id;
+    return id;
+}
+
+int compiled_scene::add_texture(texture *t) {
+    std::map<const texture *, int>::iterator found = texture_ids.find(t);
+    if (found != texture_ids.end())
+        return found->second;
+    compiled_ref ref;
+    if (constant_texture *c = dynamic_cast<constant_texture *>(t)) {
+        ref.type = compiled_constant;
+        ref.index = int(constants.size());
+        constants.push_back(c->color);
+    } else if (checker_texture *c = dynamic_cast<checker_texture *>(t)) {
+        compiled_checker_texture checker;
+        checker.odd = add_texture(c->odd);
+        checker.even = add_texture(c->even);
+        ref.type = compiled_checker;
+        ref.index = int(checkers.size());
+        checkers.push_back(checker);
+    } else if (noise_texture *n = dynamic_cast<noise_texture *>(t)) {
+        ref.type = compiled_noise;
+        ref.index = int(noises.size());
+        noises.push_back(*n);
+    } else if (image_texture *i = dynamic_cast<image_texture *>(t)) {
+        ref.type = compiled_image;
+        ref.index = int(images.size());
+        images.push_back(*i);
+    } else {
+        ref.type = compiled_texture;
+        ref.index = int(texture_objects.size());
+        texture_objects.push_back(t);
+    }
+    int id = int(textures.size());
+    textures.push_back(ref);
+    texture_ids[t] = id;
+    return id;
+}
+
+/*
+    The qualified calls below name the function to run, so they are not
+    virtual and the compiler can inline them into the traversal loop.
+*/
+__attribute__((always_inline)) inline bool compiled_scene::intersect_prim(int i, const ray& r, float t_min, float t_max, hit_record& rec) const {
+    const compiled_prim& p = prims[i];
+    bool hit;
+    switch (p.type) {
+        case compiled_sphere: hit = spheres[p.index].sphere::intersect(r, t_min, t_max, rec); break;
+        case compiled_moving_sphere: hit = moving_spheres[p.index].moving_sphere::intersect(r, t_min, t_max, rec); break;
+        case compiled_xy_rect: hit = xy_rects[p.index].xy_rect::intersect(r, t_min, t_max, rec); break;
+        case compiled_xz_rect: hit = xz_rects[p.index].xz_rect::intersect(r, t_min, t_max, rec); break;
+        case compiled_yz_rect: hit = yz_rects[p.index].yz_rect::intersect(r, t_min, t_max, rec); break;
+        case compiled_box: hit = boxes[p.index].box::intersect(r, t_min, t_max, rec); break;
+        case compiled_quad: {
+            float t, a, b;
+            hit = quads[p.index].intersect(r, t_min, t_max, t, a, b);
+            if (hit) {
+                rec.t = t;
+                rec.u = a;
+                rec.v = b;
+            }
+            break;
+        }
+        default:
+            // finished right away, as surface() has no way back to the shape's own
+            if (p.frame < 0) {
+                if (!hitables[p.index]->hit(r, t_min, t_max, rec))
+                    return false;
+            } else {
+                const affine_frame& f = frames[p.frame];
+                if (!hitables[p.index]->hit(f.ray_to_object(r), t_min, t_max, rec))
+                    return false;
+                rec.p = f.point_to_world(rec.p);
+                rec.normal = f.normal_to_world_unit(rec.normal);
+            }
+            if (p.flip)
+                rec.normal = -rec.normal;
+            rec.prim = NULL;
+            rec.index = i;
+            return true;
+    }
+    if (hit) {
+        rec.prim = this;
+        rec.index = i;
+    }
+    return hit;
+}
+
+bool compiled_scene::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (prims.empty())
+        return false;
+    slab_ray sr(r);
+
+    float tnear;
+    if (!slab_hit(nodes[0].box, sr, t_min, t_max, tnear))
+        return false;
+
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    bool hit_anything = false;
+
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                if (intersect_prim(i, r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = slab_hit(nodes[near_child].box, sr, t_min, t_max, t_near);
+            bool hit_far = slab_hit(nodes[far_child].box, sr, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+    return hit_anything;
+}
+
+void compiled_scene::surface(const ray& r, hit_record& rec) const {
+    const compiled_prim& p = prims[rec.index];
+    switch (p.type) {
+        case compiled_sphere: spheres[p.index].sphere::surface(r, rec); break;
+        case compiled_moving_sphere: moving_spheres[p.index].moving_sphere::surface(r, rec); break;
+        case compiled_xy_rect: xy_rects[p.index].xy_rect::surface(r, rec); break;
+        case compiled_xz_rect: xz_rects[p.index].xz_rect::surface(r, rec); break;
+        case compiled_yz_rect: yz_rects[p.index].yz_rect::surface(r, rec); break;
+        case compiled_box: boxes[p.index].box::surface(r, rec); break;
+        case compiled_quad:
+            rec.p = r.point_at_parameter(rec.t);
+            rec.normal = quads[p.index].normal;
+            rec.mat_ptr = quads[p.index].mat_ptr;
+            return;
+        default: return;
+    }
+    if (p.flip)
+        rec.normal = -rec.normal;
+}
+
+bool compiled_scene::occluded(const ray& r, float t_min, float t_max) const {
+    if (prims.empty())
+        return false;
+    slab_ray sr(r);
+
+    int stack[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    float tnear;
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (slab_hit(node.box, sr, t_min, t_max, tnear)) {
+            if (node.count == 0) {
+                stack[sp++] = node.second_child;
+                index++;
+                continue;
+            }
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                const compiled_prim& p = prims[i];
+                bool blocked;
+                switch (p.type) {
+                    case compiled_sphere: blocked = spheres[p.index].sphere::occluded(r, t_min, t_max); break;
+                    case compiled_moving_sphere: blocked = moving_spheres[p.index].moving_sphere::occluded(r, t_min, t_max); break;
+                    case compiled_xy_rect: blocked = xy_rects[p.index].xy_rect::occluded(r, t_min, t_max); break;
+                    case compiled_xz_rect: blocked = xz_rects[p.index].xz_rect::occluded(r, t_min, t_max); break;
+                    case compiled_yz_rect: blocked = yz_rects[p.index].yz_rect::occluded(r, t_min, t_max); break;
+                    case compiled_box: blocked = boxes[p.index].box::occluded(r, t_min, t_max); break;
+                    case compiled_quad: {
+                        float t, a, b;
+                        blocked = quads[p.index].intersect(r, t_min, t_max, t, a, b);
+                        break;
+                    }
+                    default:
+                        blocked = hitables[p.index]->occluded(p.frame < 0 ? r : frames[p.frame].ray_to_object(r), t_min, t_max);
+                        break;
+                }
+                if (blocked)
+                    return true;
+            }
+        }
+        if (sp == 0)
+            return false;
+        index = stack[--sp];
+    }
+}
+
+vec3 compiled_scene::texture_value(int t, float u, float v, const vec3& p) const {
+    const compiled_ref& ref = textures[t];
+    switch (ref.type) {
+        case compiled_constant:
+            return constants[ref.index];
+        case compiled_checker: {
+            float sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
+            return texture_value(sines < 0 ? checkers[ref.index].odd : checkers[ref.index].even, u, v, p);
+        }
+        case compiled_noise: return noises[ref.index].noise_texture::value(u, v, p);
+        case compiled_image: return images[ref.index].image_texture::value(u, v, p);
+        default: return texture_objects[ref.index]->value(u, v, p);
+    }
+}
+
+vec3 compiled_scene::emitted(const hit_record& rec) const {
+    int m = prims[rec.index].material;
+    if (m < 0)
+        return rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    const compiled_ref& ref = materials[m];
+    switch (ref.type) {
+        case compiled_diffuse_light: return texture_value(ref.index, rec.u, rec.v, rec.p);
+        case compiled_material: return material_objects[ref.index]->emitted(rec.u, rec.v, rec.p);
+        default: return vec3(0,0,0);
+    }
+}
+
+bool compiled_scene::scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
+    int m = prims[rec.index].material;
+    if (m < 0)
+        return rec.mat_ptr->scatter(r_in, rec, attenuation, scattered);
+    const compiled_ref& ref = materials[m];
+    switch (ref.type) {
+        case compiled_lambertian:
+            scattered = ray(rec.p, rec.normal + random_unit_vector(), r_in.time());
+            attenuation = texture_value(ref.index, rec.u, rec.v, rec.p);
+            return true;
+        case compiled_metal: return metals[ref.index].metal::scatter(r_in, rec, attenuation, scattered);
+        case compiled_dielectric: return dielectrics[ref.index].dielectric::scatter(r_in, rec, attenuation, scattered);
+        case compiled_diffuse_light: return false;
+        case compiled_isotropic:
+            scattered = ray(rec.p, random_unit_vector(), r_in.time());
+            attenuation = texture_value(ref.index, rec.u, rec.v, rec.p);
+            return true;
+        default: return material_objects[ref.index]->scatter(r_in, rec, attenuation, scattered);
+    }
+}
+
+float compiled_scene::scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+    int m = prims[rec.index].material;
+    if (m < 0)
+        return rec.mat_ptr->scattering_pdf(r_in, rec, scattered);
+    const compiled_ref& ref = materials[m];
+    switch (ref.type) {
+        case compiled_lambertian: {
+            float cosine = dot(rec.normal, unit_vector(scattered.direction()));
+            return cosine < 0 ? 0 : cosine / M_PI;
+        }
+        case compiled_isotropic: return 1 / (4*M_PI);
+        case compiled_material: return material_objects[ref.index]->scattering_pdf(r_in, rec, scattered);
+        default: return 0;
+    }
+}
+
+#endif
@@ -1,28 +1,34 @@
 #ifndef CMEDH
 #define CMEDH
 
+#include "random.h"
+
 class constant_medium : public hitable {
     public:
         constant_medium(hitable *b, float d, texture *a) : boundary(b), density(d) {
             phase_function = new isotropic(a);
         }
-        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        // hits come back finished: a point in the medium has nothing to defer
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             return boundary->bounding_box(t0, t1, box);
         }
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+            return boundary->transformed_bounding_box(to_world, t0, t1, box);
+        }
 
         hitable *boundary;
         float density;
         material *phase_function;
 };
 
-bool constant_medium::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-    bool db = (drand48() < 0.00001);
-    db = false;
+bool constant_medium::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool db = false;
 
     hit_record rec1, rec2;
-    if (boundary->hit(r, -FLT_MAX, FLT_MAX, rec1)) {
-        if (boundary->hit(r, rec1.t+0.0001, FLT_MAX, rec2)) {
+    // only the distances to the boundary are needed
+    if (boundary->intersect(r, -FLT_MAX, FLT_MAX, rec1)) {
+        if (boundary->intersect(r, rec1.t+0.0001, FLT_MAX, rec2)) {
             if (db) std::cerr << "t0 t1" << rec1.t << " " << rec2.t << std::endl;
             if (rec1.t < t_min)
                 rec1.t = t_min;
@@ -33,7 +39,7 @@ bool constant_medium::hit(const ray& r, float t_min, float t_max, hit_record& re
             if (rec1.t < 0)
                 rec1.t = 0;
             float distance_inside_boundary = (rec2.t - rec1.t)*r.direction().length();
-            float hit_distance = -(1/density)*log(drand48());
+            float hit_distance = -(1/density)*log(1 - random_float());
             if (hit_distance < distance_inside_boundary) {
                 if (db) std::cerr << "hit_distance = " << hit_distance << std::endl;
                 rec.t = rec1.t + hit_distance / r.direction().length();
@@ -42,6 +48,7 @@ bool constant_medium::hit(const ray& r, float t_min, float t_max, hit_record& re
                 if (db) std::cerr << "rec.p = " << rec.p << std::endl;
                 rec.normal = vec3(1,0,0); // arbitrary
                 rec.mat_ptr = phase_function;
+                rec.prim = NULL;
                 return true;
             }
         }
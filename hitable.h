@@ -1,11 +1,16 @@
 #ifndef HITABLEH
 #define HITABLEH
 
+#include "arena.h"
 #include "ray.h"
 #include "aabb.h"
+#include "affine.h"
 #include "float.h"
+#include "random.h"
+#include "ray_packet.h"
 
 class material;
+class hitable;
 
 struct hit_record {
     float t;
@@ -13,223 +18,196 @@ struct hit_record {
     vec3 normal;
     material *mat_ptr;
     float u, v;
+    const hitable *prim; // primitive whose surface() is still to run, NULL once done
+    int index;           // which element of prim, for shapes made of many (sphere_set)
 };
 
 class hitable {
     public:
-    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+    static void *operator new(size_t bytes) { return scene_new<hitable>(bytes); }
+    static void operator delete(void *p) { scene_delete(p); }
+    virtual ~hitable() {}
+    /*
+        Closest hit queries come in two steps. intersect() finds the closest
+        hit in (t_min, t_max) and records only t, the primitive in rec.prim
+        and any parametric coordinates in rec.u and rec.v. surface() fills in
+        the point, normal, material and texture coordinates, once, for the
+        hit that is kept. hit() does both.
+
+        Shapes override intersect(), and surface() unless their intersect()
+        hands hits back finished (rec.prim NULL), as constant_medium does.
+        Neither query writes to rec unless it returns true, so callers can
+        pass the same record down to every child.
+    */
+    virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+        if (!intersect(r, t_min, t_max, rec))
+            return false;
+        finish_surface(r, rec);
+        return true;
+    }
+    static void finish_surface(const ray& r, hit_record& rec) {
+        if (rec.prim) {
+            rec.prim->surface(r, rec);
+            rec.prim = NULL;
+        }
+    }
+    virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+    virtual void surface(const ray& r, hit_record& rec) const {}
     virtual bool bounding_box(float t0, float t1, aabb& box) const = 0;
-};
-
-int box_x_compare (const void * a, const void *b) {
-    aabb box_left, box_right;
-    hitable *ah = *(hitable**)a;
-    hitable *bh = *(hitable**)a;
-    if (!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-        std::cerr << "no bounding box in bvh_onde constructor\n";
-    if (box_left.min().x() - box_right.min().x() < 0.0 )
-        return -1;
-    else 
-        return 1;
-}
-
-int box_y_compare (const void * a, const void *b) {
-    aabb box_left, box_right;
-    hitable *ah = *(hitable**)a;
-    hitable *bh = *(hitable**)a;
-    if (!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-        std::cerr << "no bounding box in bvh_onde constructor\n";
-    if (box_left.min().y() - box_right.min().y() < 0.0 )
-        return -1;
-    else 
-        return 1;
-}
-
-int box_z_compare (const void * a, const void *b) {
-    aabb box_left, box_right;
-    hitable *ah = *(hitable**)a;
-    hitable *bh = *(hitable**)a;
-    if (!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-        std::cerr << "no bounding box in bvh_onde constructor\n";
-    if (box_left.min().z() - box_right.min().z() < 0.0 )
-        return -1;
-    else 
-        return 1;
-}
-
-class bvh_node : public hitable {
-    public:
-        bvh_node() {}
-        bvh_node(hitable **l, int n , float time0, float time1);
-        virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
-        virtual bool bounding_box(float t0, float t1, aabb& box) const;
-        hitable *left;
-        hitable *right;
-        aabb box;
-};
-
-bool bvh_node::bounding_box(float t0, float t1, aabb& b) const {
-    b = box;
-    return true;
-}
-
-bvh_node::bvh_node(hitable **l, int n, float time0, float time1) {
-    int axis = int(3*drand48());
-    if (axis == 0)
-        qsort(l, n, sizeof(hitable *), box_x_compare);
-    else if (axis == 1)
-        qsort(l, n, sizeof(hitable *), box_y_compare);
-    else
-        qsort(l, n, sizeof(hitable *), box_z_compare);
-    
-    if (n == 1) {
-        left = right = l[0];
-    } else if (n == 2) {
-        left = l[0];
-        right = l[1];
-    } else {
-        left = new bvh_node(l, n/2, time0, time1);
-        right = new bvh_node(l + n/2, n-n/2, time0, time1);
+    /*
+        The box around the shape once to_world is applied to it. Boxing the
+        transformed bounding box is loose under rotation (a sphere's box
+        turned 45 degrees is 41% wider), so shapes that can do better bound
+        their own geometry: spheres exactly, meshes by their vertices and
+        containers by their children.
+    */
+    virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+        if (!bounding_box(t0, t1, box))
+            return false;
+        box = to_world.box(box);
+        return true;
     }
-    aabb box_left, box_right;
-    if(!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0,time1, box_right))
-        std::cerr << "no bounding box in bvh_node constructor\n";
-    box = surrounding_box(box_left, box_right);
-}
+    /*
+        Any hit query for shadow rays: true as soon as anything is hit in
+        (t_min, t_max), without looking for the closest hit or filling in a
+        hit_record. Shapes override it to skip computing hit attributes.
+    */
+    virtual bool occluded(const ray& r, float t_min, float t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+    /*
+        Packet versions of the queries above, for the active lanes of p with
+        each lane's own t_max. They return a bit per lane that hits (or is
+        blocked), and rec holds packet_size records. Accelerators override
+        intersect_packet() and occluded_packet() to walk their nodes once for
+        the whole packet; everything else answers lane by lane.
+    */
+    int hit_packet(const ray_packet& p, float t_min, hit_record *rec) const {
+        int mask = intersect_packet(p, t_min, rec);
+        for (int i = 0; i < packet_size; i++)
+            if (mask & (1 << i))
+                finish_surface(p.r[i], rec[i]);
+        return mask;
+    }
+    virtual int intersect_packet(const ray_packet& p, float t_min, hit_record *rec) const {
+        int mask = 0;
+        for (int i = 0; i < packet_size; i++)
+            if ((p.active & (1 << i)) && intersect(p.r[i], t_min, p.t_max[i], rec[i]))
+                mask |= 1 << i;
+        return mask;
+    }
+    virtual int occluded_packet(const ray_packet& p, float t_min) const {
+        int mask = 0;
+        for (int i = 0; i < packet_size; i++)
+            if ((p.active & (1 << i)) && occluded(p.r[i], t_min, p.t_max[i]))
+                mask |= 1 << i;
+        return mask;
+    }
+    // solid angle pdf of random() picking direction v from o, for shapes used as lights
+    virtual float pdf_value(const vec3& o, const vec3& v) const { return 0.0; }
+    virtual vec3 random(const vec3& o) const { return vec3(1,0,0); }
+};
 
-bool bvh_node::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-    if (box.hit(r, t_min, t_max)) {
-        hit_record left_rec, right_rec;
-        bool hit_left = left->hit(r, t_min, t_max, left_rec);
-        bool hit_right = right->hit(r, t_min, t_max, right_rec);
-        if (hit_left && hit_right) {
-            if (left_rec.t < right_rec.t)
-                rec = left_rec;
-            else
-                rec = right_rec;
-            return true;
-        } else if (hit_left) {
-            rec = left_rec;
-            return true;
-        } else if (hit_right) {
-            rec = right_rec;
-            return true;
-        } else
-            return false;
-    } else
-        return false;
-}
+/*
+    The wrappers below change the ray or the surface of the shape they hold.
+    A hit on that shape directly stays deferred with the wrapper as rec.prim;
+    one on something nested deeper is finished in the shape's own frame
+    before being mapped back.
+*/
 
 class flip_normals : public hitable {
     public:
         flip_normals(hitable *p) : ptr(p) {}
-        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-            if (ptr->hit(r, t_min, t_max, rec)) {
-                rec.normal = -rec.normal;
-                return true;
-            } else {
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+            if (!ptr->intersect(r, t_min, t_max, rec))
                 return false;
+            if (rec.prim == ptr) {
+                rec.prim = this;
+            } else {
+                finish_surface(r, rec);
+                rec.normal = -rec.normal;
             }
+            return true;
+        }
+        virtual void surface(const ray& r, hit_record& rec) const {
+            ptr->surface(r, rec);
+            rec.normal = -rec.normal;
         }
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             return ptr->bounding_box(t0, t1, box);
         }
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+            return ptr->transformed_bounding_box(to_world, t0, t1, box);
+        }
+        virtual bool occluded(const ray& r, float t_min, float t_max) const { return ptr->occluded(r, t_min, t_max); }
+        virtual float pdf_value(const vec3& o, const vec3& v) const { return ptr->pdf_value(o, v); }
+        virtual vec3 random(const vec3& o) const { return ptr->random(o); }
 
         hitable *ptr;
 };
 
-class translate : public hitable {
-    public:
-        translate(hitable *p, const vec3& displacement) : ptr(p), offset(displacement) {}
-        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
-        virtual bool bounding_box(float t0, float t1, aabb& box) const;
-        hitable *ptr;
-        vec3 offset;
-};
-
-bool translate::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
-    if (ptr->hit(moved_r, t_min, t_max, rec)) {
-        rec.p += offset;
-        return true;
-    } else {
-        return false;
-    }
-}
-
-bool translate::bounding_box(float t0, float t1, aabb& box) const {
-    if (ptr->bounding_box(t0, t1, box)) {
-        box = aabb(box.min() + offset, box.max() + offset);
-        return true;
-    } else {
-        return false;
-    }
-}
-
-class rotate_y : public hitable {
+/*
+    An object under an affine transform: to_world maps its space into the
+    world's. Rays are moved into the object's space, which keeps t, and hits
+    are mapped back with the normal matrix so normals stay perpendicular
+    under scaling. A transform of a transform folds into one when it is
+    made, so nesting them costs nothing per ray.
+*/
+class transform : public hitable {
     public:
-        rotate_y(hitable *p, float angle);
-        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        transform(hitable *p, const affine& to_world);
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const {
+            ptr->surface(frame.ray_to_object(r), rec);
+            to_world(rec);
+        }
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             box = bbox; return hasbox;
         }
+        virtual bool transformed_bounding_box(const affine& m, float t0, float t1, aabb& box) const {
+            return ptr->transformed_bounding_box(m * frame.to_world, t0, t1, box);
+        }
+        virtual bool occluded(const ray& r, float t_min, float t_max) const { return ptr->occluded(frame.ray_to_object(r), t_min, t_max); }
+        // solid angles only survive rotations and translations, so these are exact for lights moved rigidly
+        virtual float pdf_value(const vec3& o, const vec3& v) const {
+            return ptr->pdf_value(frame.to_object.point(o), frame.to_object.vector(v));
+        }
+        virtual vec3 random(const vec3& o) const { return frame.vector_to_world(ptr->random(frame.to_object.point(o))); }
+        // the hit point and normal back in world space
+        void to_world(hit_record& rec) const {
+            rec.p = frame.point_to_world(rec.p);
+            rec.normal = frame.normal_to_world_unit(rec.normal);
+        }
+        affine_frame frame;
         hitable *ptr;
-        float sin_theta;
-        float cos_theta;
         bool hasbox;
         aabb bbox;
 };
 
-rotate_y::rotate_y(hitable *p, float angle) : ptr(p) {
-    float radians = (M_PI / 180) * angle;
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
-    vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
-    vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-    for (int i=0; i < 2; i++) {
-        for (int j = 0; j < 2; j++) {
-            for (int k=0; k < 2; k++) {
-                float x = i*bbox.max().x() + (1-i)*bbox.min().x();
-                float y = j*bbox.max().y() + (1-j)*bbox.min().y();
-                float z = k*bbox.max().z() + (1-k)*bbox.min().z();
-                float newx = cos_theta*x + sin_theta*z;
-                float newz = -sin_theta*x + cos_theta*z;
-                vec3 tester(newx, y, newz);
-                for (int c = 0; c < 3; c++) {
-                    if (tester[c] > max[c])
-                        max[c] = tester[c];
-                    if (tester[c] < min[c])
-                        min[c] = tester[c];
-                }
-            }
-        }
+transform::transform(hitable *p, const affine& to_world) {
+    transform *inner = dynamic_cast<transform *>(p);
+    if (inner) {
+        frame = affine_frame(to_world * inner->frame.to_world);
+        ptr = inner->ptr;
+    } else {
+        frame = affine_frame(to_world);
+        ptr = p;
     }
-    bbox = aabb(min, max);
+    hasbox = ptr->transformed_bounding_box(frame.to_world, 0, 1, bbox);
 }
 
-bool rotate_y::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-    vec3 origin = r.origin();
-    vec3 direction = r.direction();
-    origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
-    origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
-    direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
-    direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
-    ray rotated_r(origin, direction, r.time());
-
-    if (ptr->hit(rotated_r, t_min, t_max, rec)) {
-        vec3 p = rec.p;
-        vec3 normal = rec.normal;
-        p[0] = cos_theta*rec.p[0] + sin_theta*rec.p[2];
-        p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
-        normal[0] = cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
-        normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
-        rec.p = p;
-        rec.normal = normal;
-        return true;
-    } else {
+bool transform::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    ray object_r = frame.ray_to_object(r);
+    if (!ptr->intersect(object_r, t_min, t_max, rec))
         return false;
+    if (rec.prim == ptr) {
+        rec.prim = this;
+    } else {
+        finish_surface(object_r, rec);
+        to_world(rec);
     }
+    return true;
 }
 
 #endif
\ No newline at end of file
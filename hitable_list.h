@@ -7,26 +7,35 @@ class hitable_list: public hitable {
     public:
         hitable_list() {}
         hitable_list(hitable **l, int n) {list = l; list_size = n; }
-        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual float pdf_value(const vec3& o, const vec3& v) const;
+        virtual vec3 random(const vec3& o) const;
         hitable **list;
         int list_size;
 };
 
-bool hitable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-    hit_record temp_rec;
+bool hitable_list::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
     bool hit_anything = false;
-    double closest_so_far = t_max;
+    float closest_so_far = t_max;
     for (int i = 0; i < list_size; i++) {
-        if (list[i]->hit(r,t_min, closest_so_far, temp_rec)) {
+        if (list[i]->intersect(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
     return hit_anything;
 }
 
+bool hitable_list::occluded(const ray& r, float t_min, float t_max) const {
+    for (int i = 0; i < list_size; i++)
+        if (list[i]->occluded(r, t_min, t_max))
+            return true;
+    return false;
+}
+
 bool hitable_list::bounding_box(float t0, float t1, aabb& box) const {
     if (list_size < 1 ) return false;
 
@@ -38,7 +47,7 @@ bool hitable_list::bounding_box(float t0, float t1, aabb& box) const {
         box = temp_box;
 
     for (int i = 1; i < list_size; i++) {
-        if (list[0]->bounding_box(t0, t1, temp_box)) {
+        if (list[i]->bounding_box(t0, t1, temp_box)) {
             box = surrounding_box(box, temp_box);
         } else
             return false;
@@ -46,4 +55,34 @@ bool hitable_list::bounding_box(float t0, float t1, aabb& box) const {
     return true;
 }
 
+bool hitable_list::transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+    if (list_size < 1)
+        return false;
+    aabb temp_box;
+    for (int i = 0; i < list_size; i++) {
+        if (!list[i]->transformed_bounding_box(to_world, t0, t1, temp_box))
+            return false;
+        box = i == 0 ? temp_box : surrounding_box(box, temp_box);
+    }
+    return true;
+}
+
+// a list of lights is sampled by picking one of them uniformly; an empty
+// list has no density and falls back to the hitable default direction
+float hitable_list::pdf_value(const vec3& o, const vec3& v) const {
+    if (list_size == 0)
+        return 0;
+    float sum = 0;
+    for (int i = 0; i < list_size; i++)
+        sum += list[i]->pdf_value(o, v);
+    return sum / list_size;
+}
+
+vec3 hitable_list::random(const vec3& o) const {
+    if (list_size == 0)
+        return vec3(1,0,0);
+    int index = int(random_float() * list_size);
+    return list[index < list_size ? index : list_size - 1]->random(o);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,230 @@
+#ifndef INSTANCEH
+#define INSTANCEH
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "affine.h"
+#include "linear_bvh.h"
+
+/*
+    Two level acceleration for instanced geometry. Each distinct shape, a
+    sphere, a mesh or a whole linear_bvh of them, is added once as a bottom
+    level structure (BLAS). The top level BVH holds instances: 64 bytes
+    with the transform from world to BLAS space, the BLAS id and a material
+    that, when set, replaces the BLAS's own. A million copies of a tree then
+    cost a million instances rather than a million trees.
+
+    Rays are moved into BLAS space instead of the geometry into the world,
+    so only the world to BLAS transform is kept: it also maps normals back,
+    by its transpose, and t is the same in both spaces. Instances stay in
+    the order they were added; build() makes the top level BVH again from
+    their current transforms without touching a BLAS, so moving instances
+    (set_transform) costs one top level build per frame. Each instance's
+    to_world is kept beside instances for that, so a build boxes them
+    without inverting anything.
+*/
+
+const int instance_bvh_max_leaf = 4;
+const float instance_bvh_intersect_cost = 2; // per instance, relative to a node visit: a ray transform and a BLAS
+
+struct instance {
+    affine to_object;      // world to BLAS space
+    int blas;
+    material *mat;         // NULL keeps the BLAS's materials
+};
+
+class instance_bvh : public hitable {
+    public:
+        instance_bvh() : nodes(NULL), node_count(0) {}
+        ~instance_bvh() { free(nodes); }
+        // returns the id that add() takes, or -1 for a shape without a bounding box, which add() ignores
+        int add_blas(hitable *h);
+        void add(int blas, const affine& to_world, material *mat = NULL);
+        // moves instance i; build() puts it in its new place
+        void set_transform(int i, const affine& to_world);
+        void build();
+        int size() const { return int(instances.size()); }
+
+        // hits come back finished, in world space; before build() or with no instances nothing is hit
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (leaf_instances.empty())
+                return false;
+            box = nodes[0].box;
+            return true;
+        }
+
+        std::vector<hitable *> blases;
+        std::vector<aabb> blas_boxes;
+        std::vector<instance> instances;
+        std::vector<affine> instance_to_world; // beside instances, which have no room for it
+        std::vector<int> leaf_instances; // instances in leaf order
+        linear_bvh_node *nodes;
+        int node_count;
+        bvh_stats stats;
+};
+
+int instance_bvh::add_blas(hitable *h) {
+    // an infinite box would turn into NaNs once transformed, so such shapes are left out as linear_bvh leaves them out
+    aabb box;
+    if (!h->bounding_box(0, 1, box))
+        return -1;
+    blases.push_back(h);
+    blas_boxes.push_back(box);
+    return int(blases.size()) - 1;
+}
+
+void instance_bvh::add(int blas, const affine& to_world, material *mat) {
+    if (blas < 0)
+        return;
+    instance i = {to_world.inverse(), blas, mat};
+    instances.push_back(i);
+    instance_to_world.push_back(to_world);
+}
+
+void instance_bvh::set_transform(int i, const affine& to_world) {
+    instances[i].to_object = to_world.inverse();
+    instance_to_world[i] = to_world;
+}
+
+void instance_bvh::build() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int count = size();
+    std::vector<bvh_primitive> build_prims(count);
+    shared_thread_pool().parallel_for(0, count, bvh_parallel_chunk, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            build_prims[i].box = instance_to_world[i].box(blas_boxes[instances[i].blas]);
+            build_prims[i].centroid = build_prims[i].box.center();
+            build_prims[i].index = i;
+            build_prims[i].ptr = NULL;
+        }
+    });
+
+    std::vector<linear_bvh_node> out;
+    stats = bvh_stats();
+    leaf_instances.resize(count);
+    if (count == 0) {
+        out.push_back(empty_bvh_root());
+    } else {
+        std::atomic<int> build_nodes(0);
+        bvh_build_node *root = build_bvh_tree(&build_prims[0], 0, count, 0, instance_bvh_max_leaf, build_nodes, instance_bvh_intersect_cost);
+        stats.build_bytes = build_prims.size()*sizeof(bvh_primitive) + build_nodes*sizeof(bvh_build_node);
+        out.reserve(build_nodes);
+        flatten_bvh(out, root, 0, root->box.area(), stats, [](int first, int n) { return first; });
+        for (int i = 0; i < count; i++)
+            leaf_instances[i] = build_prims[i].index;
+    }
+
+    free(nodes);
+    node_count = int(out.size());
+    size_t bytes = sizeof(linear_bvh_node) * node_count;
+    nodes = (linear_bvh_node *)aligned_alloc(32, (bytes + 31) & ~size_t(31));
+    memcpy(nodes, &out[0], bytes);
+
+    stats.bytes = bytes + instances.size()*(sizeof(instance) + sizeof(affine)) + leaf_instances.size()*sizeof(int);
+    stats.build_bytes += out.capacity()*sizeof(linear_bvh_node);
+    stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool instance_bvh::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (leaf_instances.empty())
+        return false;
+    slab_ray sr(r);
+
+    float tnear;
+    if (!slab_hit(nodes[0].box, sr, t_min, t_max, tnear))
+        return false;
+
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    const instance *hit_instance = NULL;
+
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                const instance& in = instances[leaf_instances[i]];
+                if (blases[in.blas]->intersect(in.to_object.apply(r), t_min, t_max, rec)) {
+                    hit_instance = &in;
+                    t_max = rec.t;
+                }
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = slab_hit(nodes[near_child].box, sr, t_min, t_max, t_near);
+            bool hit_far = slab_hit(nodes[far_child].box, sr, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+
+    if (!hit_instance)
+        return false;
+    // the BLAS's surface needs its own space, so the hit is finished here rather than deferred
+    finish_surface(hit_instance->to_object.apply(r), rec);
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = unit_vector(hit_instance->to_object.transposed_vector(rec.normal));
+    if (hit_instance->mat)
+        rec.mat_ptr = hit_instance->mat;
+    return true;
+}
+
+bool instance_bvh::occluded(const ray& r, float t_min, float t_max) const {
+    if (leaf_instances.empty())
+        return false;
+    slab_ray sr(r);
+
+    int stack[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    float tnear;
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (slab_hit(node.box, sr, t_min, t_max, tnear)) {
+            if (node.count == 0) {
+                stack[sp++] = node.second_child;
+                index++;
+                continue;
+            }
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                const instance& in = instances[leaf_instances[i]];
+                if (blases[in.blas]->occluded(in.to_object.apply(r), t_min, t_max))
+                    return true;
+            }
+        }
+        if (sp == 0)
+            return false;
+        index = stack[--sp];
+    }
+}
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef LINEARBVHH
+#define LINEARBVHH
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "bvh.h"
+#include "ray_packet.h"
+
+/*
+    BVH compiled into one contiguous array of 32 byte nodes in depth first
+    order, flattened from the tree build_bvh_tree makes in parallel. An
+    interior node's first child is the next node in the array and second_child
+    indexes the other one; a leaf points at count primitives starting at
+    first_prim. Traversal is iterative, visits the nearer child
+    first and skips anything behind the closest hit found so far.
+*/
+
+/*
+    32 bytes, so the aligned_alloc'ed arrays traversal reads keep every node
+    on a 32 byte boundary. The type itself is not over-aligned: nodes are
+    also built in std::vectors, whose C++11 allocator ignores alignas.
+*/
+struct linear_bvh_node {
+    aabb box;
+    union {
+        int first_prim;   // leaves
+        int second_child; // interior nodes
+    };
+    int count;            // 0 for interior nodes
+};
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+/*
+    Root of a tree over nothing, so that nodes[0] exists. Its box is inside
+    out: unions ignore it and the slab_ray test never enters it. The packet
+    kernels take the smaller and larger of the two planes, which turns it
+    back into a box, so traversals check for an empty tree before reading
+    the root's children, which do not exist.
+*/
+inline linear_bvh_node empty_bvh_root() {
+    linear_bvh_node empty;
+    empty.box = aabb(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+    empty.second_child = 0;
+    empty.count = 0;
+    return empty;
+}
+
+// slab test that also returns where the ray enters the box
+inline bool slab_hit(const aabb& box, const slab_ray& r, float tmin, float tmax, float& tnear) {
+    return box.hit(r, tmin, tmax, tnear);
+}
+
+/*
+    Appends the subtree under node in depth first order, frees it and returns
+    its index. leaf(first, count) is called for every leaf's range of build
+    primitives and returns where the leaf's primitives start in the caller's
+    own arrays.
+*/
+template <class F>
+int flatten_bvh(std::vector<linear_bvh_node>& out, bvh_build_node *node, int depth, float root_area, bvh_stats& stats, F leaf) {
+    int index = int(out.size());
+    out.push_back(linear_bvh_node());
+    out[index].box = node->box;
+
+    float relative_area = root_area > 0 ? node->box.area() / root_area : 1;
+    stats.nodes++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    if (!node->left) {
+        out[index].first_prim = leaf(node->first, node->count);
+        out[index].count = node->count;
+        stats.leaves++;
+        stats.primitives += node->count;
+        stats.max_leaf_size = std::max(stats.max_leaf_size, node->count);
+        stats.sah_cost += relative_area * node->count * bvh_intersect_cost;
+    } else {
+        stats.sah_cost += relative_area * bvh_traversal_cost;
+        flatten_bvh(out, node->left, depth + 1, root_area, stats, leaf);
+        int second = flatten_bvh(out, node->right, depth + 1, root_area, stats, leaf);
+        out[index].second_child = second;
+        out[index].count = 0;
+    }
+    delete node;
+    return index;
+}
+
+class linear_bvh : public hitable {
+    public:
+        linear_bvh() : nodes(NULL), node_count(0) { packet_test = select_packet_box_test(&packet_kernel); }
+        linear_bvh(hitable **l, int n, float time0, float time1, int max_leaf_size = 4);
+        ~linear_bvh() { free(nodes); }
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual int intersect_packet(const ray_packet& p, float t_min, hit_record *rec) const;
+        virtual int occluded_packet(const ray_packet& p, float t_min) const;
+        // none for a BVH over nothing
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (prims.empty())
+                return false;
+            box = nodes[0].box;
+            return true;
+        }
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const;
+        bool intersect_subtree(int root, const ray& r, float t_min, float t_max, hit_record& rec) const;
+        bool occluded_subtree(int root, const ray& r, float t_min, float t_max) const;
+
+        linear_bvh_node *nodes;
+        int node_count;
+        std::vector<hitable *> prims;
+        int max_leaf_size;
+        bvh_stats stats;
+        packet_box_test_fn packet_test;
+        const char *packet_kernel;
+};
+
+linear_bvh::linear_bvh(hitable **l, int n, float time0, float time1, int leaf_size) : max_leaf_size(leaf_size) {
+    packet_test = select_packet_box_test(&packet_kernel);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<bvh_primitive> build_prims = make_bvh_primitives(l, n, time0, time1);
+    std::vector<linear_bvh_node> out;
+    if (build_prims.empty()) {
+        out.push_back(empty_bvh_root());
+    } else {
+        std::atomic<int> build_nodes(0);
+        bvh_build_node *root = build_bvh_tree(&build_prims[0], 0, int(build_prims.size()), 0, max_leaf_size, build_nodes);
+        stats.build_bytes = build_prims.size()*sizeof(bvh_primitive) + build_nodes*sizeof(bvh_build_node);
+
+        out.reserve(build_nodes);
+        prims.reserve(build_prims.size());
+        flatten_bvh(out, root, 0, root->box.area(), stats, [&](int first, int count) {
+            int start = int(prims.size());
+            for (int i = first; i < first + count; i++)
+                prims.push_back(build_prims[i].ptr);
+            return start;
+        });
+    }
+
+    node_count = int(out.size());
+    size_t bytes = sizeof(linear_bvh_node) * node_count;
+    nodes = (linear_bvh_node *)aligned_alloc(32, (bytes + 31) & ~size_t(31));
+    memcpy(nodes, &out[0], bytes);
+
+    stats.bytes = bytes + prims.size()*sizeof(hitable *);
+    stats.build_bytes += out.capacity()*sizeof(linear_bvh_node);
+    stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the union of the primitives' own transformed boxes, which is tighter than the transformed box of the root
+bool linear_bvh::transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+    if (prims.empty())
+        return hitable::transformed_bounding_box(to_world, t0, t1, box);
+    aabb prim_box;
+    for (size_t i = 0; i < prims.size(); i++) {
+        if (!prims[i]->transformed_bounding_box(to_world, t0, t1, prim_box))
+            prim_box = to_world.box(nodes[0].box);
+        box = i == 0 ? prim_box : surrounding_box(box, prim_box);
+    }
+    return true;
+}
+
+bool linear_bvh::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (prims.empty())
+        return false;
+    return intersect_subtree(0, r, t_min, t_max, rec);
+}
+
+bool linear_bvh::intersect_subtree(int root, const ray& r, float t_min, float t_max, hit_record& rec) const {
+    slab_ray sr(r);
+
+    float tnear;
+    if (!slab_hit(nodes[root].box, sr, t_min, t_max, tnear))
+        return false;
+
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = root;
+    bool hit_anything = false;
+
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                if (prims[i]->intersect(r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = slab_hit(nodes[near_child].box, sr, t_min, t_max, t_near);
+            bool hit_far = slab_hit(nodes[far_child].box, sr, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+
+        // pop the next subtree that is still in front of the closest hit
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+    return hit_anything;
+}
+
+// children are visited in array order since any hit ends the search
+bool linear_bvh::occluded(const ray& r, float t_min, float t_max) const {
+    if (prims.empty())
+        return false;
+    return occluded_subtree(0, r, t_min, t_max);
+}
+
+bool linear_bvh::occluded_subtree(int root, const ray& r, float t_min, float t_max) const {
+    slab_ray sr(r);
+
+    int stack[bvh_max_depth];
+    int sp = 0;
+    int index = root;
+    float tnear;
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (slab_hit(node.box, sr, t_min, t_max, tnear)) {
+            if (node.count == 0) {
+                stack[sp++] = node.second_child;
+                index++;
+                continue;
+            }
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++)
+                if (prims[i]->occluded(r, t_min, t_max))
+                    return true;
+        }
+        if (sp == 0)
+            return false;
+        index = stack[--sp];
+    }
+}
+
+/*
+    Packet traversal. Each node is visited with the mask of lanes that
+    reached it: a coherent packet first tries to cull the child for all of
+    them with the interval test, then the lane test narrows the mask.
+    Children are ordered by the nearest entry among their lanes. Rays that
+    diverge leave lanes behind, and once only one is left the rest of the
+    subtree is walked with the single ray code.
+*/
+int linear_bvh::intersect_packet(const ray_packet& p, float t_min, hit_record *rec) const {
+    if (prims.empty())
+        return 0;
+    alignas(32) float t_max[packet_size];
+    memcpy(t_max, p.t_max, sizeof(t_max));
+    float packet_t_max = -FLT_MAX;
+    for (int i = 0; i < packet_size; i++)
+        if (p.active & (1 << i)) packet_t_max = ffmax(packet_t_max, t_max[i]);
+
+    alignas(32) float tnear[packet_size], tnear_far[packet_size];
+    int stack[bvh_max_depth];
+    int stack_mask[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    int mask = packet_test(nodes[0].box, p, p.active, t_min, t_max, tnear);
+    int hits = 0;
+
+    while (mask) {
+        const linear_bvh_node& node = nodes[index];
+        if ((mask & (mask - 1)) == 0) {
+            int i = __builtin_ctz(mask);
+            if (intersect_subtree(index, p.r[i], t_min, t_max[i], rec[i])) {
+                hits |= mask;
+                t_max[i] = rec[i].t;
+            }
+        } else if (node.count > 0) {
+            for (int k = node.first_prim; k < node.first_prim + node.count; k++) {
+                for (int m = mask; m; m &= m - 1) {
+                    int i = __builtin_ctz(m);
+                    if (prims[k]->intersect(p.r[i], t_min, t_max[i], rec[i])) {
+                        hits |= 1 << i;
+                        t_max[i] = rec[i].t;
+                    }
+                }
+            }
+            packet_t_max = -FLT_MAX;
+            for (int i = 0; i < packet_size; i++)
+                if (p.active & (1 << i)) packet_t_max = ffmax(packet_t_max, t_max[i]);
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            int near_mask = 0, far_mask = 0;
+            float t_near = FLT_MAX, t_far = FLT_MAX;
+            if (!p.coherent || p.may_hit(nodes[near_child].box, t_min, packet_t_max)) {
+                near_mask = packet_test(nodes[near_child].box, p, mask, t_min, t_max, tnear);
+                for (int m = near_mask; m; m &= m - 1)
+                    t_near = ffmin(t_near, tnear[__builtin_ctz(m)]);
+            }
+            if (!p.coherent || p.may_hit(nodes[far_child].box, t_min, packet_t_max)) {
+                far_mask = packet_test(nodes[far_child].box, p, mask, t_min, t_max, tnear_far);
+                for (int m = far_mask; m; m &= m - 1)
+                    t_far = ffmin(t_far, tnear_far[__builtin_ctz(m)]);
+            }
+            if (near_mask && far_mask) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(near_mask, far_mask);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_mask[sp] = far_mask;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                mask = near_mask;
+                continue;
+            } else if (near_mask) {
+                index = near_child;
+                mask = near_mask;
+                continue;
+            } else if (far_mask) {
+                index = far_child;
+                mask = far_mask;
+                continue;
+            }
+        }
+
+        // pop the next subtree that is still in front of some lane's closest hit
+        mask = 0;
+        while (sp > 0 && !mask) {
+            sp--;
+            if (stack_t[sp] > packet_t_max)
+                continue;
+            for (int m = stack_mask[sp]; m; m &= m - 1) {
+                int i = __builtin_ctz(m);
+                if (stack_t[sp] <= t_max[i]) mask |= 1 << i;
+            }
+            index = stack[sp];
+        }
+    }
+    return hits;
+}
+
+// lanes drop out as soon as they are blocked
+int linear_bvh::occluded_packet(const ray_packet& p, float t_min) const {
+    if (prims.empty())
+        return 0;
+    alignas(32) float t_max[packet_size];
+    memcpy(t_max, p.t_max, sizeof(t_max));
+    float packet_t_max = -FLT_MAX;
+    for (int i = 0; i < packet_size; i++)
+        if (p.active & (1 << i)) packet_t_max = ffmax(packet_t_max, t_max[i]);
+
+    alignas(32) float tnear[packet_size];
+    int stack[bvh_max_depth];
+    int stack_mask[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    int mask = p.active;
+    int blocked = 0;
+
+    for (;;) {
+        mask &= ~blocked;
+        const linear_bvh_node& node = nodes[index];
+        if ((mask & (mask - 1)) == 0) {
+            if (mask && occluded_subtree(index, p.r[__builtin_ctz(mask)], t_min, t_max[__builtin_ctz(mask)]))
+                blocked |= mask;
+        } else if (!p.coherent || p.may_hit(node.box, t_min, packet_t_max)) {
+            mask = packet_test(node.box, p, mask, t_min, t_max, tnear);
+            if (mask && node.count == 0) {
+                stack[sp] = node.second_child;
+                stack_mask[sp++] = mask;
+                index++;
+                continue;
+            }
+            for (int k = node.first_prim; mask && k < node.first_prim + node.count; k++) {
+                for (int m = mask; m; m &= m - 1) {
+                    int i = __builtin_ctz(m);
+                    if (prims[k]->occluded(p.r[i], t_min, t_max[i])) {
+                        blocked |= 1 << i;
+                        mask &= ~(1 << i);
+                    }
+                }
+            }
+        }
+        if (blocked == p.active || sp == 0)
+            return blocked;
+        index = stack[--sp];
+        mask = stack_mask[sp];
+    }
+}
+
+#endif
@@ -1,19 +1,17 @@
 #include <fstream>
 #include <iostream>
 #include <string>
-#include <time.h>
+#include <chrono>
 #include <vector>
 
 #include "ray.h"
-#include "sphere.h"
-#include "rectangle.h"
-#include "box.h"
-#include "hitable_list.h"
 #include "float.h"
 #include "camera.h"
-#include "material.h"
-#include "parallel.h"
-#include "constant_medium.h"
+#include "compiled_scene.h"
+#include "random.h"
+#include "render.h"
+#include "scenes.h"
+#include "wavefront.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -26,127 +24,30 @@ struct Options {
     int nSamples = 1;
     int xResolution = 600;
     int yResolution = 300;
+    unsigned long seed = 0;
+    std::string scene = "final";
+    int tileSize = 16;
+    unsigned long threads = 0;
+    bool pinThreads = false;
+    int grain = 0;
+    int maxDepth = 50;
+    int rrStartDepth = 5;
+    bool lightSampling = true;
+    bool packets = false;
+    bool compiled = false;
+    std::string integrator = "path";
+    int waveSize = 1 << 14;
+    bool hugePages = false;
+    std::string sphereFile;
+    int spheres = 1000000;
+    std::string meshFile;
+    int triangles = 1000000;
+    bool instancing = false;
+    int trees = 10000;
+    float bounce = 0.5;
+    int timeSegments = 1;
 };
 
-vec3 color(const ray& r, hitable *world, int depth) {
-    hit_record rec;
-    if (world->hit(r, 0.001,FLT_MAX, rec)) {
-        ray scattered_ray;
-        vec3 attenuation = vec3(0.5,0.5,0.5);
-        vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-        if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered_ray)) {
-            return emitted + attenuation*color(scattered_ray, world, depth+1);
-        } else {
-            return emitted;
-        }
-    } else {
-        return vec3(0,0,0);
-    }
-}
-
-hitable *random_scene(unsigned char **tex_data) {
-    vec3 colors[6] = {
-            vec3(0.37,0.62,0.58),
-            vec3(0.24,0.21,0.22),
-            vec3(0.45,0.21,0.20),
-            vec3(0.71,0.38,0.22),
-            vec3(0.69,0.63,0.64),
-            vec3(0.89,0.85,0.82),
-    };
-
-    int n = 500;
-    hitable **list = new hitable*[n+1];
-    list[0] =  new sphere(vec3(0,-1000,0), 1000, new diffuse_light(new constant_texture(vec3(1.1,1.1,1.1))));
-
-    int i = 1;
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            float choose_mat = drand48();
-            vec3 center(a+0.9*drand48(),0.2,b+0.9*drand48());
-            vec3 color;
-            color = colors[ int(drand48()*5) ];
-
-            if ((center-vec3(4,0.2,0)).length() > 0.9) { 
-                if (choose_mat < 0.3) {  // diffuse
-                    list[i++] = new sphere(center, 0.2, new lambertian(new constant_texture(color)));
-                }
-                else if (choose_mat < 0.6) { // metal
-                    list[i++] = new sphere(center, 0.2, new metal(vec3(0.5*(1 + drand48()), 0.5*(1 + drand48()), 0.5*(1 + drand48())),  0.5*drand48()));
-                }
-                else {  // glass
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
-                }
-            }
-        }
-    }
-
-    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-
-    int nx, ny, nn;
-    *tex_data = stbi_load("textures/earth.jpg", &nx, &ny, &nn, 0);
-    if (tex_data == NULL) {
-        std::cout << "Error: texture could not be loaded!" << std::endl;
-        return NULL;
-    }
-
-    material *mat = new lambertian(new image_texture(*tex_data, nx, ny));
-    list[i++] = new sphere(vec3(4, 1, 0), 1.0, mat);
-
-    list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new metal(colors[4], 0.0));
-    return new bvh_node(list,i,0.0, 1.0);
-}
-
-hitable *cornell_box() {
-    hitable **list = new hitable*[6];
-    int i = 0;
-    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
-
-    list[i++] = new flip_normals(new yz_rect(0, 700, 0, 700, 700, white));
-    list[i++] = new yz_rect(0, 700, 0, 700, -700, white);
-    list[i++] = new flip_normals(new xz_rect(-700, 700, -700, 700, 700, white));
-    list[i++] = new xz_rect(-700, 700, -700, 700, 0, white);
-    list[i++] = new flip_normals(new xy_rect(-700, 700, 0, 700, 700, white));
-
-    return new hitable_list(list,i);
-}
-
-hitable *final() {
-    hitable **list = new hitable*[500];
-    int count = 0;
-    material *red = new lambertian( new constant_texture(vec3(0.65, 0.05, 0.05)) );
-    material *white = new lambertian( new constant_texture(vec3(0.73, 0.73, 0.73)) );
-    material *green = new lambertian( new constant_texture(vec3(0.12, 0.45, 0.15)) );
-    material *light = new diffuse_light( new constant_texture(vec3(15, 15, 15)) );
-
-    list[count++] = cornell_box();
-    
-    for (int i=0; i < 6; i++) {
-        for (int j = 0; j < 6; j++) {
-            float x = (drand48()*900)-450;
-            float y = drand48()*700;  
-            float z = (drand48()*900)-450;
-
-            list[count++] = new sphere(vec3(x,y,z), 50, white);
-        }
-    }
-
-    for (int i=0; i < 28; i++) {
-
-        list[count++] = new box(
-            vec3(650-(50*i),0,400-drand48()*100),
-            vec3(700-(50*i),100+drand48()*200,700),
-            green
-        );
-
-    }
-
-    list[count++] = new constant_medium(cornell_box(), 0.01, new constant_texture(vec3(1.0, 1.0, 1.0)));
-
-    list[count++] = new xz_rect(-200, 200, 0, 200, 554, light);
-
-    return new hitable_list(list, count);
-}
-
 int main(int argc, char *argv[]) {
     Options options;
 
@@ -160,54 +61,211 @@ int main(int argc, char *argv[]) {
             options.xResolution = stoi(argString.substr(14,argString.length()));
         } else if (argString.substr(0,14) == "--yResolution=") {
             options.yResolution = stoi(argString.substr(14,argString.length()));
+        } else if (argString.substr(0,11) == "--tileSize=") {
+            options.tileSize = std::max(1, stoi(argString.substr(11,argString.length())));
+        } else if (argString.substr(0,10) == "--threads=") {
+            options.threads = stoul(argString.substr(10,argString.length()));
+        } else if (argString == "--pinThreads") {
+            options.pinThreads = true;
+        } else if (argString.substr(0,8) == "--grain=") {
+            options.grain = stoi(argString.substr(8,argString.length()));
+        } else if (argString.substr(0,11) == "--maxDepth=") {
+            options.maxDepth = stoi(argString.substr(11,argString.length()));
+        } else if (argString.substr(0,15) == "--rrStartDepth=") {
+            options.rrStartDepth = stoi(argString.substr(15,argString.length()));
+        } else if (argString == "--noLightSampling") {
+            options.lightSampling = false;
+        } else if (argString == "--packets") {
+            options.packets = true;
+        } else if (argString == "--compiled") {
+            options.compiled = true;
+        } else if (argString.substr(0,13) == "--integrator=") {
+            options.integrator = argString.substr(13,argString.length());
+        } else if (argString.substr(0,11) == "--waveSize=") {
+            options.waveSize = stoi(argString.substr(11,argString.length()));
+        } else if (argString == "--hugePages") {
+            options.hugePages = true;
+        } else if (argString.substr(0,13) == "--sphereFile=") {
+            options.sphereFile = argString.substr(13,argString.length());
+        } else if (argString.substr(0,10) == "--spheres=") {
+            options.spheres = stoi(argString.substr(10,argString.length()));
+        } else if (argString.substr(0,11) == "--meshFile=") {
+            options.meshFile = argString.substr(11,argString.length());
+        } else if (argString.substr(0,12) == "--triangles=") {
+            options.triangles = stoi(argString.substr(12,argString.length()));
+        } else if (argString == "--instancing") {
+            options.instancing = true;
+        } else if (argString.substr(0,8) == "--trees=") {
+            options.trees = stoi(argString.substr(8,argString.length()));
+        } else if (argString.substr(0,9) == "--bounce=") {
+            options.bounce = stof(argString.substr(9,argString.length()));
+        } else if (argString.substr(0,15) == "--timeSegments=") {
+            options.timeSegments = std::max(1, stoi(argString.substr(15,argString.length())));
+        } else if (argString.substr(0,8) == "--scene=") {
+            options.scene = argString.substr(8,argString.length());
+        } else if (argString.substr(0,7) == "--seed=") {
+            options.seed = stoul(argString.substr(7,argString.length()));
         } else {
             std::cout << "Error: parameter \"" << argString << "\" unknown!" << std::endl;
             return 0;
         }
     }
 
-    srand(time(0));
+    shared_thread_pool_settings().threads = options.threads;
+    shared_thread_pool_settings().pin = options.pinThreads;
+    shared_thread_pool_settings().grain = options.grain;
+    seed_thread_rng(options.seed, 0);
 
     std::cout<< "Samples: " << options.nSamples << std::endl;
+    std::cout<< "Max depth: " << options.maxDepth << ", Russian roulette from depth " << options.rrStartDepth << std::endl;
+    std::cout<< "Light sampling: " << (options.lightSampling ? "on" : "off") << std::endl;
+    if (options.integrator != "path" && options.integrator != "wavefront") {
+        std::cout << "Error: integrator \"" << options.integrator << "\" unknown!" << std::endl;
+        return 0;
+    }
+    std::cout<< "Integrator: " << options.integrator << std::endl;
+    std::cout<< "Packets: " << (options.packets ? "on" : "off") << std::endl;
+    std::cout<< "Instancing: " << (options.instancing ? "on" : "off") << std::endl;
+    std::cout<< "Compiled scene: " << (options.compiled ? "on" : "off") << std::endl;
     std::cout<< "Resolution " << options.xResolution << " " << options.yResolution << std::endl;
+    std::cout<< "Seed: " << options.seed << std::endl;
+    cpu_budget budget = detect_cpu_budget();
+    std::cout<< "CPUs: " << budget << std::endl;
+    std::cout<< "Threads: " << shared_thread_pool().size() << (options.threads ? " (--threads)" : " (from CPUs)")
+             << (options.pinThreads ? ", pinned" : "") << std::endl;
+    std::cout<< "Scene: " << options.scene << std::endl;
     std::cout<< "Creating image " << options.fileName << "..." << std::endl;
 
+    // everything the scene allocates lives in scene_arena and goes with it
+    arena scene_arena(size_t(1) << 20, options.hugePages);
+    arena_scope scene_scope(scene_arena);
+    std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
     unsigned char *tex_data;
-    //hitable *world = random_scene(&tex_data);
-    hitable *world = final();
-    // if (tex_data == NULL || world == NULL) {
-    //     std::cout << "Error: creating scene has failed" << std::endl;
-    //     return 0;
-    // }
+    hitable *world;
+    hitable *lights = NULL;
+    vec3 lookfrom, lookat;
+    float vfov;
+    if (options.scene == "random") {
+        world = options.instancing ? instanced_random_scene(&tex_data, &lights) : random_scene(&tex_data, &lights);
+        lookfrom = vec3(13,2,3);
+        lookat = vec3(0,0,0);
+        vfov = 20;
+    } else if (options.scene == "motion") {
+        world = motion_scene(&tex_data, options.bounce, options.timeSegments, &lights);
+        if (world)
+            std::cout<< "Motion BVH: bounce " << options.bounce << ", " << options.timeSegments << " time segments, "
+                     << ((motion_bvh *)world)->stats << std::endl;
+        lookfrom = vec3(13,2,3);
+        lookat = vec3(0,0,0);
+        vfov = 20;
+    } else if (options.scene == "final") {
+        world = final(&lights);
+        lookfrom = vec3(0,278,-800);
+        lookat = vec3(0,278,0);
+        vfov = 40;
+    } else if (options.scene == "particles") {
+        sphere_set *set;
+        world = particles(options.sphereFile, options.spheres, &set, &lights);
+        std::cout<< "Spheres: " << set->size() << (options.sphereFile.empty() ? " (random)" : " from " + options.sphereFile)
+                 << ", " << set->kernel << " kernel" << std::endl;
+        std::cout<< "Sphere BVH: " << set->stats << std::endl;
+        lookfrom = vec3(0,0,-250);
+        lookat = vec3(0,0,0);
+        vfov = 40;
+    } else if (options.scene == "mesh") {
+        triangle_mesh *mesh;
+        world = mesh_scene(options.meshFile, options.triangles, &mesh, &lights);
+        if (world) {
+            std::cout<< "Mesh: " << mesh->size() << " triangles, " << mesh->vertices() << " vertices"
+                     << (mesh->normals.empty() ? "" : ", normals") << (mesh->uvs.empty() ? "" : ", uvs")
+                     << (options.meshFile.empty() ? " (torus)" : " from " + options.meshFile) << ", " << mesh->kernel << " kernel" << std::endl;
+            if (!options.meshFile.empty())
+                std::cout<< "Mesh load: " << mesh->load_seconds << " s, " << mesh->load_bytes / (1024.0*1024.0) << " MB, "
+                         << mesh->size() / mesh->load_seconds / 1e6 << " M triangles/s" << std::endl;
+            float n = float(mesh->size());
+            std::cout<< "Mesh memory: " << mesh->stats.bytes / n << " bytes/triangle: " << mesh->index_bytes() / n << " indices, "
+                     << mesh->vertex_bytes() / n << " vertices, " << mesh->triangle_bytes() / n << " intersection data, "
+                     << mesh->node_bytes() / n << " BVH" << std::endl;
+            std::cout<< "Mesh BVH: " << mesh->stats << std::endl;
+        }
+        lookfrom = vec3(0,80,-200);
+        lookat = vec3(0,0,0);
+        vfov = 40;
+    } else if (options.scene == "forest") {
+        hitable *trees;
+        world = forest(options.trees, options.instancing, &trees, &lights);
+        if (instance_bvh *top = dynamic_cast<instance_bvh *>(trees)) {
+            std::cout<< "Instances: " << top->size() << " of " << top->blases.size() << " BLASes" << std::endl;
+            std::cout<< "Top level BVH: " << top->stats << std::endl;
+        } else {
+            std::cout<< "Trees: " << ((linear_bvh *)trees)->stats << std::endl;
+        }
+        float half = 1.5f * ceil(sqrt(float(options.trees)));
+        lookfrom = vec3(0,12,-half - 10);
+        lookat = vec3(0,3,std::min(-half + 40, 0.0f));
+        vfov = 40;
+    } else {
+        std::cout << "Error: scene \"" << options.scene << "\" unknown!" << std::endl;
+        return 0;
+    }
+    if (world == NULL) {
+        std::cout << "Error: creating scene has failed" << std::endl;
+        return 0;
+    }
+    std::cout<< "Scene build: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count() << " s" << std::endl;
+    std::cout<< "Scene memory: " << scene_arena.bytes_used() / (1024.0*1024.0) << " MB in " << scene_arena.objects() << " objects, "
+             << scene_arena.bytes_reserved() / (1024.0*1024.0) << " MB reserved" << (options.hugePages ? " in huge pages" : "") << std::endl;
+    if (linear_bvh *bvh = dynamic_cast<linear_bvh *>(world)) {
+        std::cout<< "BVH: " << bvh->stats << std::endl;
+    }
+    if (instance_bvh *top = dynamic_cast<instance_bvh *>(world)) {
+        std::cout<< "Instances: " << top->size() << " of " << top->blases.size() << " BLASes" << std::endl;
+        std::cout<< "Top level BVH: " << top->stats << std::endl;
+    }
+    compiled_scene *compiled = NULL;
+    if (options.compiled) {
+        world = compiled = new compiled_scene(world, 0, 1);
+        std::cout<< "Compiled: " << compiled->source_hitables << " objects into " << compiled->prims.size() << " primitives: "
+                 << compiled->spheres.size() + compiled->moving_spheres.size() << " spheres, "
+                 << compiled->xy_rects.size() + compiled->xz_rects.size() + compiled->yz_rects.size() + compiled->quads.size() << " rectangles, "
+                 << compiled->boxes.size() << " boxes, "
+                 << compiled->hitables.size() << " other shapes, " << compiled->materials.size() << " materials" << std::endl;
+        std::cout<< "Compiled BVH: " << compiled->stats << std::endl;
+    }
 
-    vec3 lookfrom(0,278,-800);
-    vec3 lookat(0,278,0);
     float dist_to_focus = 10;
     float aperture = 0.0;
 
-    camera cam(lookfrom, lookat, vec3(0,1,0), 40, float(options.xResolution)/float(options.yResolution), aperture, dist_to_focus, 0, 1);
-
-    char* image;
-    image = new char[options.xResolution*options.yResolution*3];
-
-    parallel_for_each(0, options.yResolution, [=,&image,&cam](int j){
-        for (int i=0; i < options.xResolution; i++) {
-                vec3 col(0,0,0);
-                for (int s=0; s < options.nSamples; s++) {
-                    float u = float(i + random_float()) / float(options.xResolution);
-                    float v = float(j + random_float()) / float(options.yResolution);
-                    ray r = cam.get_ray(u, v);
-                    vec3 p = r.point_at_parameter(2.0);
-                    col += color(r, world, 0);
-                }
-                col /= float(options.nSamples);
-                col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-
-                image[(j*options.xResolution*3) + (i*3)] = char(255.99*col[0]);
-                image[(j*options.xResolution*3) + (i*3+1)] = int(255.99*col[1]);
-                image[(j*options.xResolution*3) + (i*3+2)] = int(255.99*col[2]);
-            }
-    });
+    camera cam(lookfrom, lookat, vec3(0,1,0), vfov, float(options.xResolution)/float(options.yResolution), aperture, dist_to_focus, 0, 1);
+
+    render_settings settings;
+    settings.nx = options.xResolution;
+    settings.ny = options.yResolution;
+    settings.ns = options.nSamples;
+    settings.seed = options.seed;
+    settings.tile_size = options.tileSize;
+    settings.max_depth = options.maxDepth;
+    settings.rr_start_depth = options.rrStartDepth;
+    settings.light_sampling = options.lightSampling;
+    settings.packets = options.packets;
+    settings.wave_size = options.waveSize;
+
+    unsigned char *image = new unsigned char[options.xResolution*options.yResolution*3];
+    std::chrono::steady_clock::time_point render_start = std::chrono::steady_clock::now();
+    render_stats stats;
+    if (options.integrator == "wavefront")
+        stats = render_wavefront(world, lights, cam, settings, image);
+    else if (compiled)
+        stats = render(world, lights, cam, settings, image, *compiled);
+    else
+        stats = render(world, lights, cam, settings, image);
+    std::cout<< "Render: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count() << " s" << std::endl;
+    std::cout<< "Paths: " << stats.paths << ", " << stats.rays << " rays, average path length " << stats.average_path_length() << std::endl;
+    for (unsigned long i=0; i<stats.load.size(); i++) {
+        const thread_load& load = stats.load[i];
+        std::cout<< "Thread " << i << ": busy " << load.busy_seconds << " s, idle " << load.idle_seconds
+                 << " s, " << load.tiles << " tiles (" << load.stolen << " stolen)" << std::endl;
+    }
 
     // stbi_image_free(tex_data);
 
@@ -217,7 +275,11 @@ int main(int argc, char *argv[]) {
     cFileName[fileNameSize] = '\0';
     
     stbi_flip_vertically_on_write(1);
-    int success = stbi_write_jpg(cFileName, options.xResolution, options.yResolution, 3, image, 100);
+    int success;
+    std::future<void> written = shared_thread_pool().submit([&]() {
+        success = stbi_write_jpg(cFileName, options.xResolution, options.yResolution, 3, image, 100);
+    });
+    shared_thread_pool().wait(written);
     if (!success) {
         std::cout << "Error: writing to file failed!" << std::endl;
     }
@@ -1,14 +1,12 @@
 #ifndef MATERIALH
 #define MATERIALH
 
+#include <atomic>
+
 #include "ray.h"
 #include "hitable.h"
 #include "texture.h"
-
-float random_float() {
-    // returns a random float [0, 1)
-    return ((float) rand() / (RAND_MAX));
-}
+#include "random.h"
 
 vec3 random_in_unit_sphere() {
     vec3 p;
@@ -18,6 +16,24 @@ vec3 random_in_unit_sphere() {
     return p;
 }
 
+vec3 random_unit_vector() {
+    float z = 1 - 2*random_float();
+    float r = sqrt(ffmax(0, 1 - z*z));
+    float phi = 2*M_PI*random_float();
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+// direction inside the cone a sphere of radius covers from distance_squared away, around +z
+vec3 random_to_sphere(float radius, float distance_squared) {
+    float r1 = random_float();
+    float r2 = random_float();
+    float z = 1 + r2*(sqrt(1-radius*radius/distance_squared) - 1);
+    float phi = 2*M_PI*r1;
+    float x = cos(phi)*sqrt(1-z*z);
+    float y = sin(phi)*sqrt(1-z*z);
+    return vec3(x, y, z);
+}
+
 vec3 reflect(const vec3& v, const vec3& n) {
     return v-2*dot(v,n)*n;
 };
@@ -42,19 +58,42 @@ float schlick(float cosine, float ref_idx) {
 
 class material {
     public:
+        static void *operator new(size_t bytes) { return scene_new<material>(bytes); }
+        static void operator delete(void *p) { scene_delete(p); }
+        material() : id(next_id()) {}
+        virtual ~material() {}
         virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
         virtual vec3 emitted(float u, float v, const vec3& p) const { return vec3(0,0,0); }
+        /*
+            pdf of scatter() picking scattered. Materials that return non-zero
+            sample proportionally to their BSDF times cosine, so attenuation
+            times this pdf gives the BSDF times cosine for any direction, which
+            lets the integrator sample lights for them. Specular materials
+            keep the default of 0.
+        */
+        virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const { return 0; }
+
+        // materials are numbered in the order they are made, which unlike their addresses is the same every run
+        int id;
+        static int next_id() {
+            static std::atomic<int> count(0);
+            return count++;
+        }
 };
 
 class lambertian : public material {
     public:
         lambertian(texture *a) : albedo(a) {}
         virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
-            vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-            scattered = ray(rec.p, target-rec.p, r_in.time());
+            // cosine weighted around the normal
+            scattered = ray(rec.p, rec.normal + random_unit_vector(), r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
+        virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+            float cosine = dot(rec.normal, unit_vector(scattered.direction()));
+            return cosine < 0 ? 0 : cosine / M_PI;
+        }
 
         texture *albedo;
 };
@@ -124,10 +163,13 @@ class isotropic : public material {
     public:
         isotropic(texture *a) : albedo(a) {}
         virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
-            scattered = ray(rec.p, random_in_unit_sphere());
+            scattered = ray(rec.p, random_unit_vector(), r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
+        virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+            return 1 / (4*M_PI);
+        }
         texture *albedo;
 };
 
@@ -0,0 +1,231 @@
+#ifndef MOTIONBVHH
+#define MOTIONBVHH
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "linear_bvh.h"
+
+/*
+    BVH for scenes with motion blur. A linear_bvh built over the shutter
+    holds the box each moving shape sweeps, so a fast sphere's box is as
+    long as its path and every ray, whatever its time, has to test it.
+    Here every node keeps its bounds at the start and the end of its time
+    span instead, and a ray tests the box interpolated to ray.time(). For
+    shapes that move linearly, as moving_sphere does, the interpolated box
+    of a leaf is exactly the box at that time, and a node's interpolated
+    box still holds its children's.
+
+    Shapes moving in different directions still pull the interpolated box
+    of their node apart. So the shutter can also be cut into segments,
+    each with a BVH built over its own span and bounds at its own ends:
+    splitting in time, for the cost of a tree per segment.
+*/
+
+struct alignas(64) motion_bvh_node {
+    aabb box0;            // bounds at the start of the segment
+    aabb box1;            // and at its end
+    union {
+        int first_prim;   // leaves
+        int second_child; // interior nodes
+    };
+    int count;            // 0 for interior nodes
+
+    aabb at(float s) const {
+        return aabb(box0._min + s*(box1._min - box0._min), box0._max + s*(box1._max - box0._max));
+    }
+};
+
+class motion_bvh : public hitable {
+    public:
+        /*
+            Shapes have to move linearly within each of the segments the
+            shutter [time0, time1] is cut into, and rays have to have times
+            within the shutter: a ray from outside it is tested against the
+            boxes at the nearer end, which need not hold the shapes then.
+        */
+        motion_bvh(hitable **l, int n, float time0, float time1, int segments = 1, int max_leaf_size = 4);
+        ~motion_bvh() { free(nodes); }
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            box = bounds;
+            return !prims.empty();
+        }
+        // the tree for the ray's time and how far through its segment the time is
+        int segment(float time, float& s) const;
+
+        motion_bvh_node *nodes;
+        int node_count;
+        std::vector<int> roots;          // one per segment
+        std::vector<hitable *> prims;    // every segment's leaves, one after the other
+        float time0, time1;
+        aabb bounds;                     // over the whole shutter
+        bvh_stats stats;
+};
+
+motion_bvh::motion_bvh(hitable **l, int n, float t0, float t1, int segments, int max_leaf_size) : time0(t0), time1(t1) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<linear_bvh_node> out;
+    std::vector<aabb> end_boxes[2];
+    bounds = aabb(vec3(0,0,0), vec3(0,0,0));
+    for (int k = 0; k < segments; k++) {
+        float seg_t0 = time0 + (time1 - time0) * k / segments;
+        float seg_t1 = time0 + (time1 - time0) * (k + 1) / segments;
+        // the tree is shaped by the boxes swept over the segment, which keeps apart shapes whose paths do
+        std::vector<bvh_primitive> build_prims = make_bvh_primitives(l, n, seg_t0, seg_t1);
+        int first = int(out.size());
+        roots.push_back(first);
+        if (build_prims.empty()) {
+            linear_bvh_node empty = empty_bvh_root();
+            out.push_back(empty);
+            end_boxes[0].push_back(empty.box);
+            end_boxes[1].push_back(empty.box);
+            continue;
+        }
+        std::atomic<int> build_nodes(0);
+        bvh_build_node *root = build_bvh_tree(&build_prims[0], 0, int(build_prims.size()), 0, max_leaf_size, build_nodes);
+        stats.build_bytes = std::max(stats.build_bytes, build_prims.size()*sizeof(bvh_primitive) + build_nodes*sizeof(bvh_build_node));
+        flatten_bvh(out, root, 0, root->box.area(), stats, [&](int first_build, int count) {
+            int leaf_start = int(prims.size());
+            for (int i = first_build; i < first_build + count; i++)
+                prims.push_back(build_prims[i].ptr);
+            return leaf_start;
+        });
+
+        // bounds at the segment's ends, children before parents as they come after them in out
+        int last = int(out.size());
+        end_boxes[0].resize(last);
+        end_boxes[1].resize(last);
+        for (int i = last - 1; i >= first; i--) {
+            const linear_bvh_node& node = out[i];
+            for (int e = 0; e < 2; e++) {
+                float time = e ? seg_t1 : seg_t0;
+                aabb box;
+                if (node.count > 0) {
+                    for (int p = node.first_prim; p < node.first_prim + node.count; p++) {
+                        aabb prim_box;
+                        prims[p]->bounding_box(time, time, prim_box);
+                        box = p == node.first_prim ? prim_box : surrounding_box(box, prim_box);
+                    }
+                } else {
+                    box = surrounding_box(end_boxes[e][i + 1], end_boxes[e][node.second_child]);
+                }
+                end_boxes[e][i] = box;
+            }
+        }
+        aabb segment_bounds = surrounding_box(end_boxes[0][first], end_boxes[1][first]);
+        bounds = k == 0 ? segment_bounds : surrounding_box(bounds, segment_bounds);
+    }
+    stats.sah_cost /= segments;
+
+    node_count = int(out.size());
+    nodes = (motion_bvh_node *)aligned_alloc(64, sizeof(motion_bvh_node) * node_count);
+    for (int i = 0; i < node_count; i++) {
+        nodes[i].box0 = end_boxes[0][i];
+        nodes[i].box1 = end_boxes[1][i];
+        nodes[i].first_prim = out[i].first_prim;
+        nodes[i].count = out[i].count;
+    }
+
+    stats.bytes = sizeof(motion_bvh_node) * node_count + prims.size()*sizeof(hitable *) + roots.size()*sizeof(int);
+    stats.build_bytes += out.capacity()*sizeof(linear_bvh_node) + 2*end_boxes[0].capacity()*sizeof(aabb);
+    stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline int motion_bvh::segment(float time, float& s) const {
+    int segments = int(roots.size());
+    float x = time1 > time0 ? (time - time0) / (time1 - time0) * segments : 0;
+    int k = std::min(std::max(int(floorf(x)), 0), segments - 1);
+    // a node's box is only known to hold its children's between the segment's ends
+    s = ffmin(ffmax(x - k, 0.0f), 1.0f);
+    return roots[k];
+}
+
+bool motion_bvh::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    slab_ray sr(r);
+    float s;
+    int root = segment(r.time(), s);
+
+    float tnear;
+    if (!nodes[root].at(s).hit(sr, t_min, t_max, tnear))
+        return false;
+
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = root;
+    bool hit_anything = false;
+
+    for (;;) {
+        const motion_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++) {
+                if (prims[i]->intersect(r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = nodes[near_child].at(s).hit(sr, t_min, t_max, t_near);
+            bool hit_far = nodes[far_child].at(s).hit(sr, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+    return hit_anything;
+}
+
+bool motion_bvh::occluded(const ray& r, float t_min, float t_max) const {
+    slab_ray sr(r);
+    float s;
+    int index = segment(r.time(), s);
+
+    int stack[bvh_max_depth];
+    int sp = 0;
+    float tnear;
+    for (;;) {
+        const motion_bvh_node& node = nodes[index];
+        if (node.at(s).hit(sr, t_min, t_max, tnear)) {
+            if (node.count == 0) {
+                stack[sp++] = node.second_child;
+                index++;
+                continue;
+            }
+            for (int i = node.first_prim; i < node.first_prim + node.count; i++)
+                if (prims[i]->occluded(r, t_min, t_max))
+                    return true;
+        }
+        if (sp == 0)
+            return false;
+        index = stack[--sp];
+    }
+}
+
+#endif
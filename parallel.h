@@ -1,10 +1,26 @@
 #ifndef PARALLELH
 #define PARALLELH
 
+#include <algorithm>
+#include <chrono>
 #include <thread>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <future>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "arena.h"
+
 class join_threads {
     std::vector<std::thread>& threads;
     public:
@@ -18,43 +34,404 @@ class join_threads {
         }
 };
 
-void parallel_for_each(int first, int last, const std::function<void(int)> &f){
-    unsigned long const length = last-first;
+// CPUs this process may run on, in order
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+#endif
+    return cpus;
+}
 
-    if (!length) return;
+// pins a thread to one CPU; does nothing where affinity is not supported
+void pin_thread(std::thread& thread, int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+void pin_this_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+/*
+    CPU limits of a process, e.g. one running in a container. hardware_concurrency
+    reports the host's cores, but the affinity mask and the cgroup CPU quota
+    (cpu.max in v2, cpu.cfs_quota_us / cpu.cfs_period_us in v1) decide how much
+    of them we may actually use before being throttled.
+*/
+struct cpu_budget {
+    unsigned long hardware_cpus = 0;
+    unsigned long affinity_cpus = 0;
+    double quota_cpus = 0; // 0 when no quota is set
+    std::string quota_source;
+
+    unsigned long threads() const {
+        unsigned long n = affinity_cpus ? affinity_cpus : hardware_cpus;
+        if (quota_cpus > 0) n = std::min(n, (unsigned long)quota_cpus);
+        return std::max(1ul, n);
+    }
+};
 
-    unsigned long const min_per_thread=25;
-    unsigned long const max_threads=(length+min_per_thread-1)/min_per_thread;
+// reads "quota period" from a v2 cpu.max file; false when missing or "max"
+bool read_cgroup2_quota(const std::string& dir, double& cpus) {
+    std::ifstream in(dir + "/cpu.max");
+    std::string quota;
+    double period;
+    if (!(in >> quota >> period) || quota == "max" || period <= 0) return false;
+    cpus = std::stod(quota) / period;
+    return true;
+}
 
-    unsigned long const hardware_threads= std::thread::hardware_concurrency();
+// reads cpu.cfs_quota_us and cpu.cfs_period_us; false when missing or -1
+bool read_cgroup1_quota(const std::string& dir, double& cpus) {
+    std::ifstream quota_in(dir + "/cpu.cfs_quota_us");
+    std::ifstream period_in(dir + "/cpu.cfs_period_us");
+    double quota, period;
+    if (!(quota_in >> quota) || !(period_in >> period) || quota <= 0 || period <= 0) return false;
+    cpus = quota / period;
+    return true;
+}
 
-    unsigned long const num_threads=std::min(hardware_threads!=0?hardware_threads:2,max_threads);
-    unsigned long const block_size=length/num_threads;
+/*
+    Takes the tightest quota on the way from the process's own cgroup up to
+    the root of the mount. Inside a container the cgroup path in /proc is
+    often not visible under the mount, and the mount root itself is the
+    container's group, so that is checked as well.
+*/
+void find_cgroup_quota(const std::string& mount, std::string path, bool v2, cpu_budget& budget) {
+    for (;;) {
+        std::string dir = mount + path;
+        double cpus;
+        if ((v2 ? read_cgroup2_quota(dir, cpus) : read_cgroup1_quota(dir, cpus)) &&
+            (budget.quota_cpus == 0 || cpus < budget.quota_cpus)) {
+            budget.quota_cpus = cpus;
+            budget.quota_source = dir;
+        }
+        if (path.empty() || path == "/") break;
+        path = path.substr(0, path.rfind('/'));
+    }
+}
 
-    std::vector<std::future<void>> futures(num_threads-1);
-    std::vector<std::thread> threads(num_threads-1);
-    join_threads joiner(threads);
+cpu_budget detect_cpu_budget() {
+    cpu_budget budget;
+    budget.hardware_cpus = std::thread::hardware_concurrency();
+    budget.affinity_cpus = allowed_cpus().size();
 
-    int block_start=first;
+    // lines look like "0::/path" for v2 and "4:cpu,cpuacct:/path" for v1
+    std::ifstream in("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(in, line)) {
+        std::string::size_type first = line.find(':');
+        std::string::size_type second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        if (controllers.empty()) {
+            find_cgroup_quota("/sys/fs/cgroup", path, true, budget);
+            find_cgroup_quota("/sys/fs/cgroup/unified", path, true, budget);
+            continue;
+        }
+        std::stringstream names(controllers);
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            if (name != "cpu") continue;
+            find_cgroup_quota("/sys/fs/cgroup/" + controllers, path, false, budget);
+            find_cgroup_quota("/sys/fs/cgroup/cpu", path, false, budget);
+        }
+    }
+    return budget;
+}
 
-    for (unsigned long i=0;i<(num_threads-1);i++) {
-        int block_end=block_start;
-        block_end += block_size;
-        std::packaged_task<void(void)> task(
-            [=]() {
-                for (unsigned long j=block_start;j<block_end;j++) {
-                    f(j);
-                }
+std::ostream& operator<<(std::ostream &os, const cpu_budget &b) {
+    os << b.hardware_cpus << " hardware, " << b.affinity_cpus << " in affinity mask";
+    if (b.quota_cpus > 0)
+        os << ", cgroup quota " << b.quota_cpus << " from " << b.quota_source;
+    else
+        os << ", no cgroup quota";
+    return os;
+}
+
+/*
+    Long lived workers fed from one queue. A thread waiting on a task from the
+    pool runs queued tasks itself meanwhile, so tasks may submit and wait on
+    subtasks without deadlocking, even with no workers at all. With pin set the
+    calling thread and each worker get a CPU of their own.
+*/
+class thread_pool {
+    public:
+        explicit thread_pool(unsigned long num_workers, bool pin = false) : done(false), joiner(workers) {
+            std::vector<int> cpus = allowed_cpus();
+            pin = pin && !cpus.empty();
+            if (pin) pin_this_thread(cpus[0]);
+            for (unsigned long i=0;i<num_workers;i++) {
+                workers.push_back(std::thread(&thread_pool::worker_loop, this));
+                if (pin) pin_thread(workers.back(), cpus[(i+1) % cpus.size()]);
+            }
+        }
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+            wake.notify_all();
+        }
+
+        // f runs with the submitting thread's current arena, so scene objects it makes go where the caller's would
+        std::future<void> submit(const std::function<void()> &f) {
+            arena *a = current_arena();
+            std::packaged_task<void(void)> task([a, f]() {
+                arena_scope scope(a);
+                f();
             });
-        futures[i]=task.get_future();
-        threads[i]=std::thread(std::move(task));
-        block_start=block_end;
+            std::future<void> result = task.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+            return result;
+        }
+
+        bool run_pending_task() {
+            std::packaged_task<void(void)> task;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (tasks.empty()) return false;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            return true;
+        }
+
+        void wait(std::future<void> &f) {
+            while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                if (!run_pending_task()) std::this_thread::yield();
+            }
+            f.get();
+        }
+
+        // runs f(block_start, block_end) over [first, last) in blocks of grain
+        void parallel_for(int first, int last, int grain, const std::function<void(int, int)> &f) {
+            std::vector<std::future<void>> futures;
+            for (int block_start=first;block_start<last;block_start+=grain) {
+                int block_end=std::min(block_start+grain, last);
+                futures.push_back(submit([=,&f]() { f(block_start, block_end); }));
+            }
+            for (unsigned long i=0;i<futures.size();i++) {
+                wait(futures[i]);
+            }
+        }
+
+        // threads that run tasks, counting the one that waits
+        unsigned long size() const { return workers.size() + 1; }
+
+    private:
+        void worker_loop() {
+            for (;;) {
+                std::packaged_task<void(void)> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [this]() { return done || !tasks.empty(); });
+                    if (done && tasks.empty()) return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::packaged_task<void(void)>> tasks;
+        bool done;
+        std::vector<std::thread> workers;
+        join_threads joiner;
+};
+
+struct thread_pool_settings {
+    unsigned long threads = 0; // counting the caller; 0 sizes the pool from detect_cpu_budget()
+    bool pin = false;
+    int grain = 0;             // parallel_for_each block size; 0 picks one per call
+};
+
+// must be filled in before shared_thread_pool() is first called
+thread_pool_settings& shared_thread_pool_settings() {
+    static thread_pool_settings settings;
+    return settings;
+}
+
+/*
+    The one pool the renderer, BVH builds, texture loading and image writing
+    all submit to. It is created on first use and lives until exit, so later
+    frames and passes reuse the same threads.
+*/
+thread_pool& shared_thread_pool() {
+    static thread_pool pool(
+        (shared_thread_pool_settings().threads ? shared_thread_pool_settings().threads
+            : detect_cpu_budget().threads()) - 1,
+        shared_thread_pool_settings().pin);
+    return pool;
+}
+
+void parallel_for_each(int first, int last, const std::function<void(int)> &f, int grain = 0){
+    if (last <= first) return;
+
+    thread_pool& pool = shared_thread_pool();
+    if (!grain) grain = shared_thread_pool_settings().grain;
+    if (!grain) grain = std::max(1, int((last-first) / (4*pool.size())));
+    pool.parallel_for(first, last, grain, [&](int block_start, int block_end) {
+        for (int j=block_start;j<block_end;j++) {
+            f(j);
+        }
+    });
+}
+
+struct tile {
+    int x0, y0, x1, y1; // pixels [x0, x1) x [y0, y1)
+};
+
+// position of (x, y) along a Hilbert curve filling an n by n grid, n a power of two
+inline long hilbert_index(int n, int x, int y) {
+    long d = 0;
+    for (int s = n/2; s > 0; s /= 2) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += long(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s-1 - x;
+                y = s-1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// cuts an nx by ny image into tiles ordered along a Hilbert curve; tile_size below 1 counts as 1
+std::vector<tile> make_tiles(int nx, int ny, int tile_size) {
+    tile_size = std::max(tile_size, 1);
+    int tx = (nx + tile_size - 1) / tile_size;
+    int ty = (ny + tile_size - 1) / tile_size;
+    int n = 1;
+    while (n < tx || n < ty) n *= 2;
+
+    std::vector<std::pair<long, tile>> ordered;
+    for (int j = 0; j < ty; j++) {
+        for (int i = 0; i < tx; i++) {
+            tile t = {i*tile_size, j*tile_size, std::min((i+1)*tile_size, nx), std::min((j+1)*tile_size, ny)};
+            ordered.push_back(std::make_pair(hilbert_index(n, i, j), t));
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const std::pair<long, tile>& a, const std::pair<long, tile>& b) {
+        return a.first < b.first;
+    });
+    std::vector<tile> tiles;
+    for (unsigned long i=0;i<ordered.size();i++) tiles.push_back(ordered[i].second);
+    return tiles;
+}
+
+/*
+    Tiles owned by one thread. The owner takes from the front, walking its
+    stretch of the curve in order; thieves take from the back, as far from the
+    owner's current tile as possible.
+*/
+class tile_deque {
+    public:
+        void push_back(const tile& t) { tiles.push_back(t); }
+        bool pop_front(tile& t) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (tiles.empty()) return false;
+            t = tiles.front();
+            tiles.pop_front();
+            return true;
+        }
+        bool steal_back(tile& t) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (tiles.empty()) return false;
+            t = tiles.back();
+            tiles.pop_back();
+            return true;
+        }
+    private:
+        std::mutex mutex;
+        std::deque<tile> tiles;
+};
+
+struct thread_load {
+    double busy_seconds = 0;
+    double idle_seconds = 0;
+    int tiles = 0;
+    int stolen = 0;
+};
+
+/*
+    Runs f on every tile of an nx by ny image on the shared pool. Each thread
+    starts with a contiguous run of the Hilbert ordered tiles and steals from
+    the others once its own run is done. Returns how long each thread spent
+    working and waiting.
+*/
+std::vector<thread_load> parallel_for_tiles(int nx, int ny, int tile_size, const std::function<void(const tile&)> &f, unsigned long requested_threads = 0) {
+    typedef std::chrono::steady_clock clock;
+    std::vector<tile> tiles = make_tiles(nx, ny, tile_size);
+    thread_pool& pool = shared_thread_pool();
+    unsigned long const pool_threads = requested_threads ? std::min(requested_threads, pool.size()) : pool.size();
+    unsigned long const num_threads=std::max(1ul, std::min(pool_threads, (unsigned long)tiles.size()));
+
+    std::vector<tile_deque> queues(num_threads);
+    for (unsigned long i=0;i<tiles.size();i++) {
+        queues[i*num_threads/tiles.size()].push_back(tiles[i]);
+    }
+
+    std::vector<thread_load> load(num_threads);
+    clock::time_point start = clock::now();
+    auto work = [&](unsigned long id) {
+        tile t;
+        for (;;) {
+            bool stolen = false;
+            bool found = queues[id].pop_front(t);
+            for (unsigned long k=1; !found && k<num_threads; k++) {
+                found = stolen = queues[(id+k)%num_threads].steal_back(t);
+            }
+            if (!found) break;
+            clock::time_point tile_start = clock::now();
+            f(t);
+            load[id].busy_seconds += std::chrono::duration<double>(clock::now() - tile_start).count();
+            load[id].tiles++;
+            load[id].stolen += stolen;
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (unsigned long i=1;i<num_threads;i++) {
+        futures.push_back(pool.submit([&work, i]() { work(i); }));
+    }
+    work(0);
+    for (unsigned long i=0;i<futures.size();i++) {
+        pool.wait(futures[i]);
     }
-    for (unsigned long i=block_start;i<last;i++) f(i);
 
-    for(unsigned long i=0;i<(num_threads-1);i++) {
-        futures[i].get();
+    double wall = std::chrono::duration<double>(clock::now() - start).count();
+    for (unsigned long i=0;i<num_threads;i++) {
+        load[i].idle_seconds = wall - load[i].busy_seconds;
     }
+    return load;
 }
 
-#endif
\ No newline at end of file
+#endif
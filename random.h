@@ -0,0 +1,66 @@
+#ifndef RANDOMH
+#define RANDOMH
+
+#include <stdint.h>
+
+/*
+    PCG32 generator (O'Neill, pcg-random.org). Small, fast and lock free; every
+    thread owns one so sampling never contends on a shared state like rand().
+*/
+class pcg32 {
+    public:
+        pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+        pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+        void seed(uint64_t initstate, uint64_t initseq) {
+            state = 0u;
+            inc = (initseq << 1u) | 1u;
+            next_uint();
+            state += initstate;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t oldstate = state;
+            state = oldstate * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = uint32_t(((oldstate >> 18u) ^ oldstate) >> 27u);
+            uint32_t rot = uint32_t(oldstate >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+        }
+
+        // returns a random float [0, 1)
+        float next_float() {
+            return float(next_uint() >> 8) * (1.0f / 16777216.0f);
+        }
+
+        uint64_t state;
+        uint64_t inc;
+};
+
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline pcg32& thread_rng() {
+    static thread_local pcg32 rng;
+    return rng;
+}
+
+/*
+    Reseed the calling thread's generator. The render loop calls this once per
+    pixel with the pixel index, so an image is identical for a given seed no
+    matter how rows are scheduled across threads.
+*/
+inline void seed_thread_rng(uint64_t seed, uint64_t stream) {
+    thread_rng().seed(splitmix64(seed), stream);
+}
+
+inline float random_float() {
+    // returns a random float [0, 1)
+    return thread_rng().next_float();
+}
+
+#endif
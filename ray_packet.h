@@ -0,0 +1,182 @@
+#ifndef RAYPACKETH
+#define RAYPACKETH
+
+#include <stdint.h>
+
+#include "ray.h"
+#include "aabb.h"
+#include "float.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAY_PACKET_X86
+#include <immintrin.h>
+#endif
+
+/*
+    Up to packet_size rays traced together, one AVX2 register (or two SSE
+    ones) wide. The renderer fills one with the camera rays of neighbouring
+    pixels, which start at the same point and point almost the same way, so
+    a BVH can test a node once for all of them. Bits of active mark the
+    lanes that hold a ray.
+
+    prepare() copies origins and reciprocal directions into SoA form for
+    the lane tests and works out the interval the packet spans on each
+    axis. When every direction has the same sign on every axis, those
+    intervals bound where any of the rays can enter and leave a box, which
+    lets a whole packet skip a node with a single scalar test.
+*/
+
+const int packet_size = 8;
+
+struct ray_packet {
+    ray r[packet_size];
+    float t_max[packet_size];
+    int active;
+
+    alignas(32) float org[3][packet_size];
+    alignas(32) float inv_dir[3][packet_size];
+    bool coherent; // direction signs agree, so the intervals below are valid
+    float org_lo[3], org_hi[3];
+    float inv_lo[3], inv_hi[3];
+
+    ray_packet() : active(0) {}
+
+    void set(int i, const ray& ray, float tmax) {
+        r[i] = ray;
+        t_max[i] = tmax;
+        active |= 1 << i;
+    }
+
+    void prepare() {
+        coherent = active != 0;
+        for (int a = 0; a < 3; a++) {
+            org_lo[a] = inv_lo[a] = FLT_MAX;
+            org_hi[a] = inv_hi[a] = -FLT_MAX;
+            int negative = 0;
+            for (int i = 0; i < packet_size; i++) {
+                if (!(active & (1 << i))) {
+                    // empty lanes get a ray that misses everything
+                    org[a][i] = FLT_MAX;
+                    inv_dir[a][i] = 1;
+                    t_max[i] = -FLT_MAX;
+                    continue;
+                }
+                org[a][i] = r[i].origin()[a];
+                inv_dir[a][i] = 1.0f / r[i].direction()[a];
+                org_lo[a] = ffmin(org_lo[a], org[a][i]);
+                org_hi[a] = ffmax(org_hi[a], org[a][i]);
+                inv_lo[a] = ffmin(inv_lo[a], inv_dir[a][i]);
+                inv_hi[a] = ffmax(inv_hi[a], inv_dir[a][i]);
+                negative |= 1 << int(inv_dir[a][i] < 0.0f);
+            }
+            if (negative == 3 || !(inv_hi[a] - inv_lo[a] < FLT_MAX))
+                coherent = false;
+        }
+    }
+
+    /*
+        Interval arithmetic slab test: false only if no ray of the packet can
+        enter box within [t_min, t_max]. (box - org) * inv_dir is bounded by
+        the extreme products of the two intervals on each axis.
+    */
+    bool may_hit(const aabb& box, float t_min, float t_max) const {
+        float tn = t_min, tf = t_max;
+        for (int a = 0; a < 3; a++) {
+            float lo0 = box._min[a] - org_hi[a], hi0 = box._min[a] - org_lo[a];
+            float lo1 = box._max[a] - org_hi[a], hi1 = box._max[a] - org_lo[a];
+            float near0 = ffmin(ffmin(lo0*inv_lo[a], lo0*inv_hi[a]), ffmin(hi0*inv_lo[a], hi0*inv_hi[a]));
+            float far0 = ffmax(ffmax(lo0*inv_lo[a], lo0*inv_hi[a]), ffmax(hi0*inv_lo[a], hi0*inv_hi[a]));
+            float near1 = ffmin(ffmin(lo1*inv_lo[a], lo1*inv_hi[a]), ffmin(hi1*inv_lo[a], hi1*inv_hi[a]));
+            float far1 = ffmax(ffmax(lo1*inv_lo[a], lo1*inv_hi[a]), ffmax(hi1*inv_lo[a], hi1*inv_hi[a]));
+            // with positive directions a ray enters at the min plane, with negative ones at the max plane
+            bool positive = inv_lo[a] > 0.0f;
+            tn = ffmax(tn, positive ? near0 : near1);
+            tf = ffmin(tf, positive ? far1 : far0);
+        }
+        return tn <= tf;
+    }
+};
+
+/*
+    Lane box tests: return a bit for every lane in mask whose ray enters box
+    within [t_min, t_max[i]] and store the entry distances in tnear. NaNs
+    from 0 * inf are dropped because min/max take the axis value first.
+*/
+
+inline int packet_box_test_scalar(const aabb& box, const ray_packet& p, int mask, float t_min, const float *t_max, float *tnear) {
+    int hits = 0;
+    for (int i = 0; i < packet_size; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        float tn = t_min, tf = t_max[i];
+        for (int a = 0; a < 3; a++) {
+            float t0 = (box._min[a] - p.org[a][i]) * p.inv_dir[a][i];
+            float t1 = (box._max[a] - p.org[a][i]) * p.inv_dir[a][i];
+            tn = ffmax(ffmin(t0, t1), tn);
+            tf = ffmin(ffmax(t0, t1), tf);
+        }
+        tnear[i] = tn;
+        if (tn <= tf) hits |= 1 << i;
+    }
+    return hits;
+}
+
+#ifdef RAY_PACKET_X86
+__attribute__((target("sse4.2")))
+int packet_box_test_sse(const aabb& box, const ray_packet& p, int mask, float t_min, const float *t_max, float *tnear) {
+    int hits = 0;
+    for (int g = 0; g < packet_size; g += 4) {
+        __m128 tn = _mm_set1_ps(t_min);
+        __m128 tf = _mm_loadu_ps(t_max + g);
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_load_ps(&p.org[a][g]);
+            __m128 inv = _mm_load_ps(&p.inv_dir[a][g]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box._min[a]), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box._max[a]), o), inv);
+            tn = _mm_max_ps(_mm_min_ps(t0, t1), tn);
+            tf = _mm_min_ps(_mm_max_ps(t0, t1), tf);
+        }
+        _mm_storeu_ps(tnear + g, tn);
+        hits |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << g;
+    }
+    return hits & mask;
+}
+
+__attribute__((target("avx2")))
+int packet_box_test_avx2(const aabb& box, const ray_packet& p, int mask, float t_min, const float *t_max, float *tnear) {
+    __m256 tn = _mm256_set1_ps(t_min);
+    __m256 tf = _mm256_loadu_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        __m256 o = _mm256_load_ps(p.org[a]);
+        __m256 inv = _mm256_load_ps(p.inv_dir[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box._min[a]), o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box._max[a]), o), inv);
+        tn = _mm256_max_ps(_mm256_min_ps(t0, t1), tn);
+        tf = _mm256_min_ps(_mm256_max_ps(t0, t1), tf);
+    }
+    _mm256_storeu_ps(tnear, tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)) & mask;
+}
+#endif
+
+typedef int (*packet_box_test_fn)(const aabb&, const ray_packet&, int, float, const float *, float *);
+
+// the widest lane test the CPU runs; kernel receives its name
+inline packet_box_test_fn select_packet_box_test(const char **kernel) {
+    packet_box_test_fn test = packet_box_test_scalar;
+    *kernel = "scalar";
+#ifdef RAY_PACKET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        test = packet_box_test_sse;
+        *kernel = "sse4.2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        test = packet_box_test_avx2;
+        *kernel = "avx2";
+    }
+#endif
+    return test;
+}
+
+#endif
@@ -10,11 +10,15 @@ class xy_rect: public hitable {
         xy_rect() {}
         xy_rect(float _x0, float _x1, float _y0, float _y1, float _k, material *mat) : 
         x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
-        virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             box = aabb(vec3(x0, y0, k-0.0001), vec3(x1, y1, k+0.0001));
             return true;
         }
+        virtual bool occluded(const ray& r, float t0, float t1) const;
+        virtual float pdf_value(const vec3& o, const vec3& v) const;
+        virtual vec3 random(const vec3& o) const;
         material *mp;
         float x0, x1, y0, y1, k;
 };
@@ -24,11 +28,15 @@ class xz_rect: public hitable {
         xz_rect() {}
         xz_rect(float _x0, float _x1, float _z0, float _z1, float _k, material *mat) : 
         x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
-        virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
-            box = aabb(vec3(x0, z0, k-0.0001), vec3(x1, z1, k+0.0001));
+            box = aabb(vec3(x0, k-0.0001, z0), vec3(x1, k+0.0001, z1));
             return true;
         }
+        virtual bool occluded(const ray& r, float t0, float t1) const;
+        virtual float pdf_value(const vec3& o, const vec3& v) const;
+        virtual vec3 random(const vec3& o) const;
         material *mp;
         float x0, x1, z0, z1, k;
 };
@@ -38,66 +46,152 @@ class yz_rect: public hitable {
         yz_rect() {}
         yz_rect(float _y0, float _y1, float _z0, float _z1, float _k, material *mat) : 
         y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
-        virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
-            box = aabb(vec3(y0, y0, k-0.0001), vec3(z1, z1, k+0.0001));
+            box = aabb(vec3(k-0.0001, y0, z0), vec3(k+0.0001, y1, z1));
             return true;
         }
+        virtual bool occluded(const ray& r, float t0, float t1) const;
+        virtual float pdf_value(const vec3& o, const vec3& v) const;
+        virtual vec3 random(const vec3& o) const;
         material *mp;
         float y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, float t0, float t1, hit_record& rec) const {
+inline bool xy_rect::intersect(const ray& r, float t0, float t1, hit_record& rec) const {
     float t = (k-r.origin().z()) / r.direction().z();
     if (t < t0 || t > t1)
         return false;
     float x = r.origin().x() + t*r.direction().x();
     float y = r.origin().y() + t*r.direction().y();
-    if (x < x0 || x > x1 || y < y0 || y > y1){
+    if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
-    }
-
     rec.u = (x-x0)/(x1-x0);
     rec.v = (y-y0)/(y1-y0);
     rec.t = t;
+    rec.prim = this;
+    return true;
+}
+
+void xy_rect::surface(const ray& r, hit_record& rec) const {
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
+    rec.p = r.point_at_parameter(rec.t);
     rec.normal = vec3(0,0,1);
-    return true;
 }
 
-bool xz_rect::hit(const ray& r, float t0, float t1, hit_record& rec) const {
+inline bool xz_rect::intersect(const ray& r, float t0, float t1, hit_record& rec) const {
     float t = (k-r.origin().y()) / r.direction().y();
     if (t < t0 || t > t1)
         return false;
     float x = r.origin().x() + t*r.direction().x();
     float z = r.origin().z() + t*r.direction().z();
-    if (x < x0 || x > x1 || z < z0 || z > z1) 
+    if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
     rec.u = (x-x0)/(x1-x0);
-    rec.v = (z-z0)/(z1-z0); 
+    rec.v = (z-z0)/(z1-z0);
     rec.t = t;
+    rec.prim = this;
+    return true;
+}
+
+void xz_rect::surface(const ray& r, hit_record& rec) const {
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
+    rec.p = r.point_at_parameter(rec.t);
     rec.normal = vec3(0, 1, 0);
-    return true;
 }
 
-bool yz_rect::hit(const ray& r, float t0, float t1, hit_record& rec) const {
+inline bool yz_rect::intersect(const ray& r, float t0, float t1, hit_record& rec) const {
     float t = (k-r.origin().x()) / r.direction().x();
     if (t < t0 || t > t1)
         return false;
     float y = r.origin().y() + t*r.direction().y();
     float z = r.origin().z() + t*r.direction().z();
-    if (y < y0 || y > y1 || z < z0 || z > z1) 
+    if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
     rec.u = (y-y0)/(y1-y0);
-    rec.v = (z-z0)/(z1-z0); 
+    rec.v = (z-z0)/(z1-z0);
     rec.t = t;
+    rec.prim = this;
+    return true;
+}
+
+void yz_rect::surface(const ray& r, hit_record& rec) const {
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
+    rec.p = r.point_at_parameter(rec.t);
     rec.normal = vec3(1, 0, 0);
-    return true;
+}
+
+bool xy_rect::occluded(const ray& r, float t0, float t1) const {
+    float t = (k-r.origin().z()) / r.direction().z();
+    if (t < t0 || t > t1)
+        return false;
+    float x = r.origin().x() + t*r.direction().x();
+    float y = r.origin().y() + t*r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+float xy_rect::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!intersect(ray(o, v), 0.001, FLT_MAX, rec))
+        return 0;
+    float area = (x1-x0)*(y1-y0);
+    float distance_squared = rec.t * rec.t * v.squared_length();
+    float cosine = fabs(v.z()) / v.length();
+    return distance_squared / (cosine * area);
+}
+
+vec3 xy_rect::random(const vec3& o) const {
+    vec3 random_point(x0 + random_float()*(x1-x0), y0 + random_float()*(y1-y0), k);
+    return random_point - o;
+}
+
+bool xz_rect::occluded(const ray& r, float t0, float t1) const {
+    float t = (k-r.origin().y()) / r.direction().y();
+    if (t < t0 || t > t1)
+        return false;
+    float x = r.origin().x() + t*r.direction().x();
+    float z = r.origin().z() + t*r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+float xz_rect::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!intersect(ray(o, v), 0.001, FLT_MAX, rec))
+        return 0;
+    float area = (x1-x0)*(z1-z0);
+    float distance_squared = rec.t * rec.t * v.squared_length();
+    float cosine = fabs(v.y()) / v.length();
+    return distance_squared / (cosine * area);
+}
+
+vec3 xz_rect::random(const vec3& o) const {
+    vec3 random_point(x0 + random_float()*(x1-x0), k, z0 + random_float()*(z1-z0));
+    return random_point - o;
+}
+
+bool yz_rect::occluded(const ray& r, float t0, float t1) const {
+    float t = (k-r.origin().x()) / r.direction().x();
+    if (t < t0 || t > t1)
+        return false;
+    float y = r.origin().y() + t*r.direction().y();
+    float z = r.origin().z() + t*r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+float yz_rect::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!intersect(ray(o, v), 0.001, FLT_MAX, rec))
+        return 0;
+    float area = (y1-y0)*(z1-z0);
+    float distance_squared = rec.t * rec.t * v.squared_length();
+    float cosine = fabs(v.x()) / v.length();
+    return distance_squared / (cosine * area);
+}
+
+vec3 yz_rect::random(const vec3& o) const {
+    vec3 random_point(k, y0 + random_float()*(y1-y0), z0 + random_float()*(z1-z0));
+    return random_point - o;
 }
 
 #endif
\ No newline at end of file
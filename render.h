@@ -0,0 +1,249 @@
+#ifndef RENDERH
+#define RENDERH
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "hitable.h"
+#include "camera.h"
+#include "material.h"
+#include "parallel.h"
+#include "random.h"
+
+struct render_settings {
+    int nx = 600;
+    int ny = 300;
+    int ns = 1;
+    uint64_t seed = 0;
+    unsigned long threads = 0; // 0 uses every thread in the pool
+    int tile_size = 16;
+    int max_depth = 50;        // bounces after the camera ray
+    int rr_start_depth = 5;    // first bounce that may be ended by Russian roulette
+    bool light_sampling = true; // next event estimation when the scene has lights
+    bool packets = false;       // trace camera rays packet_size pixels at a time
+    int wave_size = 1 << 14;    // paths in flight per thread in render_wavefront()
+    bool wave_sorting = true;   // bin rays and hits between wavefront stages
+};
+
+struct render_stats {
+    std::vector<thread_load> load;
+    uint64_t paths = 0;
+    uint64_t rays = 0;
+
+    double average_path_length() const { return paths ? double(rays) / paths : 0; }
+};
+
+// material calls through the virtual functions of rec.mat_ptr
+struct virtual_shading {
+    vec3 emitted(const hit_record& rec) const { return rec.mat_ptr->emitted(rec.u, rec.v, rec.p); }
+    bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
+        return rec.mat_ptr->scatter(r_in, rec, attenuation, scattered);
+    }
+    float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+        return rec.mat_ptr->scattering_pdf(r_in, rec, scattered);
+    }
+};
+
+inline float power_heuristic(float a, float b) {
+    return a*a / (a*a + b*b);
+}
+
+/*
+    MIS weight of emission a bounce with pdf bsdf_pdf found at t along r.
+    Only the emitters in lights are also sampled directly, so the weight
+    applies when r meets lights at t; an emitter in front of them, or off
+    their list, keeps full weight.
+*/
+inline float bounce_weight(hitable *lights, const ray& r, float t, float bsdf_pdf) {
+    hit_record light_rec;
+    if (!lights->intersect(r, 0.001, FLT_MAX, light_rec) || light_rec.t > t * (1 + 1e-4f))
+        return 1;
+    return power_heuristic(bsdf_pdf, lights->pdf_value(r.origin(), r.direction()));
+}
+
+inline bool is_black(const vec3& c) {
+    return c.x() == 0 && c.y() == 0 && c.z() == 0;
+}
+
+/*
+    Follows one path from the camera. Throughput holds the product of the
+    attenuations so far; past rr_start_depth a path survives with probability
+    equal to its largest throughput component and is reweighted to stay
+    unbiased. rays counts the rays traced along the way.
+
+    With lights given, every vertex on a material that reports a
+    scattering_pdf also samples a point on the lights and traces a shadow ray
+    to it. Light reached that way and light found by the BSDF bounce are
+    combined with multiple importance sampling (power heuristic), so neither
+    small lights nor glossy paths blow up the noise. Emitters left out of
+    lights are only found by bouncing and keep full weight (bounce_weight).
+
+    camera_hit tells whether the camera ray hit the world, at camera_rec,
+    for callers that traced it already (see render_packets()). Materials of
+    world hits are called through shading, which is virtual_shading or a
+    compiled_scene that is also the world.
+*/
+template <class S>
+vec3 color(const ray& camera_ray, bool camera_hit, const hit_record& camera_rec, hitable *world, hitable *lights, const render_settings& settings, uint64_t& rays, const S& shading) {
+    vec3 radiance(0,0,0);
+    vec3 throughput(1,1,1);
+    ray r = camera_ray;
+    hit_record rec = camera_rec;
+    bool sample_lights = lights && settings.light_sampling;
+    float bsdf_pdf = 0; // pdf of the bounce that made r; 0 from the camera and specular bounces
+    for (int depth = 0; ; depth++) {
+        rays++;
+        if (depth == 0 ? !camera_hit : !world->hit(r, 0.001, FLT_MAX, rec))
+            break;
+        vec3 emitted = shading.emitted(rec);
+        if (sample_lights && bsdf_pdf > 0 && !is_black(emitted))
+            emitted *= bounce_weight(lights, r, rec.t, bsdf_pdf);
+        radiance += throughput * emitted;
+
+        ray scattered_ray;
+        vec3 attenuation;
+        if (depth >= settings.max_depth || !shading.scatter(r, rec, attenuation, scattered_ray))
+            break;
+        bsdf_pdf = shading.scattering_pdf(r, rec, scattered_ray);
+
+        if (sample_lights && bsdf_pdf > 0) {
+            ray shadow_ray(rec.p, lights->random(rec.p), r.time());
+            float light_pdf = lights->pdf_value(shadow_ray.origin(), shadow_ray.direction());
+            float f_pdf = shading.scattering_pdf(r, rec, shadow_ray);
+            hit_record light_rec;
+            if (light_pdf > 0 && f_pdf > 0 && lights->hit(shadow_ray, 0.001, FLT_MAX, light_rec)) {
+                rays++;
+                if (!world->occluded(shadow_ray, 0.001, light_rec.t * (1 - 1e-4f))) {
+                    vec3 light = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+                    radiance += throughput * attenuation * light * (f_pdf / light_pdf * power_heuristic(light_pdf, f_pdf));
+                }
+            }
+        }
+
+        throughput *= attenuation;
+        if (depth + 1 >= settings.rr_start_depth) {
+            float survive = ffmin(1.0f, ffmax(throughput.x(), ffmax(throughput.y(), throughput.z())));
+            if (random_float() >= survive)
+                break;
+            throughput /= survive;
+        }
+        r = scattered_ray;
+    }
+    return radiance;
+}
+
+template <class S>
+vec3 color(const ray& camera_ray, hitable *world, hitable *lights, const render_settings& settings, uint64_t& rays, const S& shading) {
+    hit_record rec;
+    bool hit = world->hit(camera_ray, 0.001, FLT_MAX, rec);
+    return color(camera_ray, hit, rec, world, lights, settings, rays, shading);
+}
+
+vec3 color(const ray& camera_ray, hitable *world, hitable *lights, const render_settings& settings, uint64_t& rays) {
+    return color(camera_ray, world, lights, settings, rays, virtual_shading());
+}
+
+inline void write_pixel(unsigned char *image, int nx, int i, int j, vec3 col, int ns) {
+    col /= float(ns);
+    col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
+    image[(j*nx*3) + (i*3)] = (unsigned char)(255.99*ffmin(col[0], 1));
+    image[(j*nx*3) + (i*3+1)] = (unsigned char)(255.99*ffmin(col[1], 1));
+    image[(j*nx*3) + (i*3+2)] = (unsigned char)(255.99*ffmin(col[2], 1));
+}
+
+/*
+    Renders a tile in runs of packet_size pixels along each row. For every
+    sample the camera rays of a run go to hit_packet() together; the paths
+    then continue one by one, as they stop being coherent after the first
+    bounce. Each pixel keeps its own generator state and switches it in
+    around its own work, so the image matches the single ray render. The
+    exception is fog (constant_medium), whose intersection draws random
+    numbers: in a packet those come from a scratch state instead of the
+    pixel's own, so results there differ in noise but not in expectation.
+*/
+template <class S>
+uint64_t render_packets(hitable *world, hitable *lights, camera& cam, const render_settings& settings, const tile& t, unsigned char *image, const S& shading) {
+    const int nx = settings.nx;
+    const int ny = settings.ny;
+    uint64_t rays = 0;
+    pcg32& rng = thread_rng();
+    pcg32 lane_rng[packet_size];
+    vec3 col[packet_size];
+    hit_record rec[packet_size];
+    for (int j=t.y0; j < t.y1; j++) {
+        for (int i0=t.x0; i0 < t.x1; i0 += packet_size) {
+            int lanes = std::min(packet_size, t.x1 - i0);
+            for (int k=0; k < lanes; k++) {
+                seed_thread_rng(uint64_t(j)*nx + i0 + k, settings.seed);
+                lane_rng[k] = rng;
+                col[k] = vec3(0,0,0);
+            }
+            for (int s=0; s < settings.ns; s++) {
+                ray_packet packet;
+                for (int k=0; k < lanes; k++) {
+                    rng = lane_rng[k];
+                    float u = float(i0 + k + random_float()) / float(nx);
+                    float v = float(j + random_float()) / float(ny);
+                    packet.set(k, cam.get_ray(u, v), FLT_MAX);
+                    lane_rng[k] = rng;
+                }
+                packet.prepare();
+                int hits = world->hit_packet(packet, 0.001, rec);
+                for (int k=0; k < lanes; k++) {
+                    rng = lane_rng[k];
+                    col[k] += color(packet.r[k], (hits >> k) & 1, rec[k], world, lights, settings, rays, shading);
+                    lane_rng[k] = rng;
+                }
+            }
+            for (int k=0; k < lanes; k++)
+                write_pixel(image, nx, i0 + k, j, col[k], settings.ns);
+        }
+    }
+    return rays;
+}
+
+/*
+    Renders the world into image (nx*ny*3 bytes, bottom row first), tile by
+    tile. Each pixel reseeds the thread's generator from its index so the
+    output only depends on settings.seed, with or without settings.packets.
+    Returns each thread's busy and idle time along with path statistics.
+*/
+template <class S>
+render_stats render(hitable *world, hitable *lights, camera& cam, const render_settings& settings, unsigned char *image, const S& shading) {
+    const int nx = settings.nx;
+    const int ny = settings.ny;
+    std::atomic<uint64_t> total_rays(0);
+    render_stats stats;
+    stats.load = parallel_for_tiles(nx, ny, settings.tile_size, [&](const tile& t){
+        if (settings.packets) {
+            total_rays += render_packets(world, lights, cam, settings, t, image, shading);
+            return;
+        }
+        uint64_t rays = 0;
+        for (int j=t.y0; j < t.y1; j++) {
+            for (int i=t.x0; i < t.x1; i++) {
+                seed_thread_rng(uint64_t(j)*nx + i, settings.seed);
+                vec3 col(0,0,0);
+                for (int s=0; s < settings.ns; s++) {
+                    float u = float(i + random_float()) / float(nx);
+                    float v = float(j + random_float()) / float(ny);
+                    ray r = cam.get_ray(u, v);
+                    col += color(r, world, lights, settings, rays, shading);
+                }
+                write_pixel(image, nx, i, j, col, settings.ns);
+            }
+        }
+        total_rays += rays;
+    }, settings.threads);
+    stats.paths = uint64_t(nx) * ny * settings.ns;
+    stats.rays = total_rays;
+    return stats;
+}
+
+render_stats render(hitable *world, hitable *lights, camera& cam, const render_settings& settings, unsigned char *image) {
+    return render(world, lights, cam, settings, image, virtual_shading());
+}
+
+#endif
@@ -0,0 +1,419 @@
+#ifndef SCENESH
+#define SCENESH
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "sphere.h"
+#include "rectangle.h"
+#include "box.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+#include "hitable_list.h"
+#include "instance.h"
+#include "motion_bvh.h"
+#include "material.h"
+#include "constant_medium.h"
+#include "parallel.h"
+#include "random.h"
+#include "stb_image.h"
+
+// a list holding just light, to pass as the lights of render()
+hitable *light_list(hitable *light) {
+    hitable **list = scene_array<hitable *>(1);
+    list[0] = light;
+    return new hitable_list(list, 1);
+}
+
+// with bounce > 0 the diffuse spheres jump up by as much as bounce while the shutter is open
+hitable **random_scene_list(unsigned char **tex_data, int& n, float bounce = 0) {
+    vec3 colors[6] = {
+            vec3(0.37,0.62,0.58),
+            vec3(0.24,0.21,0.22),
+            vec3(0.45,0.21,0.20),
+            vec3(0.71,0.38,0.22),
+            vec3(0.69,0.63,0.64),
+            vec3(0.89,0.85,0.82),
+    };
+
+    // decode the earth texture on the pool while the spheres are placed
+    int nx, ny, nn;
+    std::future<void> texture_loaded = shared_thread_pool().submit([&]() {
+        *tex_data = stbi_load("textures/earth.jpg", &nx, &ny, &nn, 0);
+    });
+
+    hitable **list = scene_array<hitable *>(501);
+    list[0] =  new sphere(vec3(0,-1000,0), 1000, new diffuse_light(new constant_texture(vec3(1.1,1.1,1.1))));
+
+    int i = 1;
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            float choose_mat = random_float();
+            vec3 center(a+0.9*random_float(),0.2,b+0.9*random_float());
+            vec3 color;
+            color = colors[ int(random_float()*5) ];
+
+            if ((center-vec3(4,0.2,0)).length() > 0.9) { 
+                if (choose_mat < 0.3) {  // diffuse
+                    material *mat = new lambertian(new constant_texture(color));
+                    if (bounce > 0)
+                        list[i++] = new moving_sphere(center, center + vec3(0, bounce*random_float(), 0), 0.0, 1.0, 0.2, mat);
+                    else
+                        list[i++] = new sphere(center, 0.2, mat);
+                }
+                else if (choose_mat < 0.6) { // metal
+                    list[i++] = new sphere(center, 0.2, new metal(vec3(0.5*(1 + random_float()), 0.5*(1 + random_float()), 0.5*(1 + random_float())),  0.5*random_float()));
+                }
+                else {  // glass
+                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                }
+            }
+        }
+    }
+
+    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
+
+    shared_thread_pool().wait(texture_loaded);
+    if (*tex_data == NULL) {
+        std::cout << "Error: texture could not be loaded!" << std::endl;
+        return NULL;
+    }
+
+    material *mat = new lambertian(new image_texture(*tex_data, nx, ny));
+    list[i++] = new sphere(vec3(4, 1, 0), 1.0, mat);
+
+    list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new metal(colors[4], 0.0));
+    n = i;
+    return list;
+}
+
+// lights, when given, receives the emitters for the integrator to sample
+hitable *random_scene(unsigned char **tex_data, hitable **lights = NULL) {
+    int n;
+    hitable **list = random_scene_list(tex_data, n);
+    if (list == NULL)
+        return NULL;
+    if (lights)
+        *lights = light_list(list[0]);
+    return new linear_bvh(list, n, 0.0, 1.0);
+}
+
+/*
+    The motion blur scene: random_scene with its diffuse spheres bouncing,
+    under a motion_bvh whose shutter is cut into segments.
+*/
+hitable *motion_scene(unsigned char **tex_data, float bounce, int segments, hitable **lights = NULL) {
+    int n;
+    hitable **list = random_scene_list(tex_data, n, bounce);
+    if (list == NULL)
+        return NULL;
+    if (lights)
+        *lights = light_list(list[0]);
+    return new motion_bvh(list, n, 0.0, 1.0, segments);
+}
+
+hitable *cornell_box() {
+    hitable **list = scene_array<hitable *>(6);
+    int i = 0;
+    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
+
+    list[i++] = new flip_normals(new yz_rect(0, 700, 0, 700, 700, white));
+    list[i++] = new yz_rect(0, 700, 0, 700, -700, white);
+    list[i++] = new flip_normals(new xz_rect(-700, 700, -700, 700, 700, white));
+    list[i++] = new xz_rect(-700, 700, -700, 700, 0, white);
+    list[i++] = new flip_normals(new xy_rect(-700, 700, 0, 700, 700, white));
+
+    return new hitable_list(list,i);
+}
+
+hitable *final(hitable **lights = NULL) {
+    hitable **list = scene_array<hitable *>(500);
+    int count = 0;
+    material *red = new lambertian( new constant_texture(vec3(0.65, 0.05, 0.05)) );
+    material *white = new lambertian( new constant_texture(vec3(0.73, 0.73, 0.73)) );
+    material *green = new lambertian( new constant_texture(vec3(0.12, 0.45, 0.15)) );
+    material *light = new diffuse_light( new constant_texture(vec3(15, 15, 15)) );
+
+    list[count++] = cornell_box();
+    
+    for (int i=0; i < 6; i++) {
+        for (int j = 0; j < 6; j++) {
+            float x = (random_float()*900)-450;
+            float y = random_float()*700;  
+            float z = (random_float()*900)-450;
+
+            list[count++] = new sphere(vec3(x,y,z), 50, white);
+        }
+    }
+
+    for (int i=0; i < 28; i++) {
+
+        list[count++] = new box(
+            vec3(650-(50*i),0,400-random_float()*100),
+            vec3(700-(50*i),100+random_float()*200,700),
+            green
+        );
+
+    }
+
+    list[count++] = new constant_medium(cornell_box(), 0.01, new constant_texture(vec3(1.0, 1.0, 1.0)));
+
+    list[count++] = new xz_rect(-200, 200, 0, 200, 554, light);
+    if (lights)
+        *lights = light_list(list[count-1]);
+
+    return new linear_bvh(list, count, 0.0, 1.0);
+}
+
+/*
+    n small spheres scattered through a 100 unit cube, sized so the cube stays
+    about equally full whatever n is. Used to benchmark acceleration structures.
+*/
+std::vector<hitable *> sphere_cloud(int n) {
+    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
+    float radius = 40.0 / cbrt(float(n));
+    std::vector<hitable *> list;
+    list.reserve(n);
+    for (int i = 0; i < n; i++) {
+        vec3 center(100*random_float() - 50, 100*random_float() - 50, 100*random_float() - 50);
+        list.push_back(new sphere(center, radius, white));
+    }
+    return list;
+}
+
+/*
+    Particles from a sphere file (see sphere_set::load), or a random cloud of
+    n of them in the same 100 unit cube as sphere_cloud when path is empty,
+    lit by one big spherical light. set receives the sphere_set. Returns NULL
+    if the file cannot be read.
+*/
+hitable *particles(const std::string& path, int n, sphere_set **set, hitable **lights = NULL) {
+    std::vector<material *> materials;
+    materials.push_back(new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73))));
+    materials.push_back(new lambertian(new constant_texture(vec3(0.71, 0.38, 0.22))));
+    materials.push_back(new lambertian(new constant_texture(vec3(0.37, 0.62, 0.58))));
+    materials.push_back(new metal(vec3(0.8, 0.8, 0.9), 0.2));
+
+    *set = new sphere_set(materials);
+    if (!path.empty()) {
+        if (!(*set)->load(path.c_str()))
+            return NULL;
+    } else {
+        float radius = 40.0 / cbrt(float(n));
+        for (int i = 0; i < n; i++) {
+            vec3 center(100*random_float() - 50, 100*random_float() - 50, 100*random_float() - 50);
+            (*set)->add(center, radius, std::min(int(random_float() * materials.size()), int(materials.size()) - 1));
+        }
+    }
+    (*set)->build();
+
+    hitable **list = scene_array<hitable *>(2);
+    list[0] = *set;
+    list[1] = new sphere(vec3(0, 150, -200), 60, new diffuse_light(new constant_texture(vec3(15, 15, 15))));
+    if (lights)
+        *lights = light_list(list[1]);
+    return new hitable_list(list, 2);
+}
+
+/*
+    A torus of about n triangles around the y axis, with shared vertices,
+    normals and texture coordinates; the seams repeat their vertices so the
+    coordinates can wrap. Stands in for a scanned mesh in benchmarks.
+*/
+void tessellate_torus(triangle_mesh& mesh, float major, float minor, int n) {
+    int rings = std::max(3, int(sqrt(n / 4.0f)));
+    int segments = std::max(3, 2 * rings);
+    uint32_t base = uint32_t(mesh.vertices());
+    for (int i = 0; i <= segments; i++) {
+        float phi = 2 * M_PI * i / segments;
+        vec3 around(cos(phi), 0, sin(phi));
+        for (int j = 0; j <= rings; j++) {
+            float theta = 2 * M_PI * j / rings;
+            vec3 normal = cos(theta) * around + vec3(0, sin(theta), 0);
+            mesh.add_vertex(major * around + minor * normal, normal, float(i) / segments, float(j) / rings);
+        }
+    }
+    for (int i = 0; i < segments; i++) {
+        for (int j = 0; j < rings; j++) {
+            uint32_t a = base + i * (rings + 1) + j, b = a + rings + 1;
+            mesh.add_triangle(a, a + 1, b);
+            mesh.add_triangle(b, a + 1, b + 1);
+        }
+    }
+}
+
+/*
+    A mesh file (see triangle_mesh::load), or a torus of n triangles when
+    path is empty, fitted into the same 100 unit cube as the particles, standing
+    on a white floor and lit by one big spherical light. mesh receives the
+    triangle_mesh. Returns NULL if the file cannot be read.
+*/
+hitable *mesh_scene(const std::string& path, int n, triangle_mesh **mesh, hitable **lights = NULL) {
+    *mesh = new triangle_mesh(new lambertian(new constant_texture(vec3(0.71, 0.38, 0.22))));
+    if (!path.empty()) {
+        if (!(*mesh)->load(path.c_str()))
+            return NULL;
+    } else {
+        tessellate_torus(**mesh, 35, 15, n);
+    }
+    (*mesh)->fit(vec3(0, 0, 0), 100);
+    (*mesh)->build();
+
+    hitable **list = scene_array<hitable *>(3);
+    list[0] = *mesh;
+    list[1] = new xz_rect(-1000, 1000, -1000, 1000, (*mesh)->nodes[0].box.min().y(), new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73))));
+    list[2] = new sphere(vec3(0, 150, -200), 60, new diffuse_light(new constant_texture(vec3(15, 15, 15))));
+    if (lights)
+        *lights = light_list(list[2]);
+    return new hitable_list(list, 3);
+}
+
+/*
+    The shapes of list as instances: spheres of the same radius become
+    instances of one sphere at the origin, moved into place, with their own
+    material as the override, and anything else a BLAS of its own under an
+    identity transform. Moving rather than scaling a shared unit sphere
+    keeps the arithmetic of the sphere test as it was, so shadow rays to a
+    sphere light still agree with the light's own hit to the last bit.
+*/
+instance_bvh *instance_spheres(hitable **list, int n) {
+    instance_bvh *top = new instance_bvh();
+    std::map<float, int> by_radius;
+    for (int i = 0; i < n; i++) {
+        if (sphere *s = dynamic_cast<sphere *>(list[i])) {
+            std::map<float, int>::iterator it = by_radius.find(s->radius);
+            if (it == by_radius.end())
+                it = by_radius.insert(std::make_pair(s->radius, top->add_blas(new sphere(vec3(0,0,0), s->radius, NULL)))).first;
+            top->add(it->second, affine::translation(s->center), s->mat_ptr);
+        } else {
+            top->add(top->add_blas(list[i]), affine::identity());
+        }
+    }
+    top->build();
+    return top;
+}
+
+// random_scene with its spheres instanced from one
+hitable *instanced_random_scene(unsigned char **tex_data, hitable **lights = NULL) {
+    int n;
+    hitable **list = random_scene_list(tex_data, n);
+    if (list == NULL)
+        return NULL;
+    if (lights)
+        *lights = light_list(list[0]);
+    return instance_spheres(list, n);
+}
+
+/*
+    Adds a cone (or a cylinder when top_radius is not 0) around the y axis
+    from y0 to y1, with smooth side normals and no caps.
+*/
+void tessellate_cone(triangle_mesh& mesh, float y0, float y1, float radius, float top_radius, int segments) {
+    uint32_t base = uint32_t(mesh.vertices());
+    float slope = (radius - top_radius) / (y1 - y0);
+    for (int i = 0; i <= segments; i++) {
+        float phi = 2 * M_PI * i / segments;
+        vec3 around(cos(phi), 0, sin(phi));
+        vec3 normal = unit_vector(around + vec3(0, slope, 0));
+        mesh.add_vertex(radius * around + vec3(0, y0, 0), normal, float(i) / segments, 0);
+        mesh.add_vertex(top_radius * around + vec3(0, y1, 0), normal, float(i) / segments, 1);
+    }
+    for (int i = 0; i < segments; i++) {
+        uint32_t a = base + 2*i;
+        mesh.add_triangle(a, a + 1, a + 2);
+        mesh.add_triangle(a + 2, a + 1, a + 3);
+    }
+}
+
+/*
+    A fir: a trunk and three stacked cones of needles as two meshes in one
+    linear_bvh, about 1.5 units across and height units tall, standing on
+    the origin. Used as the BLAS of the forest.
+*/
+hitable *fir_tree(float height, const vec3& green) {
+    triangle_mesh *trunk = new triangle_mesh(new lambertian(new constant_texture(vec3(0.35, 0.22, 0.12))));
+    tessellate_cone(*trunk, 0, 0.3f * height, 0.12f, 0.1f, 8);
+    trunk->build();
+    triangle_mesh *crown = new triangle_mesh(new lambertian(new constant_texture(green)));
+    for (int k = 0; k < 3; k++) {
+        float bottom = (0.2f + 0.25f * k) * height;
+        tessellate_cone(*crown, bottom, bottom + 0.4f * height, 0.75f - 0.2f * k, 0, 16);
+    }
+    crown->build();
+    hitable **list = scene_array<hitable *>(2);
+    list[0] = trunk;
+    list[1] = crown;
+    return new linear_bvh(list, 2, 0.0, 1.0);
+}
+
+/*
+    n firs of four kinds on a jittered grid 3 units apart, each turned and
+    scaled at random, on a white ground under one big spherical light. With
+    instanced the trees are instances in an instance_bvh; otherwise every
+    tree is its own copy of the meshes, moved into place, in a linear_bvh.
+    trees, when given, receives the trees alone, for benchmarks.
+*/
+hitable *forest(int n, bool instanced, hitable **trees = NULL, hitable **lights = NULL) {
+    const int kinds = 4;
+    vec3 greens[kinds] = {vec3(0.10, 0.30, 0.12), vec3(0.15, 0.35, 0.10), vec3(0.08, 0.25, 0.15), vec3(0.20, 0.33, 0.12)};
+    float heights[kinds] = {4, 5, 6, 7};
+    hitable *firs[kinds];
+    for (int k = 0; k < kinds; k++)
+        firs[k] = fir_tree(heights[k], greens[k]);
+
+    int side = std::max(1, int(ceil(sqrt(float(n)))));
+    std::vector<affine> placements(n);
+    std::vector<int> kind(n);
+    for (int i = 0; i < n; i++) {
+        vec3 at(3 * (i % side - 0.5f * side + random_float()), 0, 3 * (i / side - 0.5f * side + random_float()));
+        float scale = 0.7f + 0.6f * random_float();
+        placements[i] = affine::translation(at) * affine::rotation_y(360 * random_float()) * affine::scaling(vec3(scale, scale, scale));
+        kind[i] = std::min(int(random_float() * kinds), kinds - 1);
+    }
+
+    hitable *world;
+    if (instanced) {
+        instance_bvh *top = new instance_bvh();
+        int ids[kinds];
+        for (int k = 0; k < kinds; k++)
+            ids[k] = top->add_blas(firs[k]);
+        for (int i = 0; i < n; i++)
+            top->add(ids[kind[i]], placements[i]);
+        top->build();
+        world = top;
+    } else {
+        hitable **list = scene_array<hitable *>(2 * n);
+        for (int i = 0; i < n; i++) {
+            linear_bvh *fir = (linear_bvh *)firs[kind[i]];
+            affine normals = placements[i].inverse();
+            for (int part = 0; part < 2; part++) {
+                const triangle_mesh *from = (const triangle_mesh *)fir->prims[part];
+                triangle_mesh *copy = new triangle_mesh(from->mat);
+                for (int v = 0; v < from->vertices(); v++)
+                    copy->add_vertex(placements[i].point(from->positions[v]), unit_vector(normals.transposed_vector(from->normals[v])),
+                                     from->uvs[2*v], from->uvs[2*v+1]);
+                for (int t = 0; t < from->size(); t++)
+                    copy->add_triangle(from->indices[3*t], from->indices[3*t+1], from->indices[3*t+2]);
+                copy->build();
+                list[2*i + part] = copy;
+            }
+        }
+        world = new linear_bvh(list, 2 * n, 0.0, 1.0);
+    }
+    if (trees)
+        *trees = world;
+
+    float extent = 3 * side;
+    hitable **list = scene_array<hitable *>(3);
+    list[0] = world;
+    list[1] = new xz_rect(-extent, extent, -extent, extent, 0, new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73))));
+    list[2] = new sphere(vec3(0, 400, -300), 150, new diffuse_light(new constant_texture(vec3(8, 8, 8))));
+    if (lights)
+        *lights = light_list(list[2]);
+    return new hitable_list(list, 3);
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hitable.h"
 #include "material.h"
+#include "onb.h"
 
 void get_sphere_uv(const vec3& p, float& u, float& v) {
     float phi = atan2(p.z(), p.x());
@@ -11,93 +12,135 @@ void get_sphere_uv(const vec3& p, float& u, float& v) {
     v = (theta + M_PI/2) / M_PI;
 }
 
-class sphere: public hitable {
-    public:
-        sphere() {}
-        sphere(vec3 cen, float r, material *m) : center(cen), radius(r), mat_ptr(m) {};
-        virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
-        virtual bool bounding_box(float t0, float t1, aabb& box) const;
-        vec3 center;
-        float radius;
-        material *mat_ptr;
-};
-
-bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+// nearest root of the ray sphere equation in (t_min, t_max)
+inline bool sphere_root(const vec3& center, float radius, const ray& r, float t_min, float t_max, float& t) {
     vec3 oc = r.origin() - center;
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
     float c = dot(oc, oc) - radius*radius;
     float discriminant = b*b - a*c;
     if (discriminant > 0) {
-        float temp = (-b - sqrt(b*b-a*c)) / a;
+        float root = sqrt(discriminant);
+        float temp = (-b - root) / a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
+            t = temp;
             return true;
         }
-        temp = (-b + sqrt(b*b-a*c))/a;
+        temp = (-b + root) / a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv(rec.p, rec.u, rec.v);
+            t = temp;
             return true;
         }
     }
     return false;
+}
+
+// whether the sphere is hit in (t_min, t_max), with none of the hit_record work
+inline bool sphere_occludes(const vec3& center, float radius, const ray& r, float t_min, float t_max) {
+    float t;
+    return sphere_root(center, radius, r, t_min, t_max, t);
+}
+
+class sphere: public hitable {
+    public:
+        sphere() {}
+        sphere(vec3 cen, float r, material *m) : center(cen), radius(r), mat_ptr(m) {};
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb& box) const;
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+            box = to_world.sphere_box(center, radius);
+            return true;
+        }
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            return sphere_occludes(center, radius, r, t_min, t_max);
+        }
+        virtual float pdf_value(const vec3& o, const vec3& v) const;
+        virtual vec3 random(const vec3& o) const;
+        vec3 center;
+        float radius;
+        material *mat_ptr;
 };
 
+inline bool sphere::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!sphere_root(center, radius, r, t_min, t_max, rec.t))
+        return false;
+    rec.prim = this;
+    return true;
+}
+
+void sphere::surface(const ray& r, hit_record& rec) const {
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center) / radius;
+    rec.mat_ptr = mat_ptr;
+    get_sphere_uv(rec.normal, rec.u, rec.v);
+}
+
 bool sphere::bounding_box(float t0, float t1, aabb& box) const {
     box = aabb(center  - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
     return true;
 }
 
+/*
+    Lights are sampled over the cone of directions the sphere covers as seen
+    from o; from inside it every direction hits, so they are sampled uniformly.
+*/
+float sphere::pdf_value(const vec3& o, const vec3& v) const {
+    if (!occluded(ray(o, v), 0.001, FLT_MAX))
+        return 0;
+    float distance_squared = (center - o).squared_length();
+    if (distance_squared <= radius*radius)
+        return 1 / (4*M_PI);
+    float cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    float solid_angle = 2*M_PI*(1-cos_theta_max);
+    return 1 / solid_angle;
+}
+
+vec3 sphere::random(const vec3& o) const {
+    vec3 direction = center - o;
+    float distance_squared = direction.squared_length();
+    if (distance_squared <= radius*radius)
+        return random_unit_vector();
+    onb uvw(direction);
+    return uvw.local(random_to_sphere(radius, distance_squared));
+}
+
 class moving_sphere: public hitable {
     public:
         moving_sphere() {}
         moving_sphere(vec3 cen0, vec3 cen1, float t0, float t1, float r, material *m) : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m) {};
-        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
         vec3 center(float time) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+            box = surrounding_box(to_world.sphere_box(center(t0), radius), to_world.sphere_box(center(t1), radius));
+            return true;
+        }
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            return sphere_occludes(center(r.time()), radius, r, t_min, t_max);
+        }
         vec3 center0, center1;
         float time0, time1;
         float radius;
         material *mat_ptr;
 };
 
-vec3 moving_sphere::center(float time) const {
+inline vec3 moving_sphere::center(float time) const {
     return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-    vec3 oc = r.origin() - center(r.time());
-    float a = dot(r.direction(), r.direction());
-    float b = dot(oc, r.direction());
-    float c = dot(oc, oc) - radius*radius;
-    float discriminant = b*b - a*c;
-    if (discriminant > 0) {
-        float temp = (-b - sqrt(discriminant))/a;
-        if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
-            return true;
-        }
-        temp = (-b + sqrt(discriminant))/a;
-        if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
-            return true;
-        }
-    }
-    return false;
+inline bool moving_sphere::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (!sphere_root(center(r.time()), radius, r, t_min, t_max, rec.t))
+        return false;
+    rec.prim = this;
+    return true;
+}
+
+void moving_sphere::surface(const ray& r, hit_record& rec) const {
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center(r.time())) / radius;
+    rec.mat_ptr = mat_ptr;
 }
 
 bool moving_sphere::bounding_box(float t0, float t1, aabb& box) const {
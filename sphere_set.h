@@ -0,0 +1,452 @@
+#ifndef SPHERESETH
+#define SPHERESETH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "linear_bvh.h"
+#include "sphere.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPHERE_SET_X86
+#include <immintrin.h>
+#endif
+
+/*
+    Many static spheres in one primitive, for particle dumps with millions of
+    them. Centers, radii and material ids are kept as structure of arrays in
+    the depth first order of the set's own BVH, so a leaf is a contiguous run
+    of spheres that SSE or AVX2 tests 4 or 8 at a time. That costs 20 bytes a
+    sphere instead of a heap allocated sphere behind two pointers.
+
+    Spheres are added with add() or load() and the BVH is built by build()
+    before the set is rendered.
+*/
+
+const int sphere_set_max_leaf = 8;
+const float sphere_set_intersect_cost = 0.25; // per sphere, relative to a node visit, with 4 or 8 tested at once
+const int sphere_set_padding = 8; // the vector kernels may read this far past the last sphere
+
+struct sphere_set_data {
+    std::vector<float> x, y, z, radius;
+    std::vector<uint32_t> material;
+};
+
+/*
+    Leaf kernels: test count spheres from first, keep the closest hit in
+    (t_min, t_max) and return its index, or -1. Lanes past count are masked
+    off rather than padded, so leaves need no alignment.
+*/
+
+int sphere_leaf_scalar(const sphere_set_data& s, int first, int count, const ray& r, float t_min, float t_max, float& t) {
+    int best = -1;
+    for (int i = first; i < first + count; i++) {
+        if (sphere_root(vec3(s.x[i], s.y[i], s.z[i]), s.radius[i], r, t_min, t_max, t)) {
+            t_max = t;
+            best = i;
+        }
+    }
+    return best;
+}
+
+#ifdef SPHERE_SET_X86
+__attribute__((target("sse4.2")))
+int sphere_leaf_sse(const sphere_set_data& s, int first, int count, const ray& r, float t_min, float t_max, float& t) {
+    __m128 ox = _mm_set1_ps(r.origin().x()), oy = _mm_set1_ps(r.origin().y()), oz = _mm_set1_ps(r.origin().z());
+    __m128 dx = _mm_set1_ps(r.direction().x()), dy = _mm_set1_ps(r.direction().y()), dz = _mm_set1_ps(r.direction().z());
+    float a = dot(r.direction(), r.direction());
+    __m128 va = _mm_set1_ps(a);
+    __m128 inv_a = _mm_set1_ps(1.0f / a);
+    __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    __m128 best_t = _mm_set1_ps(t_max);
+    __m128 best_i = _mm_set1_ps(-1);
+    for (int g = 0; g < count; g += 4) {
+        int i = first + g;
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&s.x[i]));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&s.y[i]));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&s.z[i]));
+        __m128 rad = _mm_loadu_ps(&s.radius[i]);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(rad, rad));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+        __m128 near_t = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), root), inv_a);
+        __m128 far_t = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), b), root), inv_a);
+        __m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(near_t, _mm_set1_ps(t_min)), _mm_cmplt_ps(near_t, best_t));
+        __m128 far_ok = _mm_and_ps(_mm_cmpgt_ps(far_t, _mm_set1_ps(t_min)), _mm_cmplt_ps(far_t, best_t));
+        __m128 hit_t = _mm_blendv_ps(far_t, near_t, near_ok);
+        __m128 valid = _mm_and_ps(_mm_cmpgt_ps(disc, _mm_setzero_ps()), _mm_or_ps(near_ok, far_ok));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(lane, _mm_set1_ps(float(count - g))));
+        best_t = _mm_blendv_ps(best_t, hit_t, valid);
+        best_i = _mm_blendv_ps(best_i, _mm_add_ps(lane, _mm_set1_ps(float(g))), valid);
+    }
+    alignas(16) float ts[4], is[4];
+    _mm_store_ps(ts, best_t);
+    _mm_store_ps(is, best_i);
+    int best = -1;
+    for (int k = 0; k < 4; k++) {
+        if (is[k] >= 0 && ts[k] < t_max) {
+            t_max = ts[k];
+            best = first + int(is[k]);
+        }
+    }
+    if (best >= 0) t = t_max;
+    return best;
+}
+
+__attribute__((target("avx2")))
+int sphere_leaf_avx2(const sphere_set_data& s, int first, int count, const ray& r, float t_min, float t_max, float& t) {
+    __m256 ox = _mm256_set1_ps(r.origin().x()), oy = _mm256_set1_ps(r.origin().y()), oz = _mm256_set1_ps(r.origin().z());
+    __m256 dx = _mm256_set1_ps(r.direction().x()), dy = _mm256_set1_ps(r.direction().y()), dz = _mm256_set1_ps(r.direction().z());
+    float a = dot(r.direction(), r.direction());
+    __m256 va = _mm256_set1_ps(a);
+    __m256 inv_a = _mm256_set1_ps(1.0f / a);
+    __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 best_t = _mm256_set1_ps(t_max);
+    __m256 best_i = _mm256_set1_ps(-1);
+    for (int g = 0; g < count; g += 8) {
+        int i = first + g;
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&s.x[i]));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&s.y[i]));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&s.z[i]));
+        __m256 rad = _mm256_loadu_ps(&s.radius[i]);
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(rad, rad));
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+        __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+        __m256 near_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), root), inv_a);
+        __m256 far_t = _mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(zero, b), root), inv_a);
+        __m256 tmin = _mm256_set1_ps(t_min);
+        __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near_t, tmin, _CMP_GT_OQ), _mm256_cmp_ps(near_t, best_t, _CMP_LT_OQ));
+        __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far_t, tmin, _CMP_GT_OQ), _mm256_cmp_ps(far_t, best_t, _CMP_LT_OQ));
+        __m256 hit_t = _mm256_blendv_ps(far_t, near_t, near_ok);
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GT_OQ), _mm256_or_ps(near_ok, far_ok));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(lane, _mm256_set1_ps(float(count - g)), _CMP_LT_OQ));
+        best_t = _mm256_blendv_ps(best_t, hit_t, valid);
+        best_i = _mm256_blendv_ps(best_i, _mm256_add_ps(lane, _mm256_set1_ps(float(g))), valid);
+    }
+    alignas(32) float ts[8], is[8];
+    _mm256_store_ps(ts, best_t);
+    _mm256_store_ps(is, best_i);
+    int best = -1;
+    for (int k = 0; k < 8; k++) {
+        if (is[k] >= 0 && ts[k] < t_max) {
+            t_max = ts[k];
+            best = first + int(is[k]);
+        }
+    }
+    if (best >= 0) t = t_max;
+    return best;
+}
+#endif
+
+class sphere_set : public hitable {
+    public:
+        typedef int (*leaf_fn)(const sphere_set_data&, int, int, const ray&, float, float, float&);
+
+        sphere_set(const std::vector<material *>& m);
+        ~sphere_set() { free(nodes); }
+        void add(const vec3& center, float radius, uint32_t material_id);
+        bool load(const char *path);
+        bool save(const char *path) const;
+        void build();
+        int size() const { return count; }
+
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        // none for an empty set or before build()
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (count == 0 || !nodes)
+                return false;
+            box = nodes[0].box;
+            return true;
+        }
+
+        std::vector<material *> materials;
+        sphere_set_data spheres;
+        int count;
+        linear_bvh_node *nodes;
+        int node_count;
+        bvh_stats stats;
+        leaf_fn leaf_test;
+        const char *kernel;
+
+    private:
+        // build() pads the coordinates for the vector kernels; the padding goes before more spheres are added
+        void unpad();
+};
+
+sphere_set::sphere_set(const std::vector<material *>& m) : materials(m), count(0), nodes(NULL), node_count(0) {
+    leaf_test = sphere_leaf_scalar;
+    kernel = "scalar";
+#ifdef SPHERE_SET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        leaf_test = sphere_leaf_sse;
+        kernel = "sse4.2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        leaf_test = sphere_leaf_avx2;
+        kernel = "avx2";
+    }
+#endif
+}
+
+void sphere_set::unpad() {
+    spheres.x.resize(count);
+    spheres.y.resize(count);
+    spheres.z.resize(count);
+    spheres.radius.resize(count);
+}
+
+void sphere_set::add(const vec3& center, float radius, uint32_t material_id) {
+    unpad();
+    spheres.x.push_back(center.x());
+    spheres.y.push_back(center.y());
+    spheres.z.push_back(center.z());
+    spheres.radius.push_back(radius);
+    spheres.material.push_back(material_id);
+    count++;
+}
+
+/*
+    Sphere files are a 16 byte header, the magic "SPHS", a uint32 version (1)
+    and a uint64 sphere count, then one record per sphere: float x, y, z,
+    radius and a uint32 material id, little endian. Records are read in
+    blocks and appended to the set.
+*/
+struct sphere_file_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+};
+
+struct sphere_file_record {
+    float x, y, z, radius;
+    uint32_t material;
+};
+
+bool sphere_set::load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        std::cerr << "Error: cannot open sphere file " << path << std::endl;
+        return false;
+    }
+    sphere_file_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "SPHS", 4) != 0 || header.version != 1) {
+        std::cerr << "Error: " << path << " is not a sphere file" << std::endl;
+        fclose(f);
+        return false;
+    }
+    size_t total = count + header.count;
+    unpad();
+    spheres.x.reserve(total);
+    spheres.y.reserve(total);
+    spheres.z.reserve(total);
+    spheres.radius.reserve(total);
+    spheres.material.reserve(total);
+
+    std::vector<sphere_file_record> block(1 << 16);
+    uint64_t left = header.count;
+    while (left > 0) {
+        size_t n = fread(&block[0], sizeof(sphere_file_record), std::min<uint64_t>(left, block.size()), f);
+        if (n == 0) {
+            std::cerr << "Error: " << path << " ends after " << header.count - left << " of " << header.count << " spheres" << std::endl;
+            fclose(f);
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (block[i].material >= materials.size()) {
+                std::cerr << "Error: sphere in " << path << " uses material " << block[i].material << " of " << materials.size() << std::endl;
+                fclose(f);
+                return false;
+            }
+            add(vec3(block[i].x, block[i].y, block[i].z), block[i].radius, block[i].material);
+        }
+        left -= n;
+    }
+    fclose(f);
+    return true;
+}
+
+bool sphere_set::save(const char *path) const {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        std::cerr << "Error: cannot write sphere file " << path << std::endl;
+        return false;
+    }
+    sphere_file_header header;
+    memcpy(header.magic, "SPHS", 4);
+    header.version = 1;
+    header.count = count;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int i = 0; ok && i < count; i++) {
+        sphere_file_record record = {spheres.x[i], spheres.y[i], spheres.z[i], spheres.radius[i], spheres.material[i]};
+        ok = fwrite(&record, sizeof(record), 1, f) == 1;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        std::cerr << "Error: writing sphere file " << path << " failed" << std::endl;
+    return ok;
+}
+
+// builds the BVH and reorders the spheres so that every leaf is a contiguous run
+void sphere_set::build() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<bvh_primitive> build_prims(count);
+    shared_thread_pool().parallel_for(0, count, bvh_parallel_chunk, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            vec3 c(spheres.x[i], spheres.y[i], spheres.z[i]);
+            vec3 r(spheres.radius[i], spheres.radius[i], spheres.radius[i]);
+            build_prims[i].box = aabb(c - r, c + r);
+            build_prims[i].centroid = c;
+            build_prims[i].index = i;
+            build_prims[i].ptr = NULL;
+        }
+    });
+
+    std::vector<linear_bvh_node> out;
+    stats = bvh_stats();
+    if (count == 0) {
+        out.push_back(empty_bvh_root());
+    } else {
+        std::atomic<int> build_nodes(0);
+        bvh_build_node *root = build_bvh_tree(&build_prims[0], 0, count, 0, sphere_set_max_leaf, build_nodes, sphere_set_intersect_cost);
+        stats.build_bytes = build_prims.size()*sizeof(bvh_primitive) + build_nodes*sizeof(bvh_build_node);
+        out.reserve(build_nodes);
+        flatten_bvh(out, root, 0, root->box.area(), stats, [](int first, int n) { return first; });
+    }
+
+    // partitioning left build_prims in leaf order; move the spheres to match
+    sphere_set_data sorted;
+    std::vector<float> *from[4] = {&spheres.x, &spheres.y, &spheres.z, &spheres.radius};
+    std::vector<float> *to[4] = {&sorted.x, &sorted.y, &sorted.z, &sorted.radius};
+    for (int a = 0; a < 4; a++) {
+        to[a]->resize(count + sphere_set_padding, 0.0f);
+        shared_thread_pool().parallel_for(0, count, bvh_parallel_chunk, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+                (*to[a])[i] = (*from[a])[build_prims[i].index];
+        });
+        std::vector<float>().swap(*from[a]);
+    }
+    sorted.material.resize(count);
+    for (int i = 0; i < count; i++)
+        sorted.material[i] = spheres.material[build_prims[i].index];
+    std::swap(spheres, sorted);
+
+    free(nodes);
+    node_count = int(out.size());
+    size_t bytes = sizeof(linear_bvh_node) * node_count;
+    nodes = (linear_bvh_node *)aligned_alloc(32, (bytes + 31) & ~size_t(31));
+    memcpy(nodes, &out[0], bytes);
+
+    stats.bytes = bytes + size_t(count) * (4*sizeof(float) + sizeof(uint32_t));
+    stats.build_bytes += out.capacity()*sizeof(linear_bvh_node);
+    stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool sphere_set::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (count == 0 || !nodes)
+        return false;
+    slab_ray sr(r);
+
+    float tnear;
+    if (!slab_hit(nodes[0].box, sr, t_min, t_max, tnear))
+        return false;
+
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    int hit_index = -1;
+
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            float t;
+            int i = leaf_test(spheres, node.first_prim, node.count, r, t_min, t_max, t);
+            if (i >= 0) {
+                hit_index = i;
+                t_max = t;
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = slab_hit(nodes[near_child].box, sr, t_min, t_max, t_near);
+            bool hit_far = slab_hit(nodes[far_child].box, sr, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+
+    if (hit_index < 0)
+        return false;
+    rec.t = t_max;
+    rec.prim = this;
+    rec.index = hit_index;
+    return true;
+}
+
+void sphere_set::surface(const ray& r, hit_record& rec) const {
+    int i = rec.index;
+    vec3 center(spheres.x[i], spheres.y[i], spheres.z[i]);
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center) / spheres.radius[i];
+    rec.mat_ptr = materials[spheres.material[i]];
+    get_sphere_uv(rec.normal, rec.u, rec.v);
+}
+
+bool sphere_set::occluded(const ray& r, float t_min, float t_max) const {
+    if (count == 0 || !nodes)
+        return false;
+    slab_ray sr(r);
+
+    int stack[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    float tnear, t;
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (slab_hit(node.box, sr, t_min, t_max, tnear)) {
+            if (node.count == 0) {
+                stack[sp++] = node.second_child;
+                index++;
+                continue;
+            }
+            if (leaf_test(spheres, node.first_prim, node.count, r, t_min, t_max, t) >= 0)
+                return true;
+        }
+        if (sp == 0)
+            return false;
+        index = stack[--sp];
+    }
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef TEXTUREH
 #define TEXTUREH
 
+#include "arena.h"
+#include "random.h"
+
 inline float trilinear_interp(float c[2][2][2], float u, float v, float w) {
     float accum = 0;
     for (int i=0; i< 2; i++)
@@ -42,14 +45,14 @@ class perlin {
 static float *perlin_generate() {
     float *p = new float[256];
     for (int i=0; i < 256; ++i) {
-        p[i] = drand48();
+        p[i] = random_float();
     }
     return p;
 }
 
 void permute(int *p, int n){
     for (int i=n-1; i > 0; i--) {
-        int target = int(drand48()*(i+1));
+        int target = int(random_float()*(i+1));
         int tmp = p[i];
         p[i] = p[target];
         p[target] = tmp;
@@ -68,6 +71,9 @@ static int* perlin_generate_perm() {
 
 class texture {
     public:
+        static void *operator new(size_t bytes) { return scene_new<texture>(bytes); }
+        static void operator delete(void *p) { scene_delete(p); }
+        virtual ~texture() {}
         virtual vec3 value(float u, float v, const vec3& p) const = 0;
 };
 
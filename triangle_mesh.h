@@ -0,0 +1,942 @@
+#ifndef TRIANGLEMESHH
+#define TRIANGLEMESHH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "linear_bvh.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRIANGLE_MESH_X86
+#include <immintrin.h>
+#endif
+
+/*
+    Indexed triangle mesh in one primitive, for scanned and modelled assets
+    with millions of triangles. Vertices are shared: positions, normals and
+    texture coordinates sit in flat arrays and a triangle is three uint32
+    indices into them. Normals and texture coordinates are optional; without
+    them a hit gets the face normal and its barycentric coordinates as u, v.
+
+    build() puts the triangles in the depth first order of the mesh's own
+    BVH and copies each one's first vertex and two edges into structure of
+    arrays, so a leaf is a contiguous run that a Möller-Trumbore test checks
+    4 or 8 at a time with SSE or AVX2. OBJ and binary PLY files are read as
+    a stream straight into the arrays, without an object per triangle.
+*/
+
+const int triangle_mesh_max_leaf = 8;
+const float triangle_mesh_intersect_cost = 0.25; // per triangle, relative to a node visit, with 4 or 8 tested at once
+const int triangle_mesh_padding = 8; // the vector kernels may read this far past the last triangle
+
+// first vertex and the edges to the other two, per triangle in leaf order
+struct triangle_mesh_data {
+    std::vector<float> v0[3], e1[3], e2[3];
+};
+
+/*
+    Leaf kernels: test count triangles from first, keep the closest hit in
+    (t_min, t_max) and return its index and barycentric coordinates, or -1.
+    A ray in the plane of a triangle divides by a zero determinant, and the
+    infinite or NaN coordinates that gives fail the range checks.
+*/
+
+inline bool triangle_hit(const vec3& v0, const vec3& e1, const vec3& e2, const ray& r, float t_min, float t_max, float& t, float& u, float& v) {
+    vec3 p = cross(r.direction(), e2);
+    float inv_det = 1.0f / dot(e1, p);
+    vec3 s = r.origin() - v0;
+    float bu = dot(s, p) * inv_det;
+    vec3 q = cross(s, e1);
+    float bv = dot(r.direction(), q) * inv_det;
+    float bt = dot(e2, q) * inv_det;
+    if (!(bu >= 0.0f && bv >= 0.0f && bu + bv <= 1.0f && bt > t_min && bt < t_max))
+        return false;
+    t = bt;
+    u = bu;
+    v = bv;
+    return true;
+}
+
+int triangle_leaf_scalar(const triangle_mesh_data& m, int first, int count, const ray& r, float t_min, float t_max, float& t, float& u, float& v) {
+    int best = -1;
+    for (int i = first; i < first + count; i++) {
+        vec3 v0(m.v0[0][i], m.v0[1][i], m.v0[2][i]);
+        vec3 e1(m.e1[0][i], m.e1[1][i], m.e1[2][i]);
+        vec3 e2(m.e2[0][i], m.e2[1][i], m.e2[2][i]);
+        if (triangle_hit(v0, e1, e2, r, t_min, t_max, t, u, v)) {
+            t_max = t;
+            best = i;
+        }
+    }
+    return best;
+}
+
+#ifdef TRIANGLE_MESH_X86
+__attribute__((target("sse4.2")))
+int triangle_leaf_sse(const triangle_mesh_data& m, int first, int count, const ray& r, float t_min, float t_max, float& t, float& u, float& v) {
+    __m128 ox = _mm_set1_ps(r.origin().x()), oy = _mm_set1_ps(r.origin().y()), oz = _mm_set1_ps(r.origin().z());
+    __m128 dx = _mm_set1_ps(r.direction().x()), dy = _mm_set1_ps(r.direction().y()), dz = _mm_set1_ps(r.direction().z());
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 tmin = _mm_set1_ps(t_min);
+    __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    __m128 best_t = _mm_set1_ps(t_max);
+    __m128 best_i = _mm_set1_ps(-1);
+    __m128 best_u = zero, best_v = zero;
+    for (int g = 0; g < count; g += 4) {
+        int i = first + g;
+        __m128 e1x = _mm_loadu_ps(&m.e1[0][i]), e1y = _mm_loadu_ps(&m.e1[1][i]), e1z = _mm_loadu_ps(&m.e1[2][i]);
+        __m128 e2x = _mm_loadu_ps(&m.e2[0][i]), e2y = _mm_loadu_ps(&m.e2[1][i]), e2z = _mm_loadu_ps(&m.e2[2][i]);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inv_det = _mm_div_ps(one, det);
+        __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&m.v0[0][i]));
+        __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&m.v0[1][i]));
+        __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&m.v0[2][i]));
+        __m128 bu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 bv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+        __m128 bt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+        __m128 valid = _mm_and_ps(_mm_cmpge_ps(bu, zero), _mm_cmpge_ps(bv, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(bu, bv), one));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(bt, tmin), _mm_cmplt_ps(bt, best_t)));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(lane, _mm_set1_ps(float(count - g))));
+        best_t = _mm_blendv_ps(best_t, bt, valid);
+        best_u = _mm_blendv_ps(best_u, bu, valid);
+        best_v = _mm_blendv_ps(best_v, bv, valid);
+        best_i = _mm_blendv_ps(best_i, _mm_add_ps(lane, _mm_set1_ps(float(g))), valid);
+    }
+    alignas(16) float ts[4], is[4], us[4], vs[4];
+    _mm_store_ps(ts, best_t);
+    _mm_store_ps(is, best_i);
+    _mm_store_ps(us, best_u);
+    _mm_store_ps(vs, best_v);
+    int best = -1;
+    for (int k = 0; k < 4; k++) {
+        if (is[k] >= 0 && ts[k] < t_max) {
+            t_max = ts[k];
+            best = k;
+        }
+    }
+    if (best < 0)
+        return -1;
+    t = ts[best];
+    u = us[best];
+    v = vs[best];
+    return first + int(is[best]);
+}
+
+__attribute__((target("avx2")))
+int triangle_leaf_avx2(const triangle_mesh_data& m, int first, int count, const ray& r, float t_min, float t_max, float& t, float& u, float& v) {
+    __m256 ox = _mm256_set1_ps(r.origin().x()), oy = _mm256_set1_ps(r.origin().y()), oz = _mm256_set1_ps(r.origin().z());
+    __m256 dx = _mm256_set1_ps(r.direction().x()), dy = _mm256_set1_ps(r.direction().y()), dz = _mm256_set1_ps(r.direction().z());
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    __m256 tmin = _mm256_set1_ps(t_min);
+    __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 best_t = _mm256_set1_ps(t_max);
+    __m256 best_i = _mm256_set1_ps(-1);
+    __m256 best_u = zero, best_v = zero;
+    for (int g = 0; g < count; g += 8) {
+        int i = first + g;
+        __m256 e1x = _mm256_loadu_ps(&m.e1[0][i]), e1y = _mm256_loadu_ps(&m.e1[1][i]), e1z = _mm256_loadu_ps(&m.e1[2][i]);
+        __m256 e2x = _mm256_loadu_ps(&m.e2[0][i]), e2y = _mm256_loadu_ps(&m.e2[1][i]), e2z = _mm256_loadu_ps(&m.e2[2][i]);
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+        __m256 inv_det = _mm256_div_ps(one, det);
+        __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&m.v0[0][i]));
+        __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&m.v0[1][i]));
+        __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&m.v0[2][i]));
+        __m256 bu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv_det);
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        __m256 bv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+        __m256 bt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(bu, zero, _CMP_GE_OQ), _mm256_cmp_ps(bv, zero, _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(bu, bv), one, _CMP_LE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(bt, tmin, _CMP_GT_OQ), _mm256_cmp_ps(bt, best_t, _CMP_LT_OQ)));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(lane, _mm256_set1_ps(float(count - g)), _CMP_LT_OQ));
+        best_t = _mm256_blendv_ps(best_t, bt, valid);
+        best_u = _mm256_blendv_ps(best_u, bu, valid);
+        best_v = _mm256_blendv_ps(best_v, bv, valid);
+        best_i = _mm256_blendv_ps(best_i, _mm256_add_ps(lane, _mm256_set1_ps(float(g))), valid);
+    }
+    alignas(32) float ts[8], is[8], us[8], vs[8];
+    _mm256_store_ps(ts, best_t);
+    _mm256_store_ps(is, best_i);
+    _mm256_store_ps(us, best_u);
+    _mm256_store_ps(vs, best_v);
+    int best = -1;
+    for (int k = 0; k < 8; k++) {
+        if (is[k] >= 0 && ts[k] < t_max) {
+            t_max = ts[k];
+            best = k;
+        }
+    }
+    if (best < 0)
+        return -1;
+    t = ts[best];
+    u = us[best];
+    v = vs[best];
+    return first + int(is[best]);
+}
+#endif
+
+class triangle_mesh : public hitable {
+    public:
+        typedef int (*leaf_fn)(const triangle_mesh_data&, int, int, const ray&, float, float, float&, float&, float&);
+
+        triangle_mesh(material *m);
+        ~triangle_mesh() { free(nodes); }
+        uint32_t add_vertex(const vec3& p);
+        uint32_t add_vertex(const vec3& p, const vec3& n, float u, float v);
+        void add_triangle(uint32_t a, uint32_t b, uint32_t c);
+        // .obj or .ply, by the extension of path; appends to the mesh
+        bool load(const char *path);
+        bool save(const char *path) const;
+        // scales and moves the vertices so the longest side of the bounds is size, centred on center
+        void fit(const vec3& center, float size);
+        void build();
+        int size() const { return count; }
+        int vertices() const { return int(positions.size()); }
+
+        size_t index_bytes() const { return indices.size() * sizeof(uint32_t); }
+        size_t vertex_bytes() const { return (positions.size() + normals.size()) * sizeof(vec3) + uvs.size() * sizeof(float); }
+        size_t triangle_bytes() const { return size_t(count) * 9 * sizeof(float); }
+        size_t node_bytes() const { return size_t(node_count) * sizeof(linear_bvh_node); }
+
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual void surface(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        // none for a mesh without triangles or before build()
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (count == 0 || !nodes)
+                return false;
+            box = nodes[0].box;
+            return true;
+        }
+        // around the transformed vertices, which is exact
+        virtual bool transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const;
+
+        material *mat;
+        std::vector<vec3> positions;
+        std::vector<vec3> normals; // empty, or one per vertex; (0,0,0) where a file gave none
+        std::vector<float> uvs;    // empty, or two per vertex
+        std::vector<uint32_t> indices;
+        triangle_mesh_data triangles;
+        int count;
+        linear_bvh_node *nodes;
+        int node_count;
+        bvh_stats stats;
+        double load_seconds;
+        size_t load_bytes;
+        leaf_fn leaf_test;
+        const char *kernel;
+
+    private:
+        uint32_t push_vertex(const vec3& p, const vec3 *n, const float *uv);
+        bool load_obj(const char *path);
+        bool load_ply(const char *path);
+        bool save_obj(const char *path) const;
+        bool save_ply(const char *path) const;
+};
+
+triangle_mesh::triangle_mesh(material *m) : mat(m), count(0), nodes(NULL), node_count(0), load_seconds(0), load_bytes(0) {
+    leaf_test = triangle_leaf_scalar;
+    kernel = "scalar";
+#ifdef TRIANGLE_MESH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        leaf_test = triangle_leaf_sse;
+        kernel = "sse4.2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        leaf_test = triangle_leaf_avx2;
+        kernel = "avx2";
+    }
+#endif
+}
+
+// keeps normals and uvs one per vertex once any vertex has them
+uint32_t triangle_mesh::push_vertex(const vec3& p, const vec3 *n, const float *uv) {
+    uint32_t index = uint32_t(positions.size());
+    positions.push_back(p);
+    if (n || !normals.empty()) {
+        normals.resize(index, vec3(0,0,0));
+        normals.push_back(n ? *n : vec3(0,0,0));
+    }
+    if (uv || !uvs.empty()) {
+        uvs.resize(2*size_t(index), 0.0f);
+        uvs.push_back(uv ? uv[0] : 0.0f);
+        uvs.push_back(uv ? uv[1] : 0.0f);
+    }
+    return index;
+}
+
+uint32_t triangle_mesh::add_vertex(const vec3& p) {
+    return push_vertex(p, NULL, NULL);
+}
+
+uint32_t triangle_mesh::add_vertex(const vec3& p, const vec3& n, float u, float v) {
+    float uv[2] = {u, v};
+    return push_vertex(p, &n, uv);
+}
+
+void triangle_mesh::add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+    indices.push_back(a);
+    indices.push_back(b);
+    indices.push_back(c);
+    count++;
+}
+
+bool has_extension(const char *path, const char *extension) {
+    size_t n = strlen(path), k = strlen(extension);
+    return n >= k && strcasecmp(path + n - k, extension) == 0;
+}
+
+bool triangle_mesh::load(const char *path) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool ok;
+    if (has_extension(path, ".obj")) {
+        ok = load_obj(path);
+    } else if (has_extension(path, ".ply")) {
+        ok = load_ply(path);
+    } else {
+        std::cerr << "Error: " << path << " is neither an .obj nor a .ply file" << std::endl;
+        return false;
+    }
+    load_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ok;
+}
+
+bool triangle_mesh::save(const char *path) const {
+    if (has_extension(path, ".obj"))
+        return save_obj(path);
+    if (has_extension(path, ".ply"))
+        return save_ply(path);
+    std::cerr << "Error: " << path << " is neither an .obj nor a .ply file" << std::endl;
+    return false;
+}
+
+// the next line of f without its line break; false at the end of the file
+bool read_mesh_line(FILE *f, std::string& line) {
+    char buffer[4096];
+    line.clear();
+    while (fgets(buffer, sizeof(buffer), f)) {
+        line += buffer;
+        if (!line.empty() && line[line.size()-1] == '\n')
+            break;
+    }
+    if (line.empty())
+        return false;
+    while (!line.empty() && (line[line.size()-1] == '\n' || line[line.size()-1] == '\r'))
+        line.erase(line.size()-1);
+    return true;
+}
+
+/*
+    OBJ: v, vt and vn lines and f lines of any number of corners, which are
+    split into a fan of triangles. Indices may be negative, counting back
+    from the last element read. A corner with only a position uses one
+    vertex per position; corners that add a texture coordinate or normal get
+    one vertex per distinct combination, found through a hash map that only
+    lives while the file is read. Other statements are skipped.
+*/
+struct obj_corner {
+    int v, vt, vn;
+    bool operator==(const obj_corner& c) const { return v == c.v && vt == c.vt && vn == c.vn; }
+};
+
+struct obj_corner_hash {
+    size_t operator()(const obj_corner& c) const {
+        return (size_t(uint32_t(c.v)) * 0x9e3779b1u) ^ (size_t(uint32_t(c.vt)) * 0x85ebca6bu) ^ (size_t(uint32_t(c.vn)) * 0xc2b2ae35u);
+    }
+};
+
+// index of an OBJ reference: 1 based, or negative to count back from n; -1 if out of range
+int obj_index(long i, size_t n) {
+    long resolved = i > 0 ? i - 1 : long(n) + i;
+    return i != 0 && resolved >= 0 && resolved < long(n) ? int(resolved) : -1;
+}
+
+bool triangle_mesh::load_obj(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        std::cerr << "Error: cannot open mesh file " << path << std::endl;
+        return false;
+    }
+    std::vector<vec3> obj_positions, obj_normals;
+    std::vector<float> obj_uvs;
+    std::vector<uint32_t> position_vertex; // vertex of a position used on its own, or ~0
+    std::unordered_map<obj_corner, uint32_t, obj_corner_hash> corner_vertex;
+    std::vector<uint32_t> face;
+    std::string line;
+    long line_number = 0;
+    bool ok = true;
+    while (ok && read_mesh_line(f, line)) {
+        line_number++;
+        load_bytes += line.size() + 1;
+        const char *s = line.c_str();
+        while (*s == ' ' || *s == '\t')
+            s++;
+        char *end;
+        if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            float x = strtof(s + 2, &end), y = strtof(end, &end), z = strtof(end, &end);
+            obj_positions.push_back(vec3(x, y, z));
+            position_vertex.push_back(~0u);
+        } else if (s[0] == 'v' && s[1] == 'n') {
+            float x = strtof(s + 2, &end), y = strtof(end, &end), z = strtof(end, &end);
+            obj_normals.push_back(vec3(x, y, z));
+        } else if (s[0] == 'v' && s[1] == 't') {
+            float u = strtof(s + 2, &end), v = strtof(end, &end);
+            obj_uvs.push_back(u);
+            obj_uvs.push_back(v);
+        } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            face.clear();
+            s++;
+            for (;;) {
+                while (*s == ' ' || *s == '\t')
+                    s++;
+                if (!*s)
+                    break;
+                obj_corner c = {obj_index(strtol(s, &end, 10), obj_positions.size()), -2, -2};
+                bool parsed = end != s;
+                s = end;
+                if (*s == '/') {
+                    s++;
+                    if (*s != '/') {
+                        c.vt = obj_index(strtol(s, &end, 10), obj_uvs.size() / 2);
+                        parsed = parsed && end != s;
+                        s = end;
+                    }
+                    if (*s == '/') {
+                        s++;
+                        c.vn = obj_index(strtol(s, &end, 10), obj_normals.size());
+                        parsed = parsed && end != s;
+                        s = end;
+                    }
+                }
+                if (!parsed || c.v < 0 || c.vt == -1 || c.vn == -1 || (*s && *s != ' ' && *s != '\t')) {
+                    std::cerr << "Error: bad face corner on line " << line_number << " of " << path << std::endl;
+                    ok = false;
+                    break;
+                }
+                if (c.vt < 0 && c.vn < 0) {
+                    if (position_vertex[c.v] == ~0u)
+                        position_vertex[c.v] = push_vertex(obj_positions[c.v], NULL, NULL);
+                    face.push_back(position_vertex[c.v]);
+                } else {
+                    std::unordered_map<obj_corner, uint32_t, obj_corner_hash>::iterator it = corner_vertex.find(c);
+                    if (it == corner_vertex.end()) {
+                        uint32_t vertex = push_vertex(obj_positions[c.v], c.vn >= 0 ? &obj_normals[c.vn] : NULL, c.vt >= 0 ? &obj_uvs[2*c.vt] : NULL);
+                        it = corner_vertex.insert(std::make_pair(c, vertex)).first;
+                    }
+                    face.push_back(it->second);
+                }
+            }
+            if (ok && face.size() < 3) {
+                std::cerr << "Error: face with " << face.size() << " corners on line " << line_number << " of " << path << std::endl;
+                ok = false;
+            }
+            for (size_t k = 1; ok && k + 1 < face.size(); k++)
+                add_triangle(face[0], face[k], face[k+1]);
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+/*
+    Binary PLY, little or big endian: a vertex element with x, y, z and
+    optionally nx, ny, nz and u, v (or s, t), and a face element with a list
+    of vertex_indices, split into fans. Properties of any scalar type are
+    converted; other elements and properties are read past. The body goes
+    through a 64 KB buffer one value at a time.
+*/
+enum ply_type { ply_int8, ply_uint8, ply_int16, ply_uint16, ply_int32, ply_uint32, ply_float32, ply_float64, ply_unknown };
+
+ply_type ply_type_of(const char *name) {
+    const char *names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+                              {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+    for (int t = 0; t < ply_unknown; t++)
+        if (strcmp(name, names[t][0]) == 0 || strcmp(name, names[t][1]) == 0)
+            return ply_type(t);
+    return ply_unknown;
+}
+
+struct ply_property {
+    std::string name;
+    ply_type type;
+    ply_type count_type; // ply_unknown unless the property is a list
+};
+
+struct ply_element {
+    std::string name;
+    uint64_t count;
+    std::vector<ply_property> properties;
+};
+
+struct ply_stream {
+    FILE *f;
+    bool swap;
+    std::vector<char> buffer;
+    size_t pos, end;
+    size_t consumed;
+
+    ply_stream(FILE *file, bool swap_bytes) : f(file), swap(swap_bytes), buffer(1 << 16), pos(0), end(0), consumed(0) {}
+
+    bool read(void *dst, size_t n) {
+        char *out = (char *)dst;
+        while (n > 0) {
+            if (pos == end) {
+                end = fread(&buffer[0], 1, buffer.size(), f);
+                pos = 0;
+                consumed += end;
+                if (end == 0)
+                    return false;
+            }
+            size_t k = std::min(n, end - pos);
+            memcpy(out, &buffer[pos], k);
+            pos += k;
+            out += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    bool value(ply_type type, double& out) {
+        static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+        unsigned char bytes[8];
+        int n = sizes[type];
+        if (!read(bytes, n))
+            return false;
+        if (swap)
+            std::reverse(bytes, bytes + n);
+        switch (type) {
+            case ply_int8: { int8_t x; memcpy(&x, bytes, 1); out = x; break; }
+            case ply_uint8: { uint8_t x; memcpy(&x, bytes, 1); out = x; break; }
+            case ply_int16: { int16_t x; memcpy(&x, bytes, 2); out = x; break; }
+            case ply_uint16: { uint16_t x; memcpy(&x, bytes, 2); out = x; break; }
+            case ply_int32: { int32_t x; memcpy(&x, bytes, 4); out = x; break; }
+            case ply_uint32: { uint32_t x; memcpy(&x, bytes, 4); out = x; break; }
+            case ply_float32: { float x; memcpy(&x, bytes, 4); out = x; break; }
+            default: { double x; memcpy(&x, bytes, 8); out = x; break; }
+        }
+        return true;
+    }
+};
+
+bool triangle_mesh::load_ply(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        std::cerr << "Error: cannot open mesh file " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    std::vector<ply_element> elements;
+    bool binary = false, big_endian = false, ok = read_mesh_line(f, line) && line == "ply";
+    size_t header_bytes = line.size() + 1;
+    while (ok && read_mesh_line(f, line) && line != "end_header") {
+        header_bytes += line.size() + 1;
+        char word[64], type[64], count_type[64], name[256];
+        unsigned long long n;
+        if (sscanf(line.c_str(), "format %63s", word) == 1) {
+            binary = strcmp(word, "binary_little_endian") == 0 || strcmp(word, "binary_big_endian") == 0;
+            big_endian = strcmp(word, "binary_big_endian") == 0;
+        } else if (sscanf(line.c_str(), "element %255s %llu", name, &n) == 2) {
+            ply_element e = {name, n, std::vector<ply_property>()};
+            elements.push_back(e);
+        } else if (sscanf(line.c_str(), "property list %63s %63s %255s", count_type, type, name) == 3 && !elements.empty()) {
+            ply_property p = {name, ply_type_of(type), ply_type_of(count_type)};
+            ok = p.type != ply_unknown && p.count_type != ply_unknown;
+            elements.back().properties.push_back(p);
+        } else if (sscanf(line.c_str(), "property %63s %255s", type, name) == 2 && !elements.empty()) {
+            ply_property p = {name, ply_type_of(type), ply_unknown};
+            ok = p.type != ply_unknown;
+            elements.back().properties.push_back(p);
+        }
+    }
+    if (!ok || line != "end_header" || !binary) {
+        std::cerr << "Error: " << path << (ok && line == "end_header" ? " is not a binary PLY file" : " has a bad PLY header") << std::endl;
+        fclose(f);
+        return false;
+    }
+
+    uint16_t endian_probe = 1;
+    bool host_big_endian = *(unsigned char *)&endian_probe == 0;
+    ply_stream in(f, big_endian != host_big_endian);
+    uint32_t base = uint32_t(positions.size());
+    uint64_t vertex_count = 0;
+    for (const ply_element& e : elements)
+        if (e.name == "vertex")
+            vertex_count = e.count;
+    std::vector<uint32_t> face;
+    for (size_t k = 0; ok && k < elements.size(); k++) {
+        const ply_element& e = elements[k];
+        // where each property goes: 0-2 position, 3-5 normal, 6-7 uv, -1 nowhere
+        std::vector<int> slot(e.properties.size(), -1);
+        const char *slot_names[][3] = {{"x"}, {"y"}, {"z"}, {"nx"}, {"ny"}, {"nz"},
+                                       {"u", "s", "texture_u"}, {"v", "t", "texture_v"}};
+        bool has_normal = false, has_uv = false;
+        if (e.name == "vertex") {
+            for (size_t p = 0; p < e.properties.size(); p++) {
+                for (int s = 0; s < 8; s++)
+                    for (int a = 0; a < 3; a++)
+                        if (slot_names[s][a] && e.properties[p].name == slot_names[s][a] && e.properties[p].count_type == ply_unknown)
+                            slot[p] = s;
+                has_normal = has_normal || (slot[p] >= 3 && slot[p] < 6);
+                has_uv = has_uv || slot[p] >= 6;
+            }
+            positions.reserve(positions.size() + e.count);
+        }
+        for (uint64_t i = 0; ok && i < e.count; i++) {
+            double values[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            for (size_t p = 0; ok && p < e.properties.size(); p++) {
+                const ply_property& prop = e.properties[p];
+                double x;
+                if (prop.count_type == ply_unknown) {
+                    ok = in.value(prop.type, x);
+                    if (slot[p] >= 0)
+                        values[slot[p]] = x;
+                    continue;
+                }
+                double n;
+                ok = in.value(prop.count_type, n);
+                bool corners = e.name == "face" && (prop.name == "vertex_indices" || prop.name == "vertex_index");
+                face.clear();
+                for (int c = 0; ok && c < int(n); c++) {
+                    ok = in.value(prop.type, x);
+                    if (corners && ok && (x < 0 || x >= double(vertex_count))) {
+                        std::cerr << "Error: face " << i << " of " << path << " uses vertex " << x << " of " << vertex_count << std::endl;
+                        fclose(f);
+                        return false;
+                    }
+                    face.push_back(base + uint32_t(x));
+                }
+                for (size_t c = 1; ok && corners && c + 1 < face.size(); c++)
+                    add_triangle(face[0], face[c], face[c+1]);
+            }
+            if (ok && e.name == "vertex") {
+                vec3 n(values[3], values[4], values[5]);
+                float uv[2] = {float(values[6]), float(values[7])};
+                push_vertex(vec3(values[0], values[1], values[2]), has_normal ? &n : NULL, has_uv ? uv : NULL);
+            }
+            if (!ok)
+                std::cerr << "Error: " << path << " ends in " << e.name << " " << i << " of " << e.count << std::endl;
+        }
+    }
+    load_bytes += header_bytes + in.consumed;
+    fclose(f);
+    return ok;
+}
+
+bool triangle_mesh::save_obj(const char *path) const {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        std::cerr << "Error: cannot write mesh file " << path << std::endl;
+        return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; ok && i < positions.size(); i++) {
+        ok = fprintf(f, "v %.9g %.9g %.9g\n", positions[i].x(), positions[i].y(), positions[i].z()) > 0;
+        if (ok && !normals.empty())
+            ok = fprintf(f, "vn %.9g %.9g %.9g\n", normals[i].x(), normals[i].y(), normals[i].z()) > 0;
+        if (ok && !uvs.empty())
+            ok = fprintf(f, "vt %.9g %.9g\n", uvs[2*i], uvs[2*i+1]) > 0;
+    }
+    for (int i = 0; ok && i < count; i++) {
+        uint32_t a = indices[3*i] + 1, b = indices[3*i+1] + 1, c = indices[3*i+2] + 1;
+        if (!normals.empty() && !uvs.empty())
+            ok = fprintf(f, "f %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, a, b, b, b, c, c, c) > 0;
+        else if (!normals.empty())
+            ok = fprintf(f, "f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c) > 0;
+        else if (!uvs.empty())
+            ok = fprintf(f, "f %u/%u %u/%u %u/%u\n", a, a, b, b, c, c) > 0;
+        else
+            ok = fprintf(f, "f %u %u %u\n", a, b, c) > 0;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        std::cerr << "Error: writing mesh file " << path << " failed" << std::endl;
+    return ok;
+}
+
+// little endian floats and uint8 counted uint32 index lists
+bool triangle_mesh::save_ply(const char *path) const {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        std::cerr << "Error: cannot write mesh file " << path << std::endl;
+        return false;
+    }
+    fprintf(f, "ply\nformat binary_little_endian 1.0\nelement vertex %zu\n", positions.size());
+    fprintf(f, "property float x\nproperty float y\nproperty float z\n");
+    if (!normals.empty())
+        fprintf(f, "property float nx\nproperty float ny\nproperty float nz\n");
+    if (!uvs.empty())
+        fprintf(f, "property float u\nproperty float v\n");
+    fprintf(f, "element face %d\nproperty list uchar uint vertex_indices\nend_header\n", count);
+    bool ok = true;
+    std::vector<char> block;
+    block.reserve(1 << 16);
+    for (size_t i = 0; ok && i < positions.size(); i++) {
+        float record[8];
+        int n = 0;
+        for (int a = 0; a < 3; a++)
+            record[n++] = positions[i][a];
+        for (int a = 0; !normals.empty() && a < 3; a++)
+            record[n++] = normals[i][a];
+        for (int a = 0; !uvs.empty() && a < 2; a++)
+            record[n++] = uvs[2*i+a];
+        block.insert(block.end(), (char *)record, (char *)(record + n));
+        if (block.size() >= (1 << 16) - sizeof(record) || i + 1 == positions.size()) {
+            ok = fwrite(&block[0], 1, block.size(), f) == block.size();
+            block.clear();
+        }
+    }
+    for (int i = 0; ok && i < count; i++) {
+        char record[13];
+        record[0] = 3;
+        memcpy(record + 1, &indices[3*i], 12);
+        block.insert(block.end(), record, record + sizeof(record));
+        if (block.size() >= (1 << 16) - sizeof(record) || i + 1 == count) {
+            ok = fwrite(&block[0], 1, block.size(), f) == block.size();
+            block.clear();
+        }
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        std::cerr << "Error: writing mesh file " << path << " failed" << std::endl;
+    return ok;
+}
+
+void triangle_mesh::fit(const vec3& center, float size) {
+    if (positions.empty())
+        return;
+    vec3 lo = positions[0], hi = positions[0];
+    for (const vec3& p : positions) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = ffmin(lo[a], p[a]);
+            hi[a] = ffmax(hi[a], p[a]);
+        }
+    }
+    vec3 extent = hi - lo;
+    float longest = ffmax(extent.x(), ffmax(extent.y(), extent.z()));
+    float scale = longest > 0 ? size / longest : 1;
+    vec3 middle = 0.5f * (lo + hi);
+    for (vec3& p : positions)
+        p = center + scale * (p - middle);
+}
+
+bool triangle_mesh::transformed_bounding_box(const affine& to_world, float t0, float t1, aabb& box) const {
+    if (count == 0)
+        return false;
+    vec3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (const vec3& p : positions) {
+        vec3 q = to_world.point(p);
+        for (int a = 0; a < 3; a++) {
+            lo[a] = ffmin(lo[a], q[a]);
+            hi[a] = ffmax(hi[a], q[a]);
+        }
+    }
+    box = aabb(lo, hi);
+    return true;
+}
+
+// builds the BVH, reorders the triangles so that every leaf is a contiguous run and fills in triangles
+void triangle_mesh::build() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<bvh_primitive> build_prims(count);
+    shared_thread_pool().parallel_for(0, count, bvh_parallel_chunk, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            const vec3& a = positions[indices[3*i]];
+            const vec3& b = positions[indices[3*i+1]];
+            const vec3& c = positions[indices[3*i+2]];
+            vec3 lo(ffmin(a.x(), ffmin(b.x(), c.x())), ffmin(a.y(), ffmin(b.y(), c.y())), ffmin(a.z(), ffmin(b.z(), c.z())));
+            vec3 hi(ffmax(a.x(), ffmax(b.x(), c.x())), ffmax(a.y(), ffmax(b.y(), c.y())), ffmax(a.z(), ffmax(b.z(), c.z())));
+            build_prims[i].box = aabb(lo, hi);
+            build_prims[i].centroid = build_prims[i].box.center();
+            build_prims[i].index = i;
+            build_prims[i].ptr = NULL;
+        }
+    });
+
+    std::vector<linear_bvh_node> out;
+    stats = bvh_stats();
+    if (count == 0) {
+        out.push_back(empty_bvh_root());
+    } else {
+        std::atomic<int> build_nodes(0);
+        bvh_build_node *root = build_bvh_tree(&build_prims[0], 0, count, 0, triangle_mesh_max_leaf, build_nodes, triangle_mesh_intersect_cost);
+        stats.build_bytes = build_prims.size()*sizeof(bvh_primitive) + build_nodes*sizeof(bvh_build_node);
+        out.reserve(build_nodes);
+        flatten_bvh(out, root, 0, root->box.area(), stats, [](int first, int n) { return first; });
+    }
+
+    // partitioning left build_prims in leaf order; move the triangles to match
+    std::vector<uint32_t> sorted(indices.size());
+    for (int a = 0; a < 3; a++) {
+        triangles.v0[a].assign(count + triangle_mesh_padding, 0.0f);
+        triangles.e1[a].assign(count + triangle_mesh_padding, 0.0f);
+        triangles.e2[a].assign(count + triangle_mesh_padding, 0.0f);
+    }
+    shared_thread_pool().parallel_for(0, count, bvh_parallel_chunk, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            const uint32_t *tri = &indices[3*build_prims[i].index];
+            sorted[3*i] = tri[0];
+            sorted[3*i+1] = tri[1];
+            sorted[3*i+2] = tri[2];
+            const vec3& v0 = positions[tri[0]];
+            vec3 e1 = positions[tri[1]] - v0;
+            vec3 e2 = positions[tri[2]] - v0;
+            for (int a = 0; a < 3; a++) {
+                triangles.v0[a][i] = v0[a];
+                triangles.e1[a][i] = e1[a];
+                triangles.e2[a][i] = e2[a];
+            }
+        }
+    });
+    indices.swap(sorted);
+
+    free(nodes);
+    node_count = int(out.size());
+    size_t bytes = sizeof(linear_bvh_node) * node_count;
+    nodes = (linear_bvh_node *)aligned_alloc(32, (bytes + 31) & ~size_t(31));
+    memcpy(nodes, &out[0], bytes);
+
+    stats.bytes = node_bytes() + index_bytes() + vertex_bytes() + triangle_bytes();
+    stats.build_bytes += out.capacity()*sizeof(linear_bvh_node) + sorted.capacity()*sizeof(uint32_t);
+    stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool triangle_mesh::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    if (count == 0 || !nodes)
+        return false;
+    slab_ray sr(r);
+
+    float tnear;
+    if (!slab_hit(nodes[0].box, sr, t_min, t_max, tnear))
+        return false;
+
+    int stack[bvh_max_depth];
+    float stack_t[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    int hit_index = -1;
+    float hit_u = 0, hit_v = 0;
+
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            float t, u, v;
+            int i = leaf_test(triangles, node.first_prim, node.count, r, t_min, t_max, t, u, v);
+            if (i >= 0) {
+                hit_index = i;
+                hit_u = u;
+                hit_v = v;
+                t_max = t;
+            }
+        } else {
+            int near_child = index + 1;
+            int far_child = node.second_child;
+            float t_near, t_far;
+            bool hit_near = slab_hit(nodes[near_child].box, sr, t_min, t_max, t_near);
+            bool hit_far = slab_hit(nodes[far_child].box, sr, t_min, t_max, t_far);
+            if (hit_near && hit_far) {
+                if (t_far < t_near) {
+                    std::swap(near_child, far_child);
+                    std::swap(t_near, t_far);
+                }
+                stack[sp] = far_child;
+                stack_t[sp++] = t_far;
+                index = near_child;
+                continue;
+            } else if (hit_near) {
+                index = near_child;
+                continue;
+            } else if (hit_far) {
+                index = far_child;
+                continue;
+            }
+        }
+
+        while (sp > 0 && stack_t[sp-1] > t_max)
+            sp--;
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+
+    if (hit_index < 0)
+        return false;
+    rec.t = t_max;
+    rec.u = hit_u;
+    rec.v = hit_v;
+    rec.prim = this;
+    rec.index = hit_index;
+    return true;
+}
+
+// rec.u and rec.v are the barycentric coordinates of the second and third vertex
+void triangle_mesh::surface(const ray& r, hit_record& rec) const {
+    int i = rec.index;
+    const uint32_t *tri = &indices[3*i];
+    float b1 = rec.u, b2 = rec.v, b0 = 1.0f - b1 - b2;
+    rec.p = r.point_at_parameter(rec.t);
+    vec3 shading(0,0,0);
+    if (!normals.empty())
+        shading = b0*normals[tri[0]] + b1*normals[tri[1]] + b2*normals[tri[2]];
+    if (shading.squared_length() > 0) {
+        rec.normal = unit_vector(shading);
+    } else {
+        vec3 e1(triangles.e1[0][i], triangles.e1[1][i], triangles.e1[2][i]);
+        vec3 e2(triangles.e2[0][i], triangles.e2[1][i], triangles.e2[2][i]);
+        rec.normal = unit_vector(cross(e1, e2));
+    }
+    if (!uvs.empty()) {
+        rec.u = b0*uvs[2*tri[0]] + b1*uvs[2*tri[1]] + b2*uvs[2*tri[2]];
+        rec.v = b0*uvs[2*tri[0]+1] + b1*uvs[2*tri[1]+1] + b2*uvs[2*tri[2]+1];
+    }
+    rec.mat_ptr = mat;
+}
+
+bool triangle_mesh::occluded(const ray& r, float t_min, float t_max) const {
+    if (count == 0 || !nodes)
+        return false;
+    slab_ray sr(r);
+
+    int stack[bvh_max_depth];
+    int sp = 0;
+    int index = 0;
+    float tnear, t, u, v;
+    for (;;) {
+        const linear_bvh_node& node = nodes[index];
+        if (slab_hit(node.box, sr, t_min, t_max, tnear)) {
+            if (node.count == 0) {
+                stack[sp++] = node.second_child;
+                index++;
+                continue;
+            }
+            if (leaf_test(triangles, node.first_prim, node.count, r, t_min, t_max, t, u, v) >= 0)
+                return true;
+        }
+        if (sp == 0)
+            return false;
+        index = stack[--sp];
+    }
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef VEC3AH
+#define VEC3AH
+
+#include "vec3.h"
+
+#if defined(__SSE2__)
+#define VEC3A_SSE
+#include <immintrin.h>
+#endif
+
+/*
+    vec3 padded to four floats and kept in one SSE register, for code that
+    does long chains of vector arithmetic on values already in registers.
+    SSE2 is picked at compile time where the target has it (every x86-64),
+    plain scalar code is used elsewhere. The fourth lane is never read back,
+    so operations are free to leave anything in it. Conversions to and from
+    vec3 are explicit to keep mixed expressions unambiguous.
+
+    It is not a drop in replacement for vec3: over arrays, g++ already does
+    as well with the scalar vec3 code (see ./bench vec), so the renderer
+    keeps vec3 and the wide kernels in wide_bvh.h do the SIMD work.
+*/
+
+class alignas(16) vec3a {
+    public:
+        vec3a() {}
+#ifdef VEC3A_SSE
+        explicit vec3a(__m128 v) : m(v) {}
+        vec3a(float e0, float e1, float e2) : m(_mm_set_ps(0, e2, e1, e0)) {}
+        explicit vec3a(const vec3& v) : m(_mm_set_ps(0, v.z(), v.y(), v.x())) {}
+        inline float x() const { return _mm_cvtss_f32(m); }
+        inline float y() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(1,1,1,1))); }
+        inline float z() const { return _mm_cvtss_f32(_mm_movehl_ps(m, m)); }
+        inline float operator[](int i) const { return e[i]; }
+
+        union {
+            __m128 m;
+            float e[4];
+        };
+#else
+        vec3a(float e0, float e1, float e2) { e[0] = e0; e[1] = e1; e[2] = e2; e[3] = 0; }
+        explicit vec3a(const vec3& v) { e[0] = v.x(); e[1] = v.y(); e[2] = v.z(); e[3] = 0; }
+        inline float x() const { return e[0]; }
+        inline float y() const { return e[1]; }
+        inline float z() const { return e[2]; }
+        inline float operator[](int i) const { return e[i]; }
+
+        float e[4];
+#endif
+        inline vec3 to_vec3() const { return vec3(x(), y(), z()); }
+
+        inline vec3a& operator+=(const vec3a& v);
+        inline vec3a& operator-=(const vec3a& v);
+        inline vec3a& operator*=(const vec3a& v);
+        inline vec3a& operator*=(float t);
+        inline vec3a& operator/=(float t);
+
+        inline float length() const;
+        inline float squared_length() const;
+};
+
+#ifdef VEC3A_SSE
+
+inline vec3a operator+(const vec3a& a, const vec3a& b) { return vec3a(_mm_add_ps(a.m, b.m)); }
+inline vec3a operator-(const vec3a& a, const vec3a& b) { return vec3a(_mm_sub_ps(a.m, b.m)); }
+inline vec3a operator*(const vec3a& a, const vec3a& b) { return vec3a(_mm_mul_ps(a.m, b.m)); }
+inline vec3a operator/(const vec3a& a, const vec3a& b) { return vec3a(_mm_div_ps(a.m, b.m)); }
+inline vec3a operator*(float t, const vec3a& v) { return vec3a(_mm_mul_ps(_mm_set1_ps(t), v.m)); }
+inline vec3a operator*(const vec3a& v, float t) { return vec3a(_mm_mul_ps(v.m, _mm_set1_ps(t))); }
+inline vec3a operator/(const vec3a& v, float t) { return vec3a(_mm_mul_ps(v.m, _mm_set1_ps(1.0f / t))); }
+inline vec3a operator-(const vec3a& v) { return vec3a(_mm_xor_ps(v.m, _mm_set1_ps(-0.0f))); }
+inline vec3a vmin(const vec3a& a, const vec3a& b) { return vec3a(_mm_min_ps(a.m, b.m)); }
+inline vec3a vmax(const vec3a& a, const vec3a& b) { return vec3a(_mm_max_ps(a.m, b.m)); }
+
+// shuffles and adds; _mm_dp_ps measured slower even where SSE4.1 is enabled
+inline float dot(const vec3a& a, const vec3a& b) {
+    __m128 p = _mm_mul_ps(a.m, b.m);
+    __m128 sum = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1,1,1,1)));
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(p, p)));
+}
+
+inline vec3a cross(const vec3a& a, const vec3a& b) {
+    // a * b.yzx - a.yzx * b gives the cross product in zxy order
+    __m128 a_yzx = _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(3,0,2,1));
+    __m128 b_yzx = _mm_shuffle_ps(b.m, b.m, _MM_SHUFFLE(3,0,2,1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a.m, b_yzx), _mm_mul_ps(a_yzx, b.m));
+    return vec3a(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1)));
+}
+
+inline vec3a& vec3a::operator+=(const vec3a& v) { m = _mm_add_ps(m, v.m); return *this; }
+inline vec3a& vec3a::operator-=(const vec3a& v) { m = _mm_sub_ps(m, v.m); return *this; }
+inline vec3a& vec3a::operator*=(const vec3a& v) { m = _mm_mul_ps(m, v.m); return *this; }
+inline vec3a& vec3a::operator*=(float t) { m = _mm_mul_ps(m, _mm_set1_ps(t)); return *this; }
+inline vec3a& vec3a::operator/=(float t) { m = _mm_mul_ps(m, _mm_set1_ps(1.0f / t)); return *this; }
+
+inline float vec3a::length() const { return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(dot(*this, *this)))); }
+
+#else
+
+inline vec3a operator+(const vec3a& a, const vec3a& b) { return vec3a(a.e[0]+b.e[0], a.e[1]+b.e[1], a.e[2]+b.e[2]); }
+inline vec3a operator-(const vec3a& a, const vec3a& b) { return vec3a(a.e[0]-b.e[0], a.e[1]-b.e[1], a.e[2]-b.e[2]); }
+inline vec3a operator*(const vec3a& a, const vec3a& b) { return vec3a(a.e[0]*b.e[0], a.e[1]*b.e[1], a.e[2]*b.e[2]); }
+inline vec3a operator/(const vec3a& a, const vec3a& b) { return vec3a(a.e[0]/b.e[0], a.e[1]/b.e[1], a.e[2]/b.e[2]); }
+inline vec3a operator*(float t, const vec3a& v) { return vec3a(t*v.e[0], t*v.e[1], t*v.e[2]); }
+inline vec3a operator*(const vec3a& v, float t) { return vec3a(t*v.e[0], t*v.e[1], t*v.e[2]); }
+inline vec3a operator/(const vec3a& v, float t) { return v * (1.0f / t); }
+inline vec3a operator-(const vec3a& v) { return vec3a(-v.e[0], -v.e[1], -v.e[2]); }
+inline vec3a vmin(const vec3a& a, const vec3a& b) { return vec3a(fminf(a.e[0], b.e[0]), fminf(a.e[1], b.e[1]), fminf(a.e[2], b.e[2])); }
+inline vec3a vmax(const vec3a& a, const vec3a& b) { return vec3a(fmaxf(a.e[0], b.e[0]), fmaxf(a.e[1], b.e[1]), fmaxf(a.e[2], b.e[2])); }
+
+inline float dot(const vec3a& a, const vec3a& b) {
+    return a.e[0]*b.e[0] + a.e[1]*b.e[1] + a.e[2]*b.e[2];
+}
+
+inline vec3a cross(const vec3a& a, const vec3a& b) {
+    return vec3a(a.e[1]*b.e[2] - a.e[2]*b.e[1],
+                 a.e[2]*b.e[0] - a.e[0]*b.e[2],
+                 a.e[0]*b.e[1] - a.e[1]*b.e[0]);
+}
+
+inline vec3a& vec3a::operator+=(const vec3a& v) { *this = *this + v; return *this; }
+inline vec3a& vec3a::operator-=(const vec3a& v) { *this = *this - v; return *this; }
+inline vec3a& vec3a::operator*=(const vec3a& v) { *this = *this * v; return *this; }
+inline vec3a& vec3a::operator*=(float t) { *this = *this * t; return *this; }
+inline vec3a& vec3a::operator/=(float t) { *this = *this / t; return *this; }
+
+inline float vec3a::length() const { return sqrtf(dot(*this, *this)); }
+
+#endif
+
+inline float vec3a::squared_length() const { return dot(*this, *this); }
+
+inline vec3a unit_vector(const vec3a& v) {
+    return v / v.length();
+}
+
+inline std::ostream& operator<<(std::ostream& os, const vec3a& v) {
+    return os << v.to_vec3();
+}
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "render.h"
+
+/*
+    Wavefront integrator: the same estimator as color(), but instead of
+    following one path to its end it advances a whole wave of paths (every
+    sample of every pixel of a tile) one bounce at a time, in stages:
+
+        extend  intersect every live ray with the world
+        shade   emission, MIS weights, scattering, light samples, Russian
+                roulette for every ray that hit something
+        shadow  occlusion tests for the light samples shade made
+
+    Path state lives in one array per field, indexed by path. Before extend
+    and shadow the live rays are sorted by direction octant and the cell
+    of their origin, so consecutive rays walk the same BVH nodes (and with
+    settings.packets go through it as packets); before shade they are sorted
+    by material so each material's code runs over a run of hits. The sorts
+    are counting sorts over a few hundred bins: a full sort on finer keys
+    costs more than the coherence wins back.
+
+    Every path carries its own generator, seeded from its pixel and sample,
+    and sums its own radiance, which goes into its pixel in sample order
+    once the wave is done. So the sorts never change what is added in what
+    order, and images depend only on settings.seed. They are not the same images as
+    render() makes, whose samples share a generator per pixel.
+*/
+
+const int wavefront_bins = 512;
+
+/*
+    Bin of a ray: its direction octant above a 6 bit Morton code of the
+    cell (4 per axis) that holds its origin within box.
+*/
+inline int ray_bin(const vec3& origin, const vec3& direction, const aabb& box) {
+    int cell_key = 0;
+    for (int a = 0; a < 3; a++) {
+        float extent = box._max[a] - box._min[a];
+        float f = extent > 0 ? (origin[a] - box._min[a]) / extent : 0;
+        int cell = int(ffmin(ffmax(f, 0.0f), 0.999f) * 4);
+        cell_key |= (cell & 1) << a | (cell & 2) << (a + 2);
+    }
+    int octant = (direction.x() < 0) | (direction.y() < 0) << 1 | (direction.z() < 0) << 2;
+    return octant << 6 | cell_key;
+}
+
+/*
+    Materials spread over the bins by their id. Binning by address would
+    make the order of paths, and so which paths share a packet, change
+    from run to run with where the materials were allocated.
+*/
+inline int material_bin(const material *m) {
+    return int((uint32_t(m->id) * 2654435761u) >> 23);
+}
+
+/*
+    Counting sort of the path indices in queue by bin(index), which is in
+    [0, wavefront_bins). Linear in the queue length and stable, so paths
+    keep their order within a bin.
+*/
+template <class F>
+void bin_queue(std::vector<int>& queue, std::vector<int>& scratch, F bin) {
+    int start[wavefront_bins + 1] = {0};
+    scratch.resize(queue.size() * 2);
+    int *bins = &scratch[queue.size()];
+    for (size_t i = 0; i < queue.size(); i++) {
+        bins[i] = bin(queue[i]);
+        start[bins[i] + 1]++;
+    }
+    for (int b = 0; b < wavefront_bins; b++)
+        start[b + 1] += start[b];
+    for (size_t i = 0; i < queue.size(); i++)
+        scratch[start[bins[i]]++] = queue[i];
+    std::copy(scratch.begin(), scratch.begin() + queue.size(), queue.begin());
+}
+
+struct wavefront_state {
+    // per path
+    std::vector<vec3> origin;
+    std::vector<vec3> direction;
+    std::vector<float> time;
+    std::vector<vec3> throughput;
+    std::vector<float> bsdf_pdf; // pdf of the bounce that made the ray; 0 from the camera and specular bounces
+    std::vector<vec3> radiance;  // what the path has gathered so far
+    std::vector<pcg32> rng;
+    std::vector<hit_record> rec;
+    std::vector<char> hit;
+
+    // light samples waiting for their shadow ray, one per entry of shadows
+    std::vector<vec3> shadow_origin;
+    std::vector<vec3> shadow_direction;
+    std::vector<float> shadow_time;
+    std::vector<float> shadow_t_max;
+    std::vector<vec3> shadow_contribution;
+    std::vector<int> shadow_path;
+    std::vector<int> shadows;
+
+    std::vector<int> live;          // paths with a ray to extend
+    std::vector<int> scratch;
+
+    void resize(int paths) {
+        origin.resize(paths);
+        direction.resize(paths);
+        time.resize(paths);
+        throughput.resize(paths);
+        bsdf_pdf.resize(paths);
+        radiance.resize(paths);
+        rng.resize(paths);
+        rec.resize(paths);
+        hit.resize(paths);
+        shadow_origin.resize(paths);
+        shadow_direction.resize(paths);
+        shadow_time.resize(paths);
+        shadow_t_max.resize(paths);
+        shadow_contribution.resize(paths);
+        shadow_path.resize(paths);
+        live.clear();
+        shadows.clear();
+    }
+
+    ray path_ray(int p) const { return ray(origin[p], direction[p], time[p]); }
+    ray shadow_ray(int s) const { return ray(shadow_origin[s], shadow_direction[s], shadow_time[s]); }
+};
+
+// camera rays for every sample of every pixel of t
+void wavefront_generate(wavefront_state& w, camera& cam, const render_settings& settings, const tile& t) {
+    pcg32& rng = thread_rng();
+    int width = t.x1 - t.x0;
+    int pixels = width * (t.y1 - t.y0);
+    w.resize(pixels * settings.ns);
+    for (int j=t.y0; j < t.y1; j++) {
+        for (int i=t.x0; i < t.x1; i++) {
+            int pixel = (j - t.y0)*width + (i - t.x0);
+            for (int s=0; s < settings.ns; s++) {
+                int p = pixel*settings.ns + s;
+                seed_thread_rng((uint64_t(j)*settings.nx + i)*settings.ns + s, settings.seed);
+                float u = float(i + random_float()) / float(settings.nx);
+                float v = float(j + random_float()) / float(settings.ny);
+                ray r = cam.get_ray(u, v);
+                w.origin[p] = r.origin();
+                w.direction[p] = r.direction();
+                w.time[p] = r.time();
+                w.throughput[p] = vec3(1,1,1);
+                w.bsdf_pdf[p] = 0;
+                w.radiance[p] = vec3(0,0,0);
+                w.rng[p] = rng;
+                w.live.push_back(p);
+            }
+        }
+    }
+}
+
+/*
+    Closest hits for the live paths. Hits stay deferred (rec.prim) until
+    shade, which only finishes the ones it needs. Shapes that draw random
+    numbers while intersecting use the generator of the path being traced,
+    or of a packet's first path.
+*/
+void wavefront_extend(wavefront_state& w, hitable *world, const aabb& bounds, const render_settings& settings) {
+    pcg32& rng = thread_rng();
+    if (settings.wave_sorting)
+        bin_queue(w.live, w.scratch, [&](int p) { return ray_bin(w.origin[p], w.direction[p], bounds); });
+    size_t k = 0;
+    if (settings.packets) {
+        hit_record rec[packet_size];
+        for (; k + packet_size <= w.live.size(); k += packet_size) {
+            ray_packet packet;
+            for (int i = 0; i < packet_size; i++)
+                packet.set(i, w.path_ray(w.live[k + i]), FLT_MAX);
+            packet.prepare();
+            rng = w.rng[w.live[k]];
+            int mask = world->intersect_packet(packet, 0.001, rec);
+            w.rng[w.live[k]] = rng;
+            for (int i = 0; i < packet_size; i++) {
+                int p = w.live[k + i];
+                w.hit[p] = (mask >> i) & 1;
+                if (w.hit[p]) w.rec[p] = rec[i];
+            }
+        }
+    }
+    for (; k < w.live.size(); k++) {
+        int p = w.live[k];
+        rng = w.rng[p];
+        w.hit[p] = world->intersect(w.path_ray(p), 0.001, FLT_MAX, w.rec[p]);
+        w.rng[p] = rng;
+    }
+}
+
+/*
+    One bounce of color() for every live path that hit something: adds its
+    emission, queues a light sample and either continues the path with the
+    scattered ray or drops it.
+*/
+void wavefront_shade(wavefront_state& w, hitable *lights, const render_settings& settings, int depth) {
+    pcg32& rng = thread_rng();
+    bool sample_lights = lights && settings.light_sampling;
+    int n = 0;
+    for (int p : w.live)
+        if (w.hit[p]) w.live[n++] = p;
+    w.live.resize(n);
+    // finishing the hits first puts the material pointers in place to sort by
+    for (int p : w.live)
+        hitable::finish_surface(w.path_ray(p), w.rec[p]);
+    if (settings.wave_sorting)
+        bin_queue(w.live, w.scratch, [&](int p) { return material_bin(w.rec[p].mat_ptr); });
+
+    n = 0;
+    for (int p : w.live) {
+        rng = w.rng[p];
+        ray r = w.path_ray(p);
+        const hit_record& rec = w.rec[p];
+        vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+        if (sample_lights && w.bsdf_pdf[p] > 0 && !is_black(emitted))
+            emitted *= bounce_weight(lights, r, rec.t, w.bsdf_pdf[p]);
+        w.radiance[p] += w.throughput[p] * emitted;
+
+        ray scattered_ray;
+        vec3 attenuation;
+        bool alive = depth < settings.max_depth && rec.mat_ptr->scatter(r, rec, attenuation, scattered_ray);
+        if (alive) {
+            float bsdf_pdf = rec.mat_ptr->scattering_pdf(r, rec, scattered_ray);
+            if (sample_lights && bsdf_pdf > 0) {
+                ray shadow_ray(rec.p, lights->random(rec.p), r.time());
+                float light_pdf = lights->pdf_value(shadow_ray.origin(), shadow_ray.direction());
+                float f_pdf = rec.mat_ptr->scattering_pdf(r, rec, shadow_ray);
+                hit_record light_rec;
+                if (light_pdf > 0 && f_pdf > 0 && lights->hit(shadow_ray, 0.001, FLT_MAX, light_rec)) {
+                    vec3 light = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+                    int s = int(w.shadows.size());
+                    w.shadow_origin[s] = shadow_ray.origin();
+                    w.shadow_direction[s] = shadow_ray.direction();
+                    w.shadow_time[s] = shadow_ray.time();
+                    w.shadow_t_max[s] = light_rec.t * (1 - 1e-4f);
+                    w.shadow_contribution[s] = w.throughput[p] * attenuation * light * (f_pdf / light_pdf * power_heuristic(light_pdf, f_pdf));
+                    w.shadow_path[s] = p;
+                    w.shadows.push_back(s);
+                }
+            }
+
+            w.throughput[p] *= attenuation;
+            if (depth + 1 >= settings.rr_start_depth) {
+                const vec3& throughput = w.throughput[p];
+                float survive = ffmin(1.0f, ffmax(throughput.x(), ffmax(throughput.y(), throughput.z())));
+                alive = random_float() < survive;
+                w.throughput[p] /= survive;
+            }
+            w.origin[p] = scattered_ray.origin();
+            w.direction[p] = scattered_ray.direction();
+            w.time[p] = scattered_ray.time();
+            w.bsdf_pdf[p] = bsdf_pdf;
+        }
+        w.rng[p] = rng;
+        if (alive)
+            w.live[n++] = p;
+    }
+    w.live.resize(n);
+}
+
+/*
+    Adds the light samples whose shadow rays reach the light. Like extend,
+    shapes that draw random numbers while testing use the generator of the
+    sample's path, or of a packet's first path.
+*/
+void wavefront_shadow(wavefront_state& w, hitable *world, const aabb& bounds, const render_settings& settings) {
+    pcg32& rng = thread_rng();
+    if (settings.wave_sorting)
+        bin_queue(w.shadows, w.scratch, [&](int s) { return ray_bin(w.shadow_origin[s], w.shadow_direction[s], bounds); });
+    size_t k = 0;
+    if (settings.packets) {
+        for (; k + packet_size <= w.shadows.size(); k += packet_size) {
+            ray_packet packet;
+            for (int i = 0; i < packet_size; i++)
+                packet.set(i, w.shadow_ray(w.shadows[k + i]), w.shadow_t_max[w.shadows[k + i]]);
+            packet.prepare();
+            int first = w.shadow_path[w.shadows[k]];
+            rng = w.rng[first];
+            int blocked = world->occluded_packet(packet, 0.001);
+            w.rng[first] = rng;
+            for (int i = 0; i < packet_size; i++) {
+                int s = w.shadows[k + i];
+                if (!((blocked >> i) & 1))
+                    w.radiance[w.shadow_path[s]] += w.shadow_contribution[s];
+            }
+        }
+    }
+    for (; k < w.shadows.size(); k++) {
+        int s = w.shadows[k];
+        int p = w.shadow_path[s];
+        rng = w.rng[p];
+        if (!world->occluded(w.shadow_ray(s), 0.001, w.shadow_t_max[s]))
+            w.radiance[p] += w.shadow_contribution[s];
+        w.rng[p] = rng;
+    }
+    w.shadows.clear();
+}
+
+/*
+    Renders like render(), a wave per tile. Tiles are made large enough to
+    hold about settings.wave_size paths so sorting has something to work
+    with; each thread reuses its own wave state from tile to tile.
+*/
+render_stats render_wavefront(hitable *world, hitable *lights, camera& cam, const render_settings& settings, unsigned char *image) {
+    const int nx = settings.nx;
+    // rays are binned by where they start within the world's box; without one, only by direction
+    aabb bounds;
+    if (!world->bounding_box(0, 1, bounds))
+        bounds = aabb(vec3(0,0,0), vec3(0,0,0));
+    int tile_size = std::max(settings.tile_size, int(sqrt(double(settings.wave_size) / settings.ns)));
+
+    std::atomic<uint64_t> total_rays(0);
+    render_stats stats;
+    stats.load = parallel_for_tiles(nx, settings.ny, tile_size, [&](const tile& t){
+        static thread_local wavefront_state w;
+        uint64_t rays = 0;
+        wavefront_generate(w, cam, settings, t);
+        for (int depth = 0; !w.live.empty(); depth++) {
+            rays += w.live.size();
+            wavefront_extend(w, world, bounds, settings);
+            wavefront_shade(w, lights, settings, depth);
+            rays += w.shadows.size();
+            wavefront_shadow(w, world, bounds, settings);
+        }
+        int width = t.x1 - t.x0;
+        for (int j=t.y0; j < t.y1; j++) {
+            for (int i=t.x0; i < t.x1; i++) {
+                int first = ((j - t.y0)*width + (i - t.x0)) * settings.ns;
+                vec3 col(0,0,0);
+                for (int s=0; s < settings.ns; s++)
+                    col += w.radiance[first + s];
+                write_pixel(image, nx, i, j, col, settings.ns);
+            }
+        }
+        total_rays += rays;
+    }, settings.threads);
+    stats.paths = uint64_t(nx) * settings.ny * settings.ns;
+    stats.rays = total_rays;
+    return stats;
+}
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef WIDEBVHH
+#define WIDEBVHH
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "linear_bvh.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WIDE_BVH_X86
+#include <immintrin.h>
+#endif
+
+/*
+    Wide BVH with W (4 or 8) children per node. It is collapsed from the binary
+    SAH tree by repeatedly opening the child with the largest surface area.
+    The child boxes are kept as structure of arrays so one SSE or AVX2 sequence
+    tests a ray against all of them; the kernel is picked at runtime from what
+    the CPU supports.
+*/
+
+// a multiple of 32 bytes, so the bounds of nodes in the aligned_alloc'ed array can be loaded aligned; see linear_bvh_node for why the type is not alignas(32)
+template <int W>
+struct wide_bvh_node {
+    float bounds[6][W]; // min x, y, z then max x, y, z, one lane per child
+    int child[W];       // node index, or the first primitive for leaves
+    int count[W];       // primitives in a leaf child, 0 for nodes, -1 for empty lanes
+};
+static_assert(sizeof(wide_bvh_node<4>) % 32 == 0 && sizeof(wide_bvh_node<8>) % 32 == 0, "wide nodes must keep 32 byte alignment in arrays");
+
+// a ray prepared for slab tests against SoA bounds
+struct wide_ray {
+    float org[3];
+    float inv_dir[3];
+    int near_plane[3]; // row of bounds holding the entry plane on each axis
+    int far_plane[3];
+
+    wide_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            org[a] = r.origin()[a];
+            inv_dir[a] = 1.0f / r.direction()[a];
+            bool negative = inv_dir[a] < 0.0f;
+            near_plane[a] = negative ? a + 3 : a;
+            far_plane[a] = negative ? a : a + 3;
+        }
+    }
+};
+
+/*
+    Box test kernels: return a bit per child the ray enters within [tmin, tmax]
+    and store the entry distances in tnear. Empty lanes have min > max, so with
+    planes picked by direction sign they never pass. NaNs from 0 * inf are
+    dropped because min/max are called with the axis value first.
+*/
+
+template <int W>
+int box_test_scalar(const float (*bounds)[W], const wide_ray& r, float tmin, float tmax, float *tnear) {
+    int mask = 0;
+    for (int i = 0; i < W; i++) {
+        float tn = tmin, tf = tmax;
+        for (int a = 0; a < 3; a++) {
+            tn = ffmax((bounds[r.near_plane[a]][i] - r.org[a]) * r.inv_dir[a], tn);
+            tf = ffmin((bounds[r.far_plane[a]][i] - r.org[a]) * r.inv_dir[a], tf);
+        }
+        tnear[i] = tn;
+        if (tn <= tf) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef WIDE_BVH_X86
+template <int W>
+__attribute__((target("sse4.2")))
+int box_test_sse(const float (*bounds)[W], const wide_ray& r, float tmin, float tmax, float *tnear) {
+    int mask = 0;
+    for (int g = 0; g < W; g += 4) {
+        __m128 tn = _mm_set1_ps(tmin);
+        __m128 tf = _mm_set1_ps(tmax);
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_set1_ps(r.org[a]);
+            __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+            __m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bounds[r.near_plane[a]][g]), o), inv);
+            __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bounds[r.far_plane[a]][g]), o), inv);
+            tn = _mm_max_ps(n, tn);
+            tf = _mm_min_ps(f, tf);
+        }
+        _mm_storeu_ps(tnear + g, tn);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << g;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+int box_test8_avx2(const float (*bounds)[8], const wide_ray& r, float tmin, float tmax, float *tnear) {
+    __m256 tn = _mm256_set1_ps(tmin);
+    __m256 tf = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        __m256 o = _mm256_set1_ps(r.org[a]);
+        __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+        __m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.near_plane[a]]), o), inv);
+        __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.far_plane[a]]), o), inv);
+        tn = _mm256_max_ps(n, tn);
+        tf = _mm256_min_ps(f, tf);
+    }
+    _mm256_storeu_ps(tnear, tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+}
+
+// only the 8 wide tree has an AVX2 kernel
+inline bool use_avx2_box_test(int (*&test)(const float (*)[4], const wide_ray&, float, float, float *)) {
+    return false;
+}
+
+inline bool use_avx2_box_test(int (*&test)(const float (*)[8], const wide_ray&, float, float, float *)) {
+    test = box_test8_avx2;
+    return true;
+}
+#endif
+
+template <int W>
+class wide_bvh : public hitable {
+    public:
+        typedef int (*box_test_fn)(const float (*)[W], const wide_ray&, float, float, float *);
+
+        wide_bvh(hitable **l, int n, float time0, float time1, int max_leaf_size = 4);
+        ~wide_bvh() { free(nodes); }
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(float t0, float t1, aabb& b) const {
+            b = box;
+            return !prims.empty();
+        }
+        int collapse(std::vector<wide_bvh_node<W> >& out, const linear_bvh& binary, int index);
+
+        wide_bvh_node<W> *nodes;
+        int node_count;
+        std::vector<hitable *> prims;
+        aabb box;
+        box_test_fn box_test;
+        const char *kernel;
+};
+
+template <int W>
+wide_bvh<W>::wide_bvh(hitable **l, int n, float time0, float time1, int max_leaf_size) {
+    linear_bvh binary(l, n, time0, time1, max_leaf_size);
+    prims = binary.prims;
+    box = binary.nodes[0].box;
+
+    std::vector<wide_bvh_node<W> > out;
+    out.reserve(binary.node_count / (W - 1) + 1);
+    if (binary.nodes[0].count > 0 || binary.prims.empty()) {
+        // a single leaf still needs a node above it, and nothing gets a node of empty lanes
+        wide_bvh_node<W> root;
+        for (int i = 0; i < W; i++) {
+            for (int a = 0; a < 3; a++) {
+                root.bounds[a][i] = FLT_MAX;
+                root.bounds[a+3][i] = -FLT_MAX;
+            }
+            root.child[i] = 0;
+            root.count[i] = -1;
+        }
+        if (!binary.prims.empty()) {
+            for (int a = 0; a < 3; a++) {
+                root.bounds[a][0] = box._min[a];
+                root.bounds[a+3][0] = box._max[a];
+            }
+            root.child[0] = binary.nodes[0].first_prim;
+            root.count[0] = binary.nodes[0].count;
+        }
+        out.push_back(root);
+    } else {
+        collapse(out, binary, 0);
+    }
+
+    node_count = int(out.size());
+    size_t bytes = sizeof(wide_bvh_node<W>) * node_count;
+    nodes = (wide_bvh_node<W> *)aligned_alloc(32, (bytes + 31) & ~size_t(31));
+    memcpy(nodes, &out[0], bytes);
+
+    box_test = box_test_scalar<W>;
+    kernel = "scalar";
+#ifdef WIDE_BVH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        box_test = box_test_sse<W>;
+        kernel = "sse4.2";
+    }
+    if (__builtin_cpu_supports("avx2") && use_avx2_box_test(box_test))
+        kernel = "avx2";
+#endif
+}
+
+/*
+    Emits the wide node for binary interior node index and returns its position.
+    Children are opened largest area first until W of them are collected.
+*/
+template <int W>
+int wide_bvh<W>::collapse(std::vector<wide_bvh_node<W> >& out, const linear_bvh& binary, int index) {
+    int children[W];
+    int n = 2;
+    children[0] = index + 1;
+    children[1] = binary.nodes[index].second_child;
+    while (n < W) {
+        int best = -1;
+        float best_area = -1;
+        for (int i = 0; i < n; i++) {
+            const linear_bvh_node& c = binary.nodes[children[i]];
+            if (c.count == 0 && c.box.area() > best_area) {
+                best = i;
+                best_area = c.box.area();
+            }
+        }
+        if (best < 0) break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[n++] = binary.nodes[opened].second_child;
+    }
+
+    int position = int(out.size());
+    out.push_back(wide_bvh_node<W>());
+    for (int i = 0; i < W; i++) {
+        int child = 0, count = -1;
+        aabb b(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+        if (i < n) {
+            const linear_bvh_node& c = binary.nodes[children[i]];
+            b = c.box;
+            if (c.count > 0) {
+                child = c.first_prim;
+                count = c.count;
+            } else {
+                child = collapse(out, binary, children[i]);
+                count = 0;
+            }
+        }
+        wide_bvh_node<W>& node = out[position];
+        for (int a = 0; a < 3; a++) {
+            node.bounds[a][i] = b._min[a];
+            node.bounds[a+3][i] = b._max[a];
+        }
+        node.child[i] = child;
+        node.count[i] = count;
+    }
+    return position;
+}
+
+template <int W>
+bool wide_bvh<W>::intersect(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    wide_ray wr(r);
+    int stack[bvh_max_depth * W];
+    float stack_t[bvh_max_depth * W];
+    int sp = 0;
+    stack[sp] = 0;
+    stack_t[sp++] = t_min;
+    bool hit_anything = false;
+
+    while (sp > 0) {
+        sp--;
+        if (stack_t[sp] > t_max)
+            continue;
+        const wide_bvh_node<W>& node = nodes[stack[sp]];
+        alignas(32) float tnear[W];
+        int mask = box_test(node.bounds, wr, t_min, t_max, tnear);
+
+        // leaves are intersected right away, nodes pushed farthest first
+        int order[W];
+        int n = 0;
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (node.count[i] > 0) {
+                for (int p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+                    if (prims[p]->intersect(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+            } else if (node.count[i] == 0) {
+                int j = n++;
+                while (j > 0 && tnear[order[j-1]] < tnear[i]) {
+                    order[j] = order[j-1];
+                    j--;
+                }
+                order[j] = i;
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            stack[sp] = node.child[order[k]];
+            stack_t[sp++] = tnear[order[k]];
+        }
+    }
+    return hit_anything;
+}
+
+template <int W>
+bool wide_bvh<W>::occluded(const ray& r, float t_min, float t_max) const {
+    wide_ray wr(r);
+    int stack[bvh_max_depth * W];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0) {
+        const wide_bvh_node<W>& node = nodes[stack[--sp]];
+        alignas(32) float tnear[W];
+        int mask = box_test(node.bounds, wr, t_min, t_max, tnear);
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (node.count[i] > 0) {
+                for (int p = node.child[i]; p < node.child[i] + node.count[i]; p++)
+                    if (prims[p]->occluded(r, t_min, t_max))
+                        return true;
+            } else if (node.count[i] == 0) {
+                stack[sp++] = node.child[i];
+            }
+        }
+    }
+    return false;
+}
+
+typedef wide_bvh<4> bvh4;
+typedef wide_bvh<8> bvh8;
+
+#endif